@@ -27,6 +27,15 @@ if(USE_OPENMP)
   find_package(OpenMP REQUIRED)
   list(APPEND Caffe_LINKER_LIBS PRIVATE ${OpenMP_CXX_FLAGS})
   list(APPEND Caffe_COMPILE_OPTIONS PRIVATE ${OpenMP_CXX_FLAGS})
+  list(APPEND Caffe_DEFINITIONS PRIVATE -DOGN_NUM_THREADS=${OGN_NUM_THREADS})
+endif()
+
+# ---[ OGN octree backend
+if(USE_SORTED_OCTREE)
+  list(APPEND Caffe_DEFINITIONS PUBLIC -DUSE_SORTED_OCTREE)
+endif()
+if(USE_64BIT_KEYS)
+  list(APPEND Caffe_DEFINITIONS PUBLIC -DUSE_64BIT_KEYS)
 endif()
 
 # ---[ Google-glog
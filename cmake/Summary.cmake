@@ -119,6 +119,12 @@ function(caffe_print_configuration_summary)
   caffe_status("  USE_LMDB          :   ${USE_LMDB}")
   caffe_status("  USE_NCCL          :   ${USE_NCCL}")
   caffe_status("  ALLOW_LMDB_NOLOCK :   ${ALLOW_LMDB_NOLOCK}")
+  caffe_status("  USE_SORTED_OCTREE :   ${USE_SORTED_OCTREE}")
+  caffe_status("  USE_64BIT_KEYS    :   ${USE_64BIT_KEYS}")
+  caffe_status("  USE_OPENMP        :   ${USE_OPENMP}")
+  if(USE_OPENMP)
+    caffe_status("  OGN_NUM_THREADS   :   ${OGN_NUM_THREADS}")
+  endif()
   caffe_status("")
   caffe_status("Dependencies:")
   caffe_status("  BLAS              : " APPLE THEN "Yes (vecLib)" ELSE "Yes (${BLAS})")
@@ -7,6 +7,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/im2col.hpp"
+#include "caffe/util/int8_gemm.hpp"
 
 namespace caffe {
 
@@ -40,6 +41,12 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype*
       weights);
   void backward_cpu_bias(Dtype* bias, const Dtype* input);
+  // The int8 versions of forward_cpu_gemm and backward_cpu_gemm for
+  // inference, with the weights set by quantize_weights_int8. The weights are
+  // only quantized again after they changed.
+  void quantize_weights_int8();
+  void forward_cpu_gemm_int8(const Dtype* input, Dtype* output);
+  void backward_cpu_gemm_int8(const Dtype* input, Dtype* output);
 
 #ifndef CPU_ONLY
   void forward_gpu_gemm(const Dtype* col_input, const Dtype* weights,
@@ -92,6 +99,7 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   bool bias_term_;
   bool is_1x1_;
   bool force_nd_im2col_;
+  bool int8_;
 
  private:
   // wrap im2col/col2im so we don't have to remember the (long) argument lists
@@ -167,6 +175,7 @@ class BaseConvolutionLayer : public Layer<Dtype> {
 
   Blob<Dtype> col_buffer_;
   Blob<Dtype> bias_multiplier_;
+  Int8Gemm<Dtype> int8_gemm_;
 };
 
 }  // namespace caffe
@@ -2,14 +2,17 @@
 #define OGN_CONV_LAYER_HPP_
 
 #include "caffe/layers/ogn_layer.hpp"
+#include "caffe/util/int8_gemm.hpp"
 
 namespace caffe {
 
+template <typename Dtype> class OGNPropLayer;
+
 template <typename Dtype>
 class OGNConvLayer : public OGNLayer<Dtype> {
  public:
   explicit OGNConvLayer(const LayerParameter& param)
-      : OGNLayer<Dtype>(param) {}
+      : OGNLayer<Dtype>(param), _quantized(false) {}
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -27,15 +30,31 @@ class OGNConvLayer : public OGNLayer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+  bool resolve_key_layer();
   void propagate_keys_cpu();
+  void build_neighbor_table_cpu();
   void resize_computation_buffers_cpu(int batch_num_pixels);
+  void resize_batched_buffers_cpu();
+  void forward_batched_cpu(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
+  void backward_batched_cpu(const vector<Blob<Dtype>*>& top, const vector<Blob<Dtype>*>& bottom);
+  void forward_direct_cpu(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
+  void backward_direct_cpu(const vector<Blob<Dtype>*>& top, const vector<Blob<Dtype>*>& bottom);
+  void resize_direct_buffers_cpu();
+  int collect_direct_pairs(int batch_ind, int el);
+  void gather_columns_cpu(const Dtype* input, int rows, int cols, int num_pairs, const int* ind, Dtype* output);
+  void scatter_add_columns_cpu(const Dtype* input, int rows, int num_pairs, const int* ind, Dtype* output, int cols);
+  void gather_fused_input_cpu(int batch_ind, Dtype* output, int output_cols, int num_cols);
+  void pack_features_cpu(const Dtype* input, int channels, int pixels, int scale, Dtype* output);
+  void unpack_features_cpu(const Dtype* input, int channels, int pixels, int scale, Dtype* output);
   void backward_cpu_gemm(const Dtype* top_diff, const Dtype* weights, Dtype* col_buff);
   void backward_cpu_bias(Dtype* bias, const Dtype* input);
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype* weights);
-  void col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
-  void im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
+  void col2im_octree_cpu(int batch_ind, const Dtype* col_buff, int col_cols, Dtype* output, int output_cols);
+  void im2col_octree_cpu(int batch_ind, const Dtype* input, int input_cols, Dtype* col_buff, int col_cols, int num_cols);
   void forward_cpu_bias(Dtype* output, const Dtype* bias);
   void forward_cpu_gemm(const Dtype* weights, const Dtype* input, Dtype* output);
+  void quantize_weights_cpu();
+  void quantized_gemm_cpu(const Dtype* input, Dtype* output);
 
   vector<int> _weight_shape;
   vector<int> _bias_shape;
@@ -43,6 +62,34 @@ class OGNConvLayer : public OGNLayer<Dtype> {
 
   Blob<Dtype> _col_buffer;
   Blob<Dtype> _bias_multiplier;
+  Blob<Dtype> _packed_bottom;
+  Blob<Dtype> _packed_top;
+
+  /// Buffers of the DIRECT engine: the weights rearranged into one
+  /// (output channels x input channels) matrix per filter element, their
+  /// gradient, and the gathered input and output columns of one filter element.
+  Blob<Dtype> _direct_weights;
+  Blob<Dtype> _direct_weight_diff;
+  Blob<Dtype> _direct_input_buffer;
+  Blob<Dtype> _direct_output_buffer;
+  std::vector<int> _direct_src;
+  std::vector<int> _direct_dst;
+
+  /// For every active cell and every filter element, the feature index of
+  /// the corresponding neighbor, or -1 if it does not exist. The rows of batch
+  /// item n start at _key_offsets[n]. Rebuilt once per forward pass and
+  /// reused in the backward pass.
+  std::vector<int> _neighbor_table;
+  std::vector<int> _key_offsets;
+  boost::shared_ptr<OGNLayer<Dtype> > _key_layer;
+
+  /// The key layer of a deconvolution if it is a fused OGNProp layer; the
+  /// input features are then gathered from its source, see OGNPropLayer::is_fused.
+  boost::shared_ptr<OGNPropLayer<Dtype> > _fused_prop;
+
+  /// int8 inference, see OGNConvParameter.int8.
+  bool _quantized;
+  Int8Gemm<Dtype> _int8_gemm;
 
   int _num_input_pixels;
   int _num_output_pixels;
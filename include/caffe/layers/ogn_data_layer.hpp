@@ -1,18 +1,32 @@
 #ifndef OGN_DATA_LAYER_HPP_
 #define OGN_DATA_LAYER_HPP_
 
+#include "caffe/internal_thread.hpp"
 #include "caffe/layers/ogn_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 
 #include "image_tree_tools/image_tree_tools.h"
 
 namespace caffe {
 
+/// A batch prepared by the prefetch thread of OGNDataLayer: the padded
+/// (batch x max cells) values, the model labels and the per-sample key
+/// octrees, also sorted for the lookups of the loss layers.
 template <typename Dtype>
-class OGNDataLayer : public OGNLayer<Dtype> {
+class OGNBatch {
+ public:
+  Blob<Dtype> values_, labels_;
+  OGNOctreeBatch<KeyOctree> octree_keys_;
+  OGNOctreeBatch<SortedKeyOctree> sorted_keys_;
+};
+
+template <typename Dtype>
+class OGNDataLayer : public OGNLayer<Dtype>, public InternalThread {
  public:
   explicit OGNDataLayer(const LayerParameter& param)
-      : OGNLayer<Dtype>(param) {}
+      : OGNLayer<Dtype>(param), _prefetch_current(NULL) {}
+  virtual ~OGNDataLayer() { this->StopInternalThread(); }
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -29,17 +43,37 @@ class OGNDataLayer : public OGNLayer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
  private:
+   virtual void InternalThreadEntry();
+   void load_batch(OGNBatch<Dtype>* batch);
+
    void load_data_from_disk();
+   std::vector<int> next_batch_labels();
+   void start_epoch();
    int select_next_batch_models(std::vector<int> labels);
+   void fill_batch(Dtype* values, int num_elements, Dtype* labels, OGNOctreeBatch<KeyOctree>& octree_keys,
+       OGNOctreeBatch<SortedKeyOctree>& sorted_keys);
+   void set_model_ids(const Dtype* labels);
 
-   std::vector<Octree> _octrees;
-   std::vector<Octree> _batch_octrees;
+   std::vector<OctreeModel> _octrees;
+   std::vector<OctreeModel> _batch_octrees;
    std::vector<int> _batch_labels;
    std::vector<std::string> _file_names;
+   std::vector<int> _model_sizes;
+
+   std::vector<int> _epoch_order;
+   int _epoch;
+   shared_ptr<Caffe::RNG> _sampling_rng;
+   boost::shared_ptr<OGNStructureCache> _structure_cache;
 
    bool _done_initial_reshape;
    int _model_counter;
 
+   bool _prefetching;
+   std::vector<boost::shared_ptr<OGNBatch<Dtype> > > _prefetch;
+   BlockingQueue<OGNBatch<Dtype>*> _prefetch_free;
+   BlockingQueue<OGNBatch<Dtype>*> _prefetch_full;
+   OGNBatch<Dtype>* _prefetch_current;
+
 };
 
 }  // namespace caffe
@@ -25,6 +25,12 @@ class OGNGenerateKeysLayer : public OGNLayer<Dtype> {
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+  /// Spatial dimensions of the bottom blob the current keys were built for.
+  vector<int> _grid_shape;
+  /// The octrees of the grid, shared by all batch items.
+  boost::shared_ptr<KeyOctree> _keys;
+  boost::shared_ptr<KeyOctree> _prop;
+
 };
 
 }  // namespace caffe
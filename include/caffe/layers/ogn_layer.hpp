@@ -1,39 +1,290 @@
 #ifndef OGN_LAYER_HPP_
 #define OGN_LAYER_HPP_
 
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/ogn_stats.hpp"
+#include "caffe/util/ogn_structure_cache.hpp"
+#include "caffe/util/ogn_threads.hpp"
 
 #include "image_tree_tools/image_tree_tools.h"
 
 namespace caffe {
 
+/// The octrees of the items of a batch. Items are held by pointer, so that
+/// items with the same cells, e.g. the grids of OGNGenerateKeys, can share one
+/// octree instead of holding a copy each. Items are read like a std::vector;
+/// resize gives every item an octree of its own before it is written.
+template <typename Octree>
+class OGNOctreeBatch
+{
+public:
+  int size() const {return _octrees.size();}
+  void clear() {_octrees.clear();}
+
+  /// Resizes to num items with an octree of their own each. Octrees that are
+  /// not shared are kept to reuse their memory; the others start empty.
+  void resize(int num)
+  {
+      _octrees.resize(num);
+      for(int n=0; n<num; n++)
+      {
+          if(!_octrees[n] || !_octrees[n].unique()) _octrees[n].reset(new Octree());
+      }
+  }
+
+  /// Sets num items that all share octree, which must not be modified any more.
+  void assign(int num, const boost::shared_ptr<Octree>& octree) {_octrees.assign(num, octree);}
+
+  /// Lets item n share the octree of item source.
+  void share(int n, int source) {_octrees[n] = _octrees[source];}
+  bool shares(int n, int other) const {return _octrees[n] == _octrees[other];}
+
+  Octree& operator[](int n) {return *_octrees[n];}
+  const Octree& operator[](int n) const {return *_octrees[n];}
+
+  void swap(OGNOctreeBatch& other) {_octrees.swap(other._octrees);}
+
+private:
+  std::vector<boost::shared_ptr<Octree> > _octrees;
+};
+
+/// The key and propagation octrees of the items of a batch at one octree
+/// level, with the packed offsets of their cells. Layers at the same level
+/// share one instance instead of copying the octrees; an instance is not
+/// modified any more once it is shared, see OGNLayer::mutable_octrees.
+struct OGNOctrees
+{
+  OGNOctreeBatch<KeyOctree> keys;
+  OGNOctreeBatch<KeyOctree> prop;
+  // batch_offsets[n] is the number of cells of the items before n
+  std::vector<int> batch_offsets;
+  // sorted copies of keys for the batched lookups of OGNLayer::get_sorted_keys_octree;
+  // unused with the sorted backend, whose keys are sorted already
+  OGNOctreeBatch<SortedKeyOctree> sorted_keys;
+  // true if the cells depend on the network predictions, i.e. an OGNProp
+  // layer with PROP_PRED came before
+  bool predicted;
+  // if the cells only depend on the training models, the model index of
+  // every item and the cache to look up their structures in; empty otherwise
+  std::vector<int> model_ids;
+  boost::shared_ptr<OGNStructureCache> structure_cache;
+
+  OGNOctrees() : predicted(false) {}
+
+  /// The cache to look up the structures of item n in, or NULL.
+  OGNStructureCache* cache_for(int n) const
+  {
+      return n < model_ids.size() ? structure_cache.get() : NULL;
+  }
+
+  /// Takes over how the cells of octrees were determined, for cells derived from them.
+  void inherit_origin(const OGNOctrees& octrees)
+  {
+      predicted = octrees.predicted;
+      model_ids = octrees.model_ids;
+      structure_cache = octrees.structure_cache;
+  }
+
+  /// Recomputes batch_offsets and drops sorted_keys; to be called whenever keys changes.
+  void update_batch_offsets()
+  {
+      sorted_keys.clear();
+      batch_offsets.resize(keys.size() + 1);
+      batch_offsets[0] = 0;
+      for(int n=0; n<keys.size(); n++)
+      {
+          batch_offsets[n + 1] = batch_offsets[n] + keys[n].num_elements();
+      }
+  }
+};
+
 template <typename Dtype>
 class OGNLayer : public Layer<Dtype> {
 
 public:
   explicit OGNLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), _octrees(new OGNOctrees()), _shares_octrees(false), _packed(false),
+        _max_output_level(-1), _collect_stats(false) {}
 
   //TODO: make these references constant
-  GeneralOctree<int>& get_keys_octree(int batch_ind)
+  KeyOctree& get_keys_octree(int batch_ind)
   {
-      return _octree_keys[batch_ind];
+      return _octrees->keys[batch_ind];
   }
 
-  GeneralOctree<int>& get_prop_octree(int batch_ind)
+  KeyOctree& get_prop_octree(int batch_ind)
   {
-      return _octree_prop[batch_ind];
+      return _octrees->prop[batch_ind];
   }
 
+  /// The keys octree of batch item batch_ind sorted by level and key, for
+  /// the merge-join lookups of SortedOctree::get_values. build_sorted_keys()
+  /// has to be called first, outside of parallel loops.
+  SortedKeyOctree& get_sorted_keys_octree(int batch_ind)
+  {
+#ifdef USE_SORTED_OCTREE
+      return _octrees->keys[batch_ind];
+#else
+      return _octrees->sorted_keys[batch_ind];
+#endif
+  }
+
+  /// Sorts the current keys for get_sorted_keys_octree, unless this was done
+  /// already, e.g. by the prefetch thread of the data layer.
+  void build_sorted_keys()
+  {
+#ifndef USE_SORTED_OCTREE
+      OGNOctrees& octrees = *_octrees;
+      if(octrees.sorted_keys.size() == octrees.keys.size()) return;
+      octrees.sorted_keys.resize(octrees.keys.size());
+      OGN_PARALLEL_FOR
+      for(int n=0; n<octrees.keys.size(); n++)
+      {
+          if(n > 0 && octrees.keys.shares(n, n - 1)) continue;
+          octrees.sorted_keys[n].assign(octrees.keys[n].begin(), octrees.keys[n].end());
+      }
+      // items that share their keys share their sorted keys, too
+      for(int n=1; n<octrees.keys.size(); n++)
+      {
+          if(octrees.keys.shares(n, n - 1)) octrees.sorted_keys.share(n, n - 1);
+      }
+#endif
+  }
+
+  const OGNOctrees& get_octrees() {return *_octrees;}
+
   int get_level() {return _level;}
 
+  int get_batch_size() {return _octrees->keys.size();}
+
+  /// Blobs keyed by this layer are either padded, (batch x channels x max cells),
+  /// or packed, (1 x channels x total cells) with the cells of batch item n
+  /// starting at column get_batch_offset(n). In both layouts the channel rows
+  /// of a blob are blob.count(2) apart.
+  bool is_packed() {return _packed;}
+  int get_batch_offset(int batch_ind) {return _octrees->batch_offsets[batch_ind];}
+  int get_num_cells() {return _octrees->batch_offsets.empty() ? 0 : _octrees->batch_offsets.back();}
+
+  int get_max_cells()
+  {
+      const std::vector<int>& offsets = _octrees->batch_offsets;
+      int max_cells = 0;
+      for(int n=0; n+1<offsets.size(); n++)
+      {
+          if(offsets[n + 1] - offsets[n] > max_cells) max_cells = offsets[n + 1] - offsets[n];
+      }
+      return max_cells;
+  }
+
+  /// Offset of the first feature of batch item batch_ind in a blob keyed by this layer.
+  int get_item_offset(const Blob<Dtype>& blob, int batch_ind)
+  {
+      return _packed ? _octrees->batch_offsets[batch_ind] : batch_ind * blob.count(1);
+  }
+
+  /// False if blob cannot be in the layout of this layer; used to catch nets
+  /// mixing packed and padded blobs within the same octree level.
+  bool matches_layout(const Blob<Dtype>& blob)
+  {
+      const int num = get_batch_size();
+      return num < 2 || blob.shape(0) == (_packed ? 1 : num);
+  }
+
+  /// Limits the refinement to octree level max_level at inference, e.g. for
+  /// `caffe test --ogn_max_level`: OGNProp does not propagate cells of that
+  /// level or finer, and OGNOutput writes mixed cells of that level as
+  /// filled. Negative for no limit, the default.
+  void set_max_output_level(int max_level) {_max_output_level = max_level;}
+  int get_max_output_level() {return _max_output_level;}
+
+  /// Profiling counters, e.g. for `caffe time --ogn_stats`. Collection is
+  /// off by default and costs nothing then.
+  void set_collect_stats(bool collect) {_collect_stats = collect;}
+  const OGNStats& get_stats() {return _stats;}
+  void reset_stats() {_stats.reset();}
+
 protected:
 
-  std::vector<GeneralOctree<int> > _octree_keys;
-  std::vector<GeneralOctree<int> > _octree_prop;
+  /// Target for an OGNStatsTimer, or NULL if stats are not collected.
+  double* stats_timer(double OGNStats::* field)
+  {
+      return _collect_stats ? &(_stats.*field) : NULL;
+  }
+
+  void record_buffer_bytes(long long bytes)
+  {
+      if(_collect_stats && bytes > _stats.col_buffer_bytes) _stats.col_buffer_bytes = bytes;
+  }
+
+  /// Records the cells and octree memory of the current batch; to be called
+  /// at the end of every forward pass of a layer that owns keys. The memory
+  /// of shared octrees is only counted by the layer that built them, and only
+  /// once for batch items that share them.
+  void update_stats()
+  {
+      if(!_collect_stats) return;
+      _stats.iterations++;
+      OGNOctrees& octrees = *_octrees;
+      for(int n=0; n<octrees.keys.size(); n++)
+      {
+          _stats.num_cells += octrees.keys[n].num_elements();
+          if(!_shares_octrees && (n == 0 || !octrees.keys.shares(n, n - 1)))
+          {
+              _stats.octree_bytes += octrees.keys[n].memory_bytes();
+              if(n < octrees.prop.size()) _stats.octree_bytes += octrees.prop[n].memory_bytes();
+              if(n < octrees.sorted_keys.size()) _stats.octree_bytes += octrees.sorted_keys[n].memory_bytes();
+          }
+          if(_stats.level < 0 && octrees.keys[n].num_elements())
+          {
+              _stats.level = KeyOctree::compute_level(octrees.keys[n].begin()->first);
+          }
+      }
+  }
+
+  /// The octrees of this layer, to build new keys into. If they are shared
+  /// with other layers, they are replaced by a new, empty instance first.
+  OGNOctrees& mutable_octrees()
+  {
+      if(_shares_octrees || !_octrees.unique())
+      {
+          _octrees.reset(new OGNOctrees());
+          _shares_octrees = false;
+      }
+      return *_octrees;
+  }
+
+  /// Uses the octrees of layer, which is at the same level, without copying them.
+  void share_octrees(OGNLayer<Dtype>& layer)
+  {
+      _octrees = layer._octrees;
+      _shares_octrees = true;
+  }
+
+  /// Recomputes the packed offsets; to be called whenever the keys change.
+  void update_batch_offsets() {_octrees->update_batch_offsets();}
+
+  /// Builds the cells of this layer as the parents of the cells of source, one
+  /// octree level coarser, for the encoder layers OGNPool and strided OGNConv.
+  /// The parents of an item are numbered in key order. If parent_indices is
+  /// given, (*parent_indices)[n][i] is set to the parent of cell i of item n.
+  void pool_keys(OGNLayer<Dtype>& source, std::vector<std::vector<int> >* parent_indices);
+
+  boost::shared_ptr<OGNOctrees> _octrees;
+  bool _shares_octrees;
   int _level;
 
+  bool _packed;
+
+  int _max_output_level;
+
+  bool _collect_stats;
+  OGNStats _stats;
+
 };
 
 }  // namespace caffe
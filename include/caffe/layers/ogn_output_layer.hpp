@@ -1,18 +1,32 @@
 #ifndef OGN_OUTPUT_LAYER_HPP_
 #define OGN_OUTPUT_LAYER_HPP_
 
+#include <fstream>
+
+#include "caffe/internal_thread.hpp"
 #include "caffe/layers/ogn_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 
 namespace caffe {
 
+/// The octrees of a batch, queued for the writer thread of OGNOutputLayer;
+/// octree n is written as output number first_output_num + n.
+class OGNOutputBatch {
+ public:
+  std::vector<Octree> octrees_;
+  int first_output_num_;
+};
+
 /// Assembles an octree based on the network predictions,
-/// and outputs it to file.
+/// and outputs it to file. The files are written by a background thread,
+/// so that the forward pass only waits for them when the queue is full.
 template <typename Dtype>
-class OGNOutputLayer : public OGNLayer<Dtype> {
+class OGNOutputLayer : public OGNLayer<Dtype>, public InternalThread {
  public:
   explicit OGNOutputLayer(const LayerParameter& param)
-      : OGNLayer<Dtype>(param) {}
+      : OGNLayer<Dtype>(param), _writing(false) {}
+  virtual ~OGNOutputLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -26,8 +40,18 @@ class OGNOutputLayer : public OGNLayer<Dtype> {
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
+ private:
+  virtual void InternalThreadEntry();
+  void build_octrees(const vector<Blob<Dtype>*>& bottom, std::vector<Octree>& octrees);
+  void write_batch(OGNOutputBatch* batch);
+
   int _output_num;
-  bool _done_initial_reshape;
+  std::ofstream _shard;
+
+  bool _writing;
+  std::vector<boost::shared_ptr<OGNOutputBatch> > _write_batches;
+  BlockingQueue<OGNOutputBatch*> _write_free;
+  BlockingQueue<OGNOutputBatch*> _write_full;
 
 };
 
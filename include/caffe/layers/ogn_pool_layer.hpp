@@ -0,0 +1,47 @@
+#ifndef OGN_POOL_LAYER_HPP_
+#define OGN_POOL_LAYER_HPP_
+
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/// Pools the features of the cells of the key layer into their parents, one
+/// octree level coarser, e.g. to encode octrees from OGNDataLayer without
+/// converting them to a dense grid first. Only the children that exist are
+/// pooled.
+template <typename Dtype>
+class OGNPoolLayer : public OGNLayer<Dtype> {
+ public:
+  explicit OGNPoolLayer(const LayerParameter& param)
+      : OGNLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "OGNPool"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  boost::shared_ptr<OGNLayer<Dtype> > _key_layer;
+
+  /// For every cell of batch item n of the key layer, the index of its parent.
+  std::vector<std::vector<int> > _parent_indices;
+  /// AVE: for every parent of batch item n, the number of its children.
+  std::vector<std::vector<int> > _num_children;
+  /// MAX: the cell index of the maximum of every parent and channel, in the
+  /// layout of the top blob; -1 for no cell.
+  Blob<int> _max_indices;
+
+};
+
+}  // namespace caffe
+
+#endif  // OGN_POOL_LAYER_HPP_
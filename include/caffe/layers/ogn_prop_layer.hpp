@@ -17,7 +17,7 @@ template <typename Dtype>
 class OGNPropLayer : public OGNLayer<Dtype> {
  public:
   explicit OGNPropLayer(const LayerParameter& param)
-      : OGNLayer<Dtype>(param) {}
+      : OGNLayer<Dtype>(param), _source_features(NULL), _fused(false) {}
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
   virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
@@ -25,10 +25,27 @@ class OGNPropLayer : public OGNLayer<Dtype> {
 
   virtual inline const char* type() const { return "OGNProp"; }
 
+  /// True if the output blob is not computed because the following
+  /// deconvolution reads the propagated features from the source instead.
+  bool is_fused() {return _fused;}
+
+  /// Features and key layer the cells are propagated from.
+  const Blob<Dtype>& get_source_features() {return *_source_features;}
+  OGNLayer<Dtype>& get_source_key_layer() {return *_key_layer;}
+
+  /// For every propagated cell of batch item batch_ind, the index of its
+  /// features in the source item.
+  const std::vector<int>& get_source_indices(int batch_ind) {return _source_indices[batch_ind];}
+
+  /// Columns per channel of the output blob, as if it was computed.
+  int get_num_output_pixels() {return _num_output_pixels;}
+
  protected:
 
   void compute_pixel_propagation(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  bool can_fuse_deconv(const Blob<Dtype>* top_blob);
+  void set_cells_origin(const OGNOctrees& source, OGNOctrees& octrees);
 
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -42,6 +59,11 @@ class OGNPropLayer : public OGNLayer<Dtype> {
   int _nbh_prop_size;
   int _num_output_pixels;
 
+  boost::shared_ptr<OGNLayer<Dtype> > _key_layer;
+  const Blob<Dtype>* _source_features;
+  std::vector<std::vector<int> > _source_indices;
+  bool _fused;
+
 };
 
 
@@ -0,0 +1,87 @@
+#ifndef CAFFE_UTIL_INT8_GEMM_HPP_
+#define CAFFE_UTIL_INT8_GEMM_HPP_
+
+#include <stdint.h>
+#include <vector>
+
+#include "caffe/blob.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Kernels of Int8Gemm. INT8_GEMM_AVX2 multiplies pairs of int8 values
+ *        widened to int16 with vpmaddwd; INT8_GEMM_AVX512_VNNI multiplies
+ *        quadruples of int8 values with vpdpbusd, with the input offset by 128
+ *        to make it unsigned. INT8_GEMM_SCALAR computes the same as AVX2 in
+ *        plain C++. All kernels give the same results.
+ */
+enum Int8GemmImpl {
+  INT8_GEMM_SCALAR,
+  INT8_GEMM_AVX2,
+  INT8_GEMM_AVX512_VNNI
+};
+
+/// Whether the CPU supports the given kernel.
+bool int8_gemm_impl_supported(Int8GemmImpl impl);
+
+/// The fastest kernel that the CPU supports, detected on the first call.
+Int8GemmImpl int8_gemm_impl();
+
+/**
+ * @brief The forward GEMM of a convolution for CPU inference in int8 with
+ *        int32 accumulation: output (rows x cols) = A (rows x depth) *
+ *        input (depth x cols), with A the weights quantized symmetrically
+ *        per output channel.
+ *
+ * A is packed in panels of rows for the kernel when the weights are set, and
+ * the input is quantized and packed in panels of columns during the GEMM, one
+ * cache-sized block of columns at a time, so that the kernel only reads
+ * contiguous memory. The SIMD kernels are only
+ * used for float; double always runs the scalar kernel.
+ */
+template <typename Dtype>
+class Int8Gemm {
+ public:
+  explicit Int8Gemm(Int8GemmImpl impl = int8_gemm_impl());
+
+  /**
+   * @brief Sets A to the weights, stored as (rows x depth), or as
+   *        (depth x rows) if transposed; every rows_per_channel rows of A
+   *        belong to one output channel. The weights are only quantized again
+   *        if their data was modified since the last call (see
+   *        SyncedMemory::version), e.g. by a weight load or a solver update.
+   */
+  void set_weights(const Blob<Dtype>& weights, int rows, int depth,
+      bool transposed, int rows_per_channel);
+
+  /**
+   * @brief Computes output = A * input, with input quantized by input_scale,
+   *        or by the scale of its largest value if input_scale <= 0. Values
+   *        beyond the range of input_scale saturate.
+   */
+  void gemm(const Dtype* input, int cols, Dtype input_scale, Dtype* output);
+
+  Int8GemmImpl impl() const { return impl_; }
+
+ private:
+  Int8GemmImpl impl_;
+  int rows_;
+  int depth_;
+  bool transposed_;
+  // the weights that A was quantized from
+  const SyncedMemory* source_;
+  unsigned int source_version_;
+  // A in panels of rows, one 32-bit word of int8 or int16 values per row and
+  // group of consecutive depth indices
+  std::vector<int32_t> weights_;
+  std::vector<Dtype> weight_scales_;
+  // correction of the unsigned input of INT8_GEMM_AVX512_VNNI per row
+  std::vector<int32_t> row_offsets_;
+  std::vector<Dtype> row_scales_;
+  // a block of the quantized input in panels of columns per thread
+  std::vector<int32_t> packed_input_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_INT8_GEMM_HPP_
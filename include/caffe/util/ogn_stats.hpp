@@ -0,0 +1,57 @@
+#ifndef CAFFE_UTIL_OGN_STATS_HPP_
+#define CAFFE_UTIL_OGN_STATS_HPP_
+
+#include "caffe/util/benchmark.hpp"
+
+namespace caffe {
+
+/// Data-dependent counters of one OGN layer, summed over the forward and
+/// backward passes since the last reset, except col_buffer_bytes which is the
+/// peak size of the convolution buffers. Times are in milliseconds.
+struct OGNStats
+{
+  int iterations;
+  int level;
+  long long num_cells;
+  long long neighbor_lookups;
+  long long neighbor_hits;
+  long long col_buffer_bytes;
+  long long octree_bytes;
+  double keys_ms;
+  double gather_ms;
+  double gemm_ms;
+  double scatter_ms;
+
+  OGNStats() { reset(); }
+
+  void reset()
+  {
+      iterations = 0;
+      level = -1;
+      num_cells = neighbor_lookups = neighbor_hits = 0;
+      col_buffer_bytes = octree_bytes = 0;
+      keys_ms = gather_ms = gemm_ms = scatter_ms = 0;
+  }
+};
+
+/// Adds the lifetime of the enclosing scope to *total_ms; does nothing for NULL.
+class OGNStatsTimer
+{
+public:
+  explicit OGNStatsTimer(double* total_ms) : _total_ms(total_ms)
+  {
+      if(_total_ms) _timer.Start();
+  }
+  ~OGNStatsTimer()
+  {
+      if(_total_ms) *_total_ms += _timer.MicroSeconds() / 1000.0;
+  }
+
+private:
+  double* _total_ms;
+  CPUTimer _timer;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_OGN_STATS_HPP_
@@ -0,0 +1,105 @@
+#ifndef CAFFE_UTIL_OGN_STRUCTURE_CACHE_HPP_
+#define CAFFE_UTIL_OGN_STRUCTURE_CACHE_HPP_
+
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "image_tree_tools/image_tree_tools.h"
+
+namespace caffe {
+
+/// Structures that an OGN layer computed for one batch item and that only
+/// depend on the training model of the item: its cells and propagation flags,
+/// and an index array, e.g. the source indices of OGNProp or the neighbor
+/// table rows of OGNConv.
+struct OGNCachedStructure
+{
+  KeyOctree keys;
+  KeyOctree prop;
+  std::vector<int> indices;
+
+  long long memory_bytes() const
+  {
+      return keys.memory_bytes() + prop.memory_bytes() + indices.capacity() * sizeof(int);
+  }
+};
+
+/// Least recently used cache of the structures of the OGN layers, by model
+/// index and layer, limited to max_bytes. Created by OGNDataLayer (see
+/// structure_cache_mb) and handed down the net with the octrees, so that the
+/// ground-truth-driven propagation of a model is computed once per training
+/// instead of once per epoch. Thread-safe.
+class OGNStructureCache
+{
+public:
+  explicit OGNStructureCache(long long max_bytes)
+      : _max_bytes(max_bytes), _bytes(0), _hits(0), _misses(0) {}
+
+  /// The structure of layer for model, or NULL if it is not cached.
+  boost::shared_ptr<const OGNCachedStructure> find(int model, const void* layer)
+  {
+      boost::mutex::scoped_lock lock(_mutex);
+      std::map<Key, Entry>::iterator it = _entries.find(Key(model, layer));
+      if(it == _entries.end())
+      {
+          _misses++;
+          return boost::shared_ptr<const OGNCachedStructure>();
+      }
+      _hits++;
+      _order.splice(_order.begin(), _order, it->second.position);
+      return it->second.structure;
+  }
+
+  /// Adds the structure of layer for model, dropping the least recently used
+  /// structures until it fits. Structures larger than the cache are not added.
+  void insert(int model, const void* layer, const boost::shared_ptr<const OGNCachedStructure>& structure)
+  {
+      const long long bytes = structure->memory_bytes();
+      boost::mutex::scoped_lock lock(_mutex);
+      if(bytes > _max_bytes || _entries.count(Key(model, layer))) return;
+      while(_bytes + bytes > _max_bytes)
+      {
+          std::map<Key, Entry>::iterator last = _entries.find(_order.back());
+          _bytes -= last->second.bytes;
+          _entries.erase(last);
+          _order.pop_back();
+      }
+      _order.push_front(Key(model, layer));
+      Entry& entry = _entries[Key(model, layer)];
+      entry.structure = structure;
+      entry.position = _order.begin();
+      entry.bytes = bytes;
+      _bytes += bytes;
+  }
+
+  long long memory_bytes() {boost::mutex::scoped_lock lock(_mutex); return _bytes;}
+  long long hits() {boost::mutex::scoped_lock lock(_mutex); return _hits;}
+  long long misses() {boost::mutex::scoped_lock lock(_mutex); return _misses;}
+
+private:
+  typedef std::pair<int, const void*> Key;
+  struct Entry
+  {
+      boost::shared_ptr<const OGNCachedStructure> structure;
+      std::list<Key>::iterator position;
+      long long bytes;
+  };
+
+  const long long _max_bytes;
+  long long _bytes;
+  long long _hits;
+  long long _misses;
+  // most recently used first
+  std::list<Key> _order;
+  std::map<Key, Entry> _entries;
+  boost::mutex _mutex;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_OGN_STRUCTURE_CACHE_HPP_
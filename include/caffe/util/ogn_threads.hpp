@@ -0,0 +1,30 @@
+#ifndef CAFFE_UTIL_OGN_THREADS_HPP_
+#define CAFFE_UTIL_OGN_THREADS_HPP_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Parallelizes the following for loop over the threads of the OGN layers.
+/// Expands to nothing when compiled without OpenMP.
+#ifdef _OPENMP
+#define OGN_PARALLEL_FOR \
+  _Pragma("omp parallel for num_threads(caffe::ogn_num_threads())")
+#else
+#define OGN_PARALLEL_FOR
+#endif
+
+namespace caffe {
+
+/// Number of threads used by the parallel loops of the OGN layers: the last
+/// value given to set_ogn_num_threads, initially OGN_NUM_THREADS, or the
+/// OpenMP default if that is 0.
+int ogn_num_threads();
+
+/// Sets the number of threads of the OGN layers; 0 restores the OpenMP
+/// default. Not to be called while a net is running.
+void set_ogn_num_threads(int num_threads);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_OGN_THREADS_HPP_
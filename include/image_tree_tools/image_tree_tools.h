@@ -4,6 +4,8 @@
 #include "zindex.h"
 #include "voxel_grid.h"
 #include "octree.h"
+#include "sorted_octree.h"
+#include "mapped_octree.h"
 #include "common_util.h"
 
 #define CLASS_MIXED 2
@@ -14,9 +16,24 @@
 
 #define OGN_NUM_CLASSES 3
 
+// Key width of all octrees: 64-bit keys support up to 21 levels instead of 10.
+#ifdef USE_64BIT_KEYS
+typedef uint64_t KeyType;
+#else
 typedef unsigned int KeyType;
+#endif
 typedef byte SignalType;
 typedef OccupancyVoxelGrid VoxelGrid;
-typedef GeneralOctree<SignalType> Octree;
+typedef GeneralOctree<SignalType, KeyType> Octree;
+typedef MappedOctree<SignalType, KeyType> OctreeModel;
+
+// Storage backend of the key and propagation octrees used by the OGN layers.
+#ifdef USE_SORTED_OCTREE
+typedef SortedOctree<int, KeyType> KeyOctree;
+#else
+typedef GeneralOctree<int, KeyType> KeyOctree;
+#endif
+// Key octrees sorted by level and key, for batched merge-join lookups.
+typedef SortedOctree<int, KeyType> SortedKeyOctree;
 
 #endif //IMAGE_TREE_TOOLS_H_
@@ -0,0 +1,155 @@
+#ifndef MAPPED_OCTREE_H_
+#define MAPPED_OCTREE_H_
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "octree.h"
+
+/// Read-only octree stored as parallel key and value arrays. Binary .ot files
+/// are memory-mapped and used in place, without parsing or copying; files in
+/// the boost text format are parsed once into owned arrays, sorted by key as
+/// in the binary format. Copies share the underlying storage, so handing a
+/// preloaded model to a batch is O(1). Binary files with keys of the other
+/// width are converted into owned arrays as well.
+template <class VALUE, class KEY_TYPE = unsigned int>
+class MappedOctree : public OctreeBase<KEY_TYPE>
+{
+
+public:
+  typedef OctreeBase<KEY_TYPE> Base;
+  typedef typename Base::KEY KEY;
+  typedef typename Base::FileHeader FileHeader;
+  using Base::compute_level;
+
+private:
+  struct Storage
+  {
+      void* map_addr;
+      size_t map_size;
+      std::vector<KEY> keys;
+      std::vector<VALUE> values;
+
+      Storage() : map_addr(MAP_FAILED), map_size(0) {}
+      ~Storage() { if(map_addr != MAP_FAILED) munmap(map_addr, map_size); }
+  };
+
+  boost::shared_ptr<Storage> _storage;
+  const KEY* _keys;
+  const VALUE* _values;
+  int _num_elements;
+  int _max_level;
+
+  bool map_file(const std::string& fname)
+  {
+      int fd = open(fname.c_str(), O_RDONLY);
+      if(fd < 0)
+      {
+          std::cerr << "Error: cannot open " << fname << std::endl;
+          return false;
+      }
+      struct stat st;
+      if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(FileHeader))
+      {
+          std::cerr << "Error: " << fname << " is truncated" << std::endl;
+          close(fd);
+          return false;
+      }
+
+      boost::shared_ptr<Storage> storage(new Storage());
+      storage->map_size = st.st_size;
+      storage->map_addr = mmap(NULL, storage->map_size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if(storage->map_addr == MAP_FAILED)
+      {
+          std::cerr << "Error: cannot map " << fname << std::endl;
+          return false;
+      }
+
+      const FileHeader& header = *(const FileHeader*)storage->map_addr;
+      if(!Base::check_file_header(header, sizeof(VALUE), storage->map_size, fname)) return false;
+      if(header.key_size != sizeof(KEY)) return read_file(fname);
+
+      const char* data = (const char*)storage->map_addr;
+      _storage = storage;
+      _keys = (const KEY*)(data + sizeof(FileHeader));
+      _values = (const VALUE*)(data + Base::file_values_offset(header.num_elements, sizeof(KEY)));
+      _num_elements = header.num_elements;
+      _max_level = header.max_level;
+      return true;
+  }
+
+  bool read_file(const std::string& fname)
+  {
+      boost::shared_ptr<Storage> storage(new Storage());
+      if(!Base::read_binary_file(fname, _max_level, storage->keys, storage->values)) return false;
+      _storage = storage;
+      _keys = storage->keys.data();
+      _values = storage->values.data();
+      _num_elements = storage->keys.size();
+      return true;
+  }
+
+public:
+
+  MappedOctree() : _keys(NULL), _values(NULL), _num_elements(0), _max_level(-1) {}
+
+  int num_elements() const { return _num_elements; }
+  int max_level() const { return _max_level; }
+  const KEY* keys() const { return _keys; }
+  const VALUE* values() const { return _values; }
+
+  /// Copies the content of any octree backend into owned arrays, sorted by
+  /// key like binary files, so that users can build sorted octrees from
+  /// them in linear time.
+  template <class OCTREE>
+  void assign(OCTREE& octree)
+  {
+      std::vector<std::pair<KEY, VALUE> > elements;
+      elements.reserve(octree.num_elements());
+      for(typename OCTREE::iterator it=octree.begin(); it!=octree.end(); it++)
+      {
+          elements.push_back(std::pair<KEY, VALUE>(it->first, it->second));
+      }
+      std::sort(elements.begin(), elements.end());
+
+      boost::shared_ptr<Storage> storage(new Storage());
+      storage->keys.resize(elements.size());
+      storage->values.resize(elements.size());
+      _max_level = -1;
+      for(size_t i=0; i<elements.size(); i++)
+      {
+          storage->keys[i] = elements[i].first;
+          storage->values[i] = elements[i].second;
+          int level = compute_level(elements[i].first);
+          if(level > _max_level) _max_level = level;
+      }
+      _storage = storage;
+      _keys = storage->keys.data();
+      _values = storage->values.data();
+      _num_elements = storage->keys.size();
+  }
+
+  /// Loads fname in either format; returns false if it cannot be read.
+  bool from_file(const std::string& fname)
+  {
+      if(Base::is_binary_file(fname)) return map_file(fname);
+
+      GeneralOctree<VALUE, KEY> octree;
+      if(!octree.from_file(fname)) return false;
+      assign(octree);
+      return true;
+  }
+
+};
+
+#endif //MAPPED_OCTREE_H_
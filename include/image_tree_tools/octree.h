@@ -7,9 +7,13 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 #include <tr1/unordered_map>
 
 #include <math.h>
+#include <stdint.h>
 
 #include <boost/serialization/map.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -27,23 +31,21 @@ struct OctreeCoord
     int l;
 };
 
-template <class VALUE>
-class GeneralOctree
+/// Key arithmetic shared by all octree storage backends.
+/// A key is the morton code of the cell coordinates, prefixed with a
+/// single set bit that encodes the level of the cell. KEY_TYPE is either
+/// a 32-bit key, for up to 10 levels (1024^3 voxels), or a 64-bit key,
+/// for up to 21 levels. A key of a level both widths support has the same
+/// value in both.
+template <class KEY_TYPE = unsigned int>
+class OctreeBase
 {
 
 public:
-  typedef unsigned int KEY;
-
-private:
-  typedef std::tr1::unordered_map<KEY, VALUE> HashTable;
-
-  HashTable _hash_table;
-  int _max_level;
-
-public:
+  typedef KEY_TYPE KEY;
 
   static int MIN_LEVEL() { return 0; }
-  static int MAX_LEVEL() { return (sizeof(KEY) * 8) / 3; }
+  static int MAX_LEVEL() { return (sizeof(KEY) * 8 - 1) / 3; }
   static KEY INVALID_KEY() { return 0; }
   static bool IS_VALID_COORD(const OctreeCoord& c)
   {
@@ -56,21 +58,17 @@ public:
   static bool IS_VALID_KEY(const KEY& key)
   {
     if(key == INVALID_KEY()) return false;
-    int lz = __builtin_clz(key) - 1;
-    if(lz % 3) return false;
+    if(highest_bit(key) % 3) return false;
     return true;
   }
 
-  GeneralOctree(int max_level = -1)
+  /// Index of the most significant set bit of a non-zero key.
+  static int highest_bit(KEY key)
   {
-      _max_level = max_level;
+      if(sizeof(KEY) > sizeof(unsigned int)) return 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(key);
+      return 8 * sizeof(unsigned int) - 1 - __builtin_clz(key);
   }
 
-  typedef typename HashTable::iterator iterator;
-  typedef typename HashTable::const_iterator const_iterator;
-  iterator begin() { return _hash_table.begin(); }
-  iterator end() { return _hash_table.end(); }
-
   static int resolution_from_level(int level)
   {
       return pow(2, level);
@@ -78,7 +76,7 @@ public:
 
   static int compute_level(const KEY& key)
   {
-      return (MAX_LEVEL() * 3 - __builtin_clz(key) + 1) / 3;
+      return highest_bit(key) / 3;
   }
 
   static KEY compute_key(const OctreeCoord& c)
@@ -100,13 +98,459 @@ public:
     return c;
   }
 
+  /// Keys of the n cells (x[i], y[i], z[i]) of level, computed with the batch
+  /// morton functions. The coordinates must be valid for level.
+  static void compute_keys(int level, const uint32_t* x, const uint32_t* y, const uint32_t* z, KEY* keys, size_t n)
+  {
+      morton_3d_batch(x, y, z, keys, n);
+      const KEY level_bit = KEY(1) << 3 * level;
+      for(size_t i=0; i<n; i++) keys[i] |= level_bit;
+  }
+
+  /// Writes the keys of the nbh_size^3 cells around key of the same level,
+  /// INVALID_KEY() for those outside [0, res)^3. The offsets per dimension run
+  /// from -nbh_size / 2 to nbh_size / 2 (one less for even sizes), x slowest
+  /// and z fastest. The neighbors are stepped to in dilated-integer arithmetic,
+  /// without decoding and re-encoding their morton codes.
+  static void compute_neighbor_keys(KEY key, int nbh_size, int res, KEY* neighbors)
+  {
+      const int level = compute_level(key);
+      const KEY level_bit = KEY(1) << 3 * level;
+      const KEY code = key & ~level_bit;
+      const KEY mask_x = morton_3d_x_mask(KEY()), mask_y = mask_x << 1, mask_z = mask_x << 2;
+
+      KEY x, y, z;
+      inverse_morton_3d(x, y, z, code);
+
+      int min_ind = -nbh_size / 2;
+      int max_ind = nbh_size / 2;
+      if(nbh_size % 2 == 0) min_ind += 1;
+      // first neighbor per dimension; wraps around for negative coordinates, which are skipped below
+      const KEY first_x = dilated_sub(code & mask_x, morton_3d(KEY(-min_ind), KEY(0), KEY(0)), mask_x);
+      const KEY first_y = dilated_sub(code & mask_y, morton_3d(KEY(0), KEY(-min_ind), KEY(0)), mask_y);
+      const KEY first_z = dilated_sub(code & mask_z, morton_3d(KEY(0), KEY(0), KEY(-min_ind)), mask_z);
+
+      KEY dx = first_x;
+      for(int i=min_ind; i<=max_ind; i++, dx = dilated_add(dx, KEY(1), mask_x))
+      {
+          const bool inside_x = int(x) + i >= 0 && int(x) + i < res;
+          KEY dy = first_y;
+          for(int j=min_ind; j<=max_ind; j++, dy = dilated_add(dy, KEY(2), mask_y))
+          {
+              const bool inside_xy = inside_x && int(y) + j >= 0 && int(y) + j < res;
+              KEY dz = first_z;
+              for(int k=min_ind; k<=max_ind; k++, dz = dilated_add(dz, KEY(4), mask_z))
+              {
+                  const bool inside = inside_xy && int(z) + k >= 0 && int(z) + k < res;
+                  *neighbors++ = inside ? (dx | dy | dz | level_bit) : INVALID_KEY();
+              }
+          }
+      }
+  }
+
+  /// Maximum number of keys of compute_coords. Batches of this size keep
+  /// the buffers of the batch functions in the L1 cache.
+  enum { BATCH_SIZE = 256 };
+
+  /// Coordinates of the first cell of level within each of the n cells keys,
+  /// which must not be finer than level. For keys of level these are the
+  /// coordinates of compute_coord.
+  static void compute_coords(int level, const KEY* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+  {
+      KEY codes[BATCH_SIZE];
+      for(size_t i=0; i<n; i++)
+      {
+          int key_level = compute_level(keys[i]);
+          codes[i] = (keys[i] & ~(KEY(1) << 3 * key_level)) << 3 * (level - key_level);
+      }
+      inverse_morton_3d_batch(codes, x, y, z, n);
+  }
+
+  /// Header of the binary .ot file format. It is followed by the keys in
+  /// ascending (morton) order and, starting at the next 8 byte boundary,
+  /// by the values in the same order. All fields are in native byte order.
+  struct FileHeader
+  {
+      char magic[8];
+      uint32_t version;
+      uint32_t key_size;
+      uint32_t value_size;
+      int32_t max_level;
+      uint64_t num_elements;
+      uint64_t level_counts[32];
+  };
+
+  static const char* FILE_MAGIC() { return "OGNOCTB"; }
+  static uint32_t FILE_VERSION() { return 1; }
+
+  static size_t file_values_offset(uint64_t num_elements, uint32_t key_size)
+  {
+      size_t offset = sizeof(FileHeader) + num_elements * key_size;
+      return (offset + 7) & ~size_t(7);
+  }
+
+  static size_t file_size(uint64_t num_elements, uint32_t key_size, uint32_t value_size)
+  {
+      return file_values_offset(num_elements, key_size) + num_elements * value_size;
+  }
+
+  /// Size of a record of a shard file, see write_binary_record.
+  static size_t record_size(const FileHeader& header)
+  {
+      return (file_size(header.num_elements, header.key_size, header.value_size) + 7) & ~size_t(7);
+  }
+
+  /// Returns true if fname is in the binary format; the boost text format is assumed otherwise.
+  static bool is_binary_file(const std::string& fname)
+  {
+      char magic[sizeof(((FileHeader*)0)->magic)];
+      std::ifstream ff(fname.c_str(), std::ios_base::binary);
+      ff.read(magic, sizeof(magic));
+      return ff.gcount() == sizeof(magic) && !memcmp(magic, FILE_MAGIC(), sizeof(magic));
+  }
+
+  static bool check_file_header(const FileHeader& header, size_t value_size, size_t size, const std::string& fname)
+  {
+      if(memcmp(header.magic, FILE_MAGIC(), sizeof(header.magic)))
+      {
+          std::cerr << "Error: " << fname << " is not a binary octree file" << std::endl;
+          return false;
+      }
+      if(header.version != FILE_VERSION())
+      {
+          std::cerr << "Error: " << fname << " has unsupported version " << header.version << std::endl;
+          return false;
+      }
+      if((header.key_size != sizeof(uint32_t) && header.key_size != sizeof(uint64_t)) ||
+          header.value_size != value_size)
+      {
+          std::cerr << "Error: " << fname << " stores " << header.key_size << " byte keys and " << header.value_size
+                    << " byte values, expected 4 or 8 byte keys and " << value_size << " byte values" << std::endl;
+          return false;
+      }
+      if(header.max_level > MAX_LEVEL())
+      {
+          std::cerr << "Error: " << fname << " has " << header.max_level << " levels, but keys of "
+                    << sizeof(KEY) << " bytes support only " << MAX_LEVEL() << std::endl;
+          return false;
+      }
+      if(size < file_size(header.num_elements, header.key_size, header.value_size))
+      {
+          std::cerr << "Error: " << fname << " is truncated" << std::endl;
+          return false;
+      }
+      return true;
+  }
+
+  /// Writes num_elements (key, value) pairs; keys must be in ascending order.
+  template <class VALUE>
+  static void write_binary_file(const std::string& fname, int max_level, const KEY* keys, const VALUE* values,
+      size_t num_elements)
+  {
+      std::ofstream ff(fname.c_str(), std::ios_base::binary);
+      write_binary_record(ff, max_level, keys, values, num_elements, false);
+      ff.flush();
+      ff.close();
+  }
+
+  /// Writes the binary format of num_elements (key, value) pairs at the
+  /// current position of ff. A shard file is a sequence of such records,
+  /// each padded to a multiple of 8 bytes with pad, see read_shard_record.
+  template <class VALUE>
+  static void write_binary_record(std::ostream& ff, int max_level, const KEY* keys, const VALUE* values,
+      size_t num_elements, bool pad)
+  {
+      FileHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, FILE_MAGIC(), sizeof(header.magic));
+      header.version = FILE_VERSION();
+      header.key_size = sizeof(KEY);
+      header.value_size = sizeof(VALUE);
+      header.num_elements = num_elements;
+      for(size_t i=0; i<num_elements; i++)
+      {
+          if(keys[i] == INVALID_KEY()) continue;
+          int level = compute_level(keys[i]);
+          header.level_counts[level]++;
+          if(level > max_level) max_level = level;
+      }
+      header.max_level = max_level;
+
+      ff.write((const char*)&header, sizeof(header));
+      ff.write((const char*)keys, num_elements * sizeof(KEY));
+      const char padding[8] = {0};
+      ff.write(padding, file_values_offset(num_elements, sizeof(KEY)) - sizeof(header) - num_elements * sizeof(KEY));
+      ff.write((const char*)values, num_elements * sizeof(VALUE));
+      if(pad) ff.write(padding, record_size(header) - file_size(num_elements, sizeof(KEY), sizeof(VALUE)));
+  }
+
+  /// Reads a binary file into key and value arrays in ascending key order.
+  /// Keys stored with the other width are converted.
+  template <class VALUE>
+  static bool read_binary_file(const std::string& fname, int& max_level, std::vector<KEY>& keys,
+      std::vector<VALUE>& values)
+  {
+      std::ifstream ff(fname.c_str(), std::ios_base::binary);
+      ff.seekg(0, std::ios_base::end);
+      size_t size = ff.tellg();
+      ff.seekg(0, std::ios_base::beg);
+      return read_binary_record(ff, size, fname, max_level, keys, values);
+  }
+
+  /// Reads record index of a shard file written with write_binary_record.
+  template <class VALUE>
+  static bool read_shard_record(const std::string& fname, int index, int& max_level, std::vector<KEY>& keys,
+      std::vector<VALUE>& values)
+  {
+      std::ifstream ff(fname.c_str(), std::ios_base::binary);
+      ff.seekg(0, std::ios_base::end);
+      size_t size = ff.tellg();
+      size_t offset = 0;
+      for(int i=0; i<index; i++)
+      {
+          FileHeader header;
+          memset(&header, 0, sizeof(header));
+          ff.seekg(offset, std::ios_base::beg);
+          ff.read((char*)&header, sizeof(header));
+          if(!check_file_header(header, sizeof(VALUE), size - offset, fname)) return false;
+          offset += record_size(header);
+          if(offset >= size)
+          {
+              std::cerr << "Error: " << fname << " has only " << i + 1 << " records" << std::endl;
+              return false;
+          }
+      }
+      ff.seekg(offset, std::ios_base::beg);
+      return read_binary_record(ff, size, fname, max_level, keys, values);
+  }
+
+  /// Reads the binary record at the current position of ff, which has size
+  /// bytes in total, into key and value arrays in ascending key order. Keys
+  /// stored with the other width are converted.
+  template <class VALUE>
+  static bool read_binary_record(std::istream& ff, size_t size, const std::string& fname, int& max_level,
+      std::vector<KEY>& keys, std::vector<VALUE>& values)
+  {
+      const size_t start = ff.tellg();
+      FileHeader header;
+      memset(&header, 0, sizeof(header));
+      ff.read((char*)&header, sizeof(header));
+      if(!check_file_header(header, sizeof(VALUE), size - start, fname)) return false;
+
+      keys.resize(header.num_elements);
+      values.resize(header.num_elements);
+      if(header.key_size == sizeof(KEY))
+      {
+          ff.read((char*)keys.data(), header.num_elements * sizeof(KEY));
+      }
+      else if(header.key_size == sizeof(uint32_t))
+      {
+          read_converted_keys<uint32_t>(ff, keys);
+      }
+      else
+      {
+          read_converted_keys<uint64_t>(ff, keys);
+      }
+      ff.seekg(start + file_values_offset(header.num_elements, header.key_size), std::ios_base::beg);
+      ff.read((char*)values.data(), header.num_elements * sizeof(VALUE));
+
+      max_level = header.max_level;
+      return true;
+  }
+
+  /// Collects the cells of the octree of a cubic voxel grid with a power of two
+  /// side: 2x2x2 sibling groups of equal value are merged bottom-up into their
+  /// parent, down to min_level. Linear in the number of voxels and needs no
+  /// scratch memory besides the cells. The subtrees below the cells of
+  /// PARALLEL_LEVEL are built in parallel when compiled with OpenMP.
+  /// GRID provides depth() and uniform_block(), see GeneralVoxelGrid.
+  template <class GRID, class VALUE>
+  static void collect_voxel_grid_cells(GRID& vg, int min_level, int& max_level,
+      std::vector<std::pair<KEY, VALUE> >& cells)
+  {
+      const int PARALLEL_LEVEL = 2;
+      max_level = log2((float)vg.depth());
+      const int top_level = std::max(0, std::min(min_level, max_level));
+      const int split_level = std::max(top_level, std::min(PARALLEL_LEVEL, max_level));
+      const int num_split = 1 << (3 * split_level);
+
+      // cells below every split cell, and whether the split cell itself is uniform
+      std::vector<std::vector<std::pair<KEY, VALUE> > > subtree_cells(num_split);
+      std::vector<char> uniform(num_split);
+      std::vector<VALUE> values(num_split);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for(int m=0; m<num_split; m++)
+      {
+          uint32_t x, y, z;
+          inverse_morton_3d(x, y, z, m);
+          KEY key = KEY(m) | (KEY(1) << 3 * split_level);
+          uniform[m] = collect_subtree_cells(vg, key, split_level, max_level, x, y, z, values[m], subtree_cells[m]);
+      }
+
+      size_t num_cells = 0;
+      for(int m=0; m<num_split; m++) num_cells += subtree_cells[m].size() + 1;
+      cells.reserve(cells.size() + num_cells);
+      for(int m=0; m<num_split; m++)
+      {
+          cells.insert(cells.end(), subtree_cells[m].begin(), subtree_cells[m].end());
+          std::vector<std::pair<KEY, VALUE> >().swap(subtree_cells[m]);
+      }
+
+      // merge the split cells up to top_level; children of cell m are 8m .. 8m+7
+      for(int level=split_level; level>top_level; level--)
+      {
+          const int num_parents = 1 << (3 * (level - 1));
+          for(int m=0; m<num_parents; m++)
+          {
+              bool merge = true;
+              for(int i=0; i<8; i++) merge = merge && uniform[8 * m + i] && values[8 * m + i] == values[8 * m];
+              if(!merge)
+              {
+                  for(int i=0; i<8; i++)
+                  {
+                      if(uniform[8 * m + i]) cells.push_back(std::make_pair(KEY(8 * m + i) | (KEY(1) << 3 * level), values[8 * m + i]));
+                  }
+              }
+              uniform[m] = merge;
+              values[m] = values[8 * m];
+          }
+      }
+      for(int m=0; m<(1 << (3 * top_level)); m++)
+      {
+          if(uniform[m]) cells.push_back(std::make_pair(KEY(m) | (KEY(1) << 3 * top_level), values[m]));
+      }
+  }
+
+private:
+
+  template <class FILE_KEY>
+  static void read_converted_keys(std::istream& ff, std::vector<KEY>& keys)
+  {
+      std::vector<FILE_KEY> file_keys(keys.size());
+      ff.read((char*)file_keys.data(), file_keys.size() * sizeof(FILE_KEY));
+      std::copy(file_keys.begin(), file_keys.end(), keys.begin());
+  }
+
+  /// Returns true and the value of the cell (x, y, z) at level if its block
+  /// of the grid is uniform. Otherwise appends the largest uniform cells
+  /// of its subtree to cells.
+  template <class GRID, class VALUE>
+  static bool collect_subtree_cells(GRID& vg, KEY key, int level, int max_level, int x, int y, int z,
+      VALUE& value, std::vector<std::pair<KEY, VALUE> >& cells)
+  {
+      const int size = 1 << (max_level - level);
+      typename GRID::value_type grid_value;
+      if(vg.uniform_block(x * size, y * size, z * size, size, grid_value))
+      {
+          value = grid_value;
+          return true;
+      }
+
+      // child i is offset by the morton bits of i: x by bit 0, y by bit 1, z by bit 2
+      VALUE child_values[8];
+      bool child_uniform[8];
+      bool merge = true;
+      for(int i=0; i<8; i++)
+      {
+          child_uniform[i] = collect_subtree_cells(vg, (key << 3) | i, level + 1, max_level,
+              2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + ((i >> 2) & 1), child_values[i], cells);
+          merge = merge && child_uniform[i] && child_values[i] == child_values[0];
+      }
+      if(merge)
+      {
+          value = child_values[0];
+          return true;
+      }
+      for(int i=0; i<8; i++)
+      {
+          if(child_uniform[i]) cells.push_back(std::make_pair((key << 3) | i, child_values[i]));
+      }
+      return false;
+  }
+
+};
+
+template <class VALUE, class KEY_TYPE = unsigned int>
+class GeneralOctree : public OctreeBase<KEY_TYPE>
+{
+
+public:
+  typedef OctreeBase<KEY_TYPE> Base;
+  typedef typename Base::KEY KEY;
+  using Base::INVALID_KEY;
+  using Base::compute_level;
+  using Base::compute_key;
+  using Base::compute_coord;
+  using Base::compute_coords;
+  using Base::resolution_from_level;
+
+private:
+  typedef std::tr1::unordered_map<KEY, VALUE> HashTable;
+
+  HashTable _hash_table;
+  int _max_level;
+
+  /// Resolution of level for the bounds of get_neighbor_keys: 2^level, halved
+  /// for every level the octree has below level.
+  int neighbor_resolution(int level) const
+  {
+      const int shift = level - std::max(0, _max_level - level);
+      return shift < 0 ? 0 : 1 << shift;
+  }
+
+  /// Writes the cells in the binary format, which needs them sorted by key.
+  void write_binary(std::ostream& ff, bool pad)
+  {
+      std::vector<std::pair<KEY, VALUE> > elements(_hash_table.begin(), _hash_table.end());
+      std::sort(elements.begin(), elements.end());
+
+      std::vector<KEY> keys(elements.size());
+      std::vector<VALUE> values(elements.size());
+      for(size_t i=0; i<elements.size(); i++)
+      {
+        keys[i] = elements[i].first;
+        values[i] = elements[i].second;
+      }
+      Base::write_binary_record(ff, _max_level, keys.data(), values.data(), keys.size(), pad);
+  }
+
+public:
+
+  GeneralOctree(int max_level = -1)
+  {
+      _max_level = max_level;
+  }
+
+  typedef typename HashTable::iterator iterator;
+  typedef typename HashTable::const_iterator const_iterator;
+  iterator begin() { return _hash_table.begin(); }
+  iterator end() { return _hash_table.end(); }
+
   int num_elements() {return _hash_table.size();}
 
+  /// Approximate heap footprint: the bucket array plus one node per element.
+  size_t memory_bytes() const
+  {
+      return _hash_table.bucket_count() * sizeof(void*) +
+          _hash_table.size() * (sizeof(std::pair<KEY, VALUE>) + sizeof(void*));
+  }
+
   void add_element(KEY key, VALUE value)
   {
       _hash_table[key] = value;
   }
 
+  /// Replaces the content with num_elements parallel keys and values.
+  void assign(const KEY* keys, const VALUE* values, int num_elements)
+  {
+      _hash_table.clear();
+      _hash_table.rehash(num_elements);
+      for(int i=0; i<num_elements; i++) _hash_table[keys[i]] = values[i];
+  }
+
   std::pair<KEY, VALUE> get_element(int i)
   {
       typename std::map<KEY, VALUE>::iterator it = _hash_table.begin();
@@ -114,44 +558,77 @@ public:
       return *it;
   }
 
-  std::vector<KEY> get_neighbor_keys(KEY key, int nbh_size)
+  /// Writes the keys of the nbh_size^3 neighbors of key (see compute_neighbor_keys)
+  /// to neighbors, INVALID_KEY() for those not in the octree. neighbors must
+  /// hold nbh_size^3 keys.
+  void get_neighbor_keys(KEY key, int nbh_size, KEY* neighbors)
   {
-    std::vector<KEY> ret;
-
-    OctreeCoord c = compute_coord(key);
-    int res = resolution_from_level(c.l);
-
-    for(int i=0; i<(_max_level - c.l); i++) res /= 2;
+      Base::compute_neighbor_keys(key, nbh_size, neighbor_resolution(compute_level(key)), neighbors);
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      for(int i=0; i<num_neighbors; i++)
+      {
+          if(neighbors[i] != INVALID_KEY() && !(_hash_table.find(neighbors[i]) != _hash_table.end())) neighbors[i] = INVALID_KEY();
+      }
+  }
 
-    int min_ind = -nbh_size / 2;
-    int max_ind = nbh_size / 2;
-    if(nbh_size % 2 == 0) min_ind += 1;
+  /// Batched get_neighbor_keys for num_keys keys, typically of one level;
+  /// the neighbors of keys[n] start at neighbors[n * nbh_size^3].
+  void get_neighbor_keys(const KEY* keys, int num_keys, int nbh_size, KEY* neighbors)
+  {
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      int level = -1, res = 0;
+      for(int n=0; n<num_keys; n++)
+      {
+          if(compute_level(keys[n]) != level)
+          {
+              level = compute_level(keys[n]);
+              res = neighbor_resolution(level);
+          }
+          KEY* key_neighbors = neighbors + n * num_neighbors;
+          Base::compute_neighbor_keys(keys[n], nbh_size, res, key_neighbors);
+          for(int i=0; i<num_neighbors; i++)
+          {
+              if(key_neighbors[i] != INVALID_KEY() && !(_hash_table.find(key_neighbors[i]) != _hash_table.end())) key_neighbors[i] = INVALID_KEY();
+          }
+      }
+  }
 
-    for(int i=min_ind; i<=max_ind; i++)
-    {
-      for(int j=min_ind; j<=max_ind; j++)
+  /// Values of the neighbors of num_keys keys, as get_neighbor_keys followed
+  /// by get_value but with a single lookup per neighbor: the values of the
+  /// neighbors of keys[n] start at values[n * nbh_size^3], -1 for those not
+  /// in the octree.
+  void get_neighbor_values(const KEY* keys, int num_keys, int nbh_size, VALUE* values)
+  {
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      std::vector<KEY> neighbors(num_neighbors);
+      int level = -1, res = 0;
+      for(int n=0; n<num_keys; n++)
       {
-        for(int k=min_ind; k<=max_ind; k++)
-        {
-          if(c.x+i < 0 || c.x+i >= res)      ret.push_back(INVALID_KEY());
-          else if(c.y+j < 0 || c.y+j >= res) ret.push_back(INVALID_KEY());
-          else if(c.z+k < 0 || c.z+k >= res) ret.push_back(INVALID_KEY());
-          else
+          if(compute_level(keys[n]) != level)
           {
-            OctreeCoord nb_c;
-            nb_c.x = c.x+i; nb_c.y = c.y+j; nb_c.z = c.z+k; nb_c.l = c.l;
-            KEY new_code = compute_key(nb_c);
-            //typename std::map<KEY, VALUE>::iterator it = _hash_table.find(new_code);
-            typename std::tr1::unordered_map<KEY, VALUE>::iterator it = _hash_table.find(new_code);
-
-            if(it != _hash_table.end()) ret.push_back(it->first);
-            else ret.push_back(INVALID_KEY());
+              level = compute_level(keys[n]);
+              res = neighbor_resolution(level);
+          }
+          Base::compute_neighbor_keys(keys[n], nbh_size, res, neighbors.data());
+          VALUE* key_values = values + n * num_neighbors;
+          for(int i=0; i<num_neighbors; i++)
+          {
+              if(neighbors[i] == INVALID_KEY())
+              {
+                  key_values[i] = -1;
+                  continue;
+              }
+              typename HashTable::const_iterator it = _hash_table.find(neighbors[i]);
+              key_values[i] = it != _hash_table.end() ? it->second : VALUE(-1);
           }
-        }
       }
-    }
+  }
 
-    return ret;
+  std::vector<KEY> get_neighbor_keys(KEY key, int nbh_size)
+  {
+      std::vector<KEY> ret(nbh_size * nbh_size * nbh_size);
+      get_neighbor_keys(key, nbh_size, ret.data());
+      return ret;
   }
 
   VALUE get_value(KEY key, bool use_vg_info = false)
@@ -176,135 +653,66 @@ public:
       }
   }
 
-  OccupancyVoxelGrid to_voxel_grid()
+  /// get_value of num_keys keys, -1 for the missing ones; the interface of
+  /// the merge-join lookup of SortedOctree, whose keys must be ascending.
+  void get_values(const KEY* keys, int num_keys, bool use_vg_info, VALUE* values)
   {
-      int resolution = pow(2, _max_level);
-      OccupancyVoxelGrid ret(resolution, resolution, resolution);
-
-      int counter = 0;
-      for(typename std::tr1::unordered_map<KEY, VALUE>::iterator iter = _hash_table.begin(); iter != _hash_table.end(); ++iter)
-      {
-          int level = compute_level(iter->first);
-
-          KEY code = (iter->first & ~(KEY(1) << level * 3)) << (_max_level - level) * 3;
-          OctreeCoord c;
-          c.l = level;
-          KEY x, y, z;
-          inverse_morton_3d(x, y, z, code);
-          c.x = x;
-          c.y = y;
-          c.z = z;
-
-          int len = int(pow(2, _max_level - level));
-          for(int i=0; i < len; i++)
-          {
-              for(int j=0; j < len; j++)
-              {
-                  for(int k=0; k < len; k++)
-                  {
-                      if(iter->second) ret.set_element(x + i, y + j, z + k, iter->second);
-                  }
-              }
-          }
-          counter++;
-      }
-      return ret;
+      for(int i=0; i<num_keys; i++) values[i] = get_value(keys[i], use_vg_info);
   }
 
-  void from_voxel_grid(GeneralVoxelGrid<VALUE>& vg, int min_level)
+  OccupancyVoxelGrid to_voxel_grid()
   {
-      int level = log2((float)vg.depth());
-      int dim = vg.depth();
-
-      _max_level = level;
-
-      KEY *keys_arr = new KEY[dim*dim*dim];
-      VALUE *values_arr = new VALUE[dim*dim*dim];
+      int resolution = pow(2, _max_level);
+      OccupancyVoxelGrid ret(resolution, resolution, resolution);
 
-      //initially fill the hash map
-      for(unsigned int i=0; i<vg.depth(); i++)
+      // the occupied cells are decoded in batches
+      KEY keys[Base::BATCH_SIZE];
+      VALUE values[Base::BATCH_SIZE];
+      uint32_t x[Base::BATCH_SIZE], y[Base::BATCH_SIZE], z[Base::BATCH_SIZE];
+      typename HashTable::iterator iter = _hash_table.begin();
+      while(iter != _hash_table.end())
       {
-          for(unsigned int j=0; j<vg.width(); j++)
+          int num = 0;
+          for(; iter != _hash_table.end() && num < Base::BATCH_SIZE; ++iter)
           {
-              for(unsigned int k=0; k<vg.height(); k++)
-              {
-                  VALUE val = vg.get_element(i, j, k);
-                  OctreeCoord crd;
-                  crd.x = i; crd.y = j; crd.z = k; crd.l = level;
-                  KEY key = compute_key(crd);
-                  keys_arr[i*dim*dim + j*dim + k] = key;
-                  values_arr[i*dim*dim + j*dim + k] = val;
-              }
+              if(!iter->second) continue;
+              keys[num] = iter->first;
+              values[num] = iter->second;
+              num++;
           }
-      }
+          compute_coords(_max_level, keys, x, y, z, num);
 
-      while(level > min_level)
-      {
-          int step = pow(2, _max_level - level + 1);
-          for(unsigned int i=0; i<vg.depth(); i+=step)
+          for(int n=0; n<num; n++)
           {
-              for(unsigned int j=0; j<vg.width(); j+=step)
+              int len = 1 << (_max_level - compute_level(keys[n]));
+              for(int i=0; i < len; i++)
               {
-                  for(unsigned int k=0; k<vg.height(); k+=step)
+                  for(int j=0; j < len; j++)
                   {
-                      KEY key = keys_arr[i*dim*dim + j*dim + k];
-                      if(compute_level(key) == level)
+                      for(int k=0; k < len; k++)
                       {
-                          VALUE comp_val = 0;
-                          int el_count = 0;
-                          for(int ii=0; ii<2; ii++)
-                          {
-                              for(int jj=0; jj<2; jj++)
-                              {
-                                  for(int kk=0; kk<2; kk++)
-                                  {
-                                      KEY comp_key = keys_arr[(i+ii*step/2)*dim*dim + (j+jj*step/2)*dim + k+kk*step/2];
-                                      int comp_lev = compute_level(comp_key);
-                                      if(comp_lev == level)
-                                      {
-                                          VALUE val = values_arr[(i+ii*step/2)*dim*dim + (j+jj*step/2)*dim + k+kk*step/2];
-                                          if(val == CLASS_FILLED) comp_val += 1;
-                                          el_count += 1;
-                                      }
-                                  }
-                              }
-                          }
-
-                          if( (comp_val==0 || comp_val==8) && el_count==8 )
-                          {
-                              KEY new_key = key >> 3;
-                              for(int ii=0; ii<step; ii++)
-                              {
-                                  for(int jj=0; jj<step; jj++)
-                                  {
-                                      for(int kk=0; kk<step; kk++)
-                                      {
-                                          keys_arr[(i+ii)*dim*dim + (j+jj)*dim + k+kk] = new_key;
-                                      }
-                                  }
-                              }
-                          }
+                          ret.set_element(x[n] + i, y[n] + j, z[n] + k, values[n]);
                       }
                   }
               }
           }
-          level--;
       }
+      return ret;
+  }
 
-      for(unsigned int i=0; i<vg.depth(); i++)
+  /// Builds the octree of a voxel grid, see collect_voxel_grid_cells. GRID is
+  /// a GeneralVoxelGrid or, to skip the dense grid, a RunLengthVoxelGrid.
+  template <class GRID>
+  void from_voxel_grid(GRID& vg, int min_level)
+  {
+      std::vector<std::pair<KEY, VALUE> > cells;
+      Base::collect_voxel_grid_cells(vg, min_level, _max_level, cells);
+
+      _hash_table.rehash(_hash_table.size() + cells.size());
+      for(size_t i=0; i<cells.size(); i++)
       {
-          for(unsigned int j=0; j<vg.width(); j++)
-          {
-              for(unsigned int k=0; k<vg.height(); k++)
-              {
-                  KEY key = keys_arr[i*dim*dim + j*dim + k];
-                  _hash_table[key] = values_arr[i*dim*dim + j*dim + k];
-              }
-          }
+          _hash_table[cells[i].first] = cells[i].second;
       }
-
-      delete[] keys_arr;
-      delete[] values_arr;
   }
 
   void to_file(std::string fname)
@@ -321,9 +729,44 @@ public:
       ff.close();
   }
 
-  void from_file(std::string fname)
+  void to_binary_file(std::string fname)
   {
+      std::ofstream ff(fname.c_str(), std::ios_base::binary);
+      write_binary(ff, false);
+      ff.flush();
+      ff.close();
+  }
+
+  /// Appends the octree as a record of a shard file, see OctreeBase::write_binary_record.
+  void to_shard(std::ostream& ff)
+  {
+      write_binary(ff, true);
+  }
+
+  /// Reads both the boost text and the binary format. Returns false, and
+  /// leaves the octree unchanged, if fname cannot be opened or is not a valid
+  /// binary file; errors in the text format throw.
+  bool from_file(std::string fname)
+  {
+      if(Base::is_binary_file(fname))
+      {
+          std::vector<KEY> keys;
+          std::vector<VALUE> values;
+          int max_level;
+          if(!Base::read_binary_file(fname, max_level, keys, values)) return false;
+
+          _hash_table.rehash(keys.size());
+          for(size_t i=0; i<keys.size(); i++) _hash_table.insert(std::pair<KEY, VALUE>(keys[i], values[i]));
+          if(max_level > _max_level) _max_level = max_level;
+          return true;
+      }
+
       std::ifstream ff(fname.c_str(), std::ios_base::binary);
+      if(!ff.good())
+      {
+          std::cerr << "Error: cannot open " << fname << std::endl;
+          return false;
+      }
       boost::archive::text_iarchive iarch(ff);
       std::map<KEY, VALUE> tmp_map;
       iarch >> tmp_map;
@@ -335,6 +778,7 @@ public:
         int level = compute_level(it->first);
         if(level > _max_level) _max_level = level;
       }
+      return true;
   }
 
 };
@@ -0,0 +1,460 @@
+#ifndef SORTED_OCTREE_H_
+#define SORTED_OCTREE_H_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <boost/serialization/map.hpp>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+
+#include "octree.h"
+
+/// Octree backend that keeps the cells in two contiguous arrays: the keys in
+/// ascending (morton) order and the values in parallel. Since the level bit
+/// is the most significant set bit of a key, the keys of one level form a
+/// contiguous range; a per-level offset table narrows every binary search to
+/// the level of the queried key. Iteration is deterministic and linear in
+/// memory. Exposes the same interface as GeneralOctree.
+template <class VALUE, class KEY_TYPE = unsigned int>
+class SortedOctree : public OctreeBase<KEY_TYPE>
+{
+
+public:
+  typedef OctreeBase<KEY_TYPE> Base;
+  typedef typename Base::KEY KEY;
+  using Base::MAX_LEVEL;
+  using Base::INVALID_KEY;
+  using Base::compute_level;
+  using Base::compute_key;
+  using Base::compute_coord;
+  using Base::compute_coords;
+  using Base::resolution_from_level;
+
+private:
+  std::vector<KEY> _keys;
+  std::vector<VALUE> _values;
+  // _level_offsets[l] is the index of the first key of level >= l
+  std::vector<int> _level_offsets;
+  int _max_level;
+
+  static int key_level(KEY key)
+  {
+      if(key == INVALID_KEY()) return 0;
+      return compute_level(key);
+  }
+
+  int find_index(KEY key) const
+  {
+      int level = key_level(key);
+      if(level > MAX_LEVEL()) return -1;
+      typename std::vector<KEY>::const_iterator first = _keys.begin() + _level_offsets[level];
+      typename std::vector<KEY>::const_iterator last = _keys.begin() + _level_offsets[level + 1];
+      typename std::vector<KEY>::const_iterator it = std::lower_bound(first, last, key);
+      if(it != last && *it == key) return it - _keys.begin();
+      return -1;
+  }
+
+  /// Resolution of level for the bounds of get_neighbor_keys: 2^level, halved
+  /// for every level the octree has below level.
+  int neighbor_resolution(int level) const
+  {
+      const int shift = level - std::max(0, _max_level - level);
+      return shift < 0 ? 0 : 1 << shift;
+  }
+
+  void rebuild_level_offsets()
+  {
+      _level_offsets.assign(MAX_LEVEL() + 2, 0);
+      int ind = 0;
+      for(int l=0; l<=MAX_LEVEL(); l++)
+      {
+          _level_offsets[l] = ind;
+          while(ind < _keys.size() && key_level(_keys[ind]) == l) ind++;
+      }
+      _level_offsets[MAX_LEVEL() + 1] = _keys.size();
+  }
+
+public:
+
+  /// Proxy giving iterators the (first, second) interface of a map entry.
+  struct reference
+  {
+      const KEY& first;
+      VALUE& second;
+
+      reference(const KEY& k, VALUE& v) : first(k), second(v) {}
+      reference* operator->() { return this; }
+  };
+
+  class iterator
+  {
+      const KEY* _key;
+      VALUE* _value;
+
+  public:
+      iterator(const KEY* key, VALUE* value) : _key(key), _value(value) {}
+
+      reference operator*() const { return reference(*_key, *_value); }
+      reference operator->() const { return reference(*_key, *_value); }
+      iterator& operator++() { ++_key; ++_value; return *this; }
+      iterator operator++(int) { iterator ret = *this; ++(*this); return ret; }
+      bool operator==(const iterator& other) const { return _key == other._key; }
+      bool operator!=(const iterator& other) const { return _key != other._key; }
+  };
+
+  SortedOctree(int max_level = -1)
+  {
+      _max_level = max_level;
+      _level_offsets.assign(MAX_LEVEL() + 2, 0);
+  }
+
+  iterator begin() { return iterator(_keys.data(), _values.data()); }
+  iterator end() { return iterator(_keys.data() + _keys.size(), _values.data() + _values.size()); }
+
+  int num_elements() {return _keys.size();}
+
+  size_t memory_bytes() const
+  {
+      return _keys.capacity() * sizeof(KEY) + _values.capacity() * sizeof(VALUE) +
+          _level_offsets.capacity() * sizeof(int);
+  }
+
+  const KEY* keys() const { return _keys.data(); }
+  const VALUE* values() const { return _values.data(); }
+
+  void reserve(int num_elements)
+  {
+      _keys.reserve(num_elements);
+      _values.reserve(num_elements);
+  }
+
+  /// Appending keys in ascending order is O(1); out-of-order keys are
+  /// inserted in place, which is cheap when they land close to the end,
+  /// as is the case for neighbors collected during a morton-order traversal.
+  void add_element(KEY key, VALUE value)
+  {
+      if(_keys.empty() || key > _keys.back())
+      {
+          _keys.push_back(key);
+          _values.push_back(value);
+      }
+      else
+      {
+          typename std::vector<KEY>::iterator it = std::lower_bound(_keys.begin(), _keys.end(), key);
+          int ind = it - _keys.begin();
+          if(*it == key)
+          {
+              _values[ind] = value;
+              return;
+          }
+          _keys.insert(it, key);
+          _values.insert(_values.begin() + ind, value);
+      }
+      for(int l=key_level(key)+1; l<=MAX_LEVEL()+1; l++) _level_offsets[l]++;
+  }
+
+  std::pair<KEY, VALUE> get_element(int i)
+  {
+      return std::pair<KEY, VALUE>(_keys[i], _values[i]);
+  }
+
+  /// Writes the keys of the nbh_size^3 neighbors of key (see compute_neighbor_keys)
+  /// to neighbors, INVALID_KEY() for those not in the octree. neighbors must
+  /// hold nbh_size^3 keys.
+  void get_neighbor_keys(KEY key, int nbh_size, KEY* neighbors)
+  {
+      Base::compute_neighbor_keys(key, nbh_size, neighbor_resolution(compute_level(key)), neighbors);
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      for(int i=0; i<num_neighbors; i++)
+      {
+          if(neighbors[i] != INVALID_KEY() && !(find_index(neighbors[i]) != -1)) neighbors[i] = INVALID_KEY();
+      }
+  }
+
+  /// Batched get_neighbor_keys for num_keys keys, typically of one level;
+  /// the neighbors of keys[n] start at neighbors[n * nbh_size^3].
+  void get_neighbor_keys(const KEY* keys, int num_keys, int nbh_size, KEY* neighbors)
+  {
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      int level = -1, res = 0;
+      for(int n=0; n<num_keys; n++)
+      {
+          if(compute_level(keys[n]) != level)
+          {
+              level = compute_level(keys[n]);
+              res = neighbor_resolution(level);
+          }
+          KEY* key_neighbors = neighbors + n * num_neighbors;
+          Base::compute_neighbor_keys(keys[n], nbh_size, res, key_neighbors);
+          for(int i=0; i<num_neighbors; i++)
+          {
+              if(key_neighbors[i] != INVALID_KEY() && !(find_index(key_neighbors[i]) != -1)) key_neighbors[i] = INVALID_KEY();
+          }
+      }
+  }
+
+  /// Values of the neighbors of num_keys keys, as get_neighbor_keys followed
+  /// by get_value but with a single lookup per neighbor: the values of the
+  /// neighbors of keys[n] start at values[n * nbh_size^3], -1 for those not
+  /// in the octree.
+  void get_neighbor_values(const KEY* keys, int num_keys, int nbh_size, VALUE* values)
+  {
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      std::vector<KEY> neighbors(num_neighbors);
+      int level = -1, res = 0;
+      for(int n=0; n<num_keys; n++)
+      {
+          if(compute_level(keys[n]) != level)
+          {
+              level = compute_level(keys[n]);
+              res = neighbor_resolution(level);
+          }
+          Base::compute_neighbor_keys(keys[n], nbh_size, res, neighbors.data());
+          VALUE* key_values = values + n * num_neighbors;
+          for(int i=0; i<num_neighbors; i++)
+          {
+              if(neighbors[i] == INVALID_KEY())
+              {
+                  key_values[i] = -1;
+                  continue;
+              }
+              const int ind = find_index(neighbors[i]);
+              key_values[i] = ind != -1 ? _values[ind] : VALUE(-1);
+          }
+      }
+  }
+
+  std::vector<KEY> get_neighbor_keys(KEY key, int nbh_size)
+  {
+      std::vector<KEY> ret(nbh_size * nbh_size * nbh_size);
+      get_neighbor_keys(key, nbh_size, ret.data());
+      return ret;
+  }
+
+  VALUE get_value(KEY key, bool use_vg_info = false)
+  {
+      int ind = find_index(key);
+      if(ind != -1) return _values[ind];
+      else
+      {
+          if(use_vg_info)
+          {
+              KEY inner_key = key;
+              int level = compute_level(key);
+              for(int i=0; i<level; i++)
+              {
+                  inner_key >>= 3;
+                  ind = find_index(inner_key);
+                  if(ind != -1)
+                    return _values[ind];
+              }
+          }
+          return -1;
+      }
+  }
+
+  /// get_value of num_keys keys in ascending order, -1 for the missing ones.
+  /// Every level of the octree is merged once with the keys, or with their
+  /// ancestors of that level, instead of a binary search per key and ancestor.
+  void get_values(const KEY* keys, int num_keys, bool use_vg_info, VALUE* values)
+  {
+      std::fill(values, values + num_keys, VALUE(-1));
+      std::vector<char> found(num_keys, 0);
+      int first = 0;
+      while(first < num_keys)
+      {
+          // the keys of one level are contiguous
+          const int level = key_level(keys[first]);
+          int last = first;
+          while(last < num_keys && key_level(keys[last]) == level) last++;
+
+          const int min_level = use_vg_info ? 0 : level;
+          for(int l=level; l>=min_level; l--)
+          {
+              int ind = _level_offsets[l];
+              const int end = _level_offsets[l + 1];
+              const int shift = 3 * (level - l);
+              for(int i=first; i<last && ind<end; i++)
+              {
+                  if(found[i]) continue;
+                  const KEY ancestor = keys[i] >> shift;
+                  while(ind < end && _keys[ind] < ancestor) ind++;
+                  if(ind < end && _keys[ind] == ancestor)
+                  {
+                      values[i] = _values[ind];
+                      found[i] = 1;
+                  }
+              }
+          }
+          first = last;
+      }
+  }
+
+  /// Replaces the content with the (key, value) pairs of any octree-like range.
+  template <class ITERATOR>
+  void assign(ITERATOR first, ITERATOR last)
+  {
+      std::vector<std::pair<KEY, VALUE> > elements;
+      for(ITERATOR it=first; it!=last; it++)
+      {
+          elements.push_back(std::pair<KEY, VALUE>(it->first, it->second));
+      }
+      std::sort(elements.begin(), elements.end());
+
+      _keys.clear();
+      _values.clear();
+      reserve(elements.size());
+      for(int i=0; i<elements.size(); i++)
+      {
+          _keys.push_back(elements[i].first);
+          _values.push_back(elements[i].second);
+      }
+      rebuild_level_offsets();
+  }
+
+  /// Replaces the content with num_elements parallel keys and values. Linear
+  /// if the keys are in ascending order, as when generated in morton order.
+  void assign(const KEY* keys, const VALUE* values, int num_elements)
+  {
+      bool ascending = true;
+      for(int i=1; i<num_elements && ascending; i++) ascending = keys[i - 1] < keys[i];
+      if(!ascending)
+      {
+          std::vector<std::pair<KEY, VALUE> > elements(num_elements);
+          for(int i=0; i<num_elements; i++) elements[i] = std::pair<KEY, VALUE>(keys[i], values[i]);
+          assign(elements.begin(), elements.end());
+          return;
+      }
+      _keys.assign(keys, keys + num_elements);
+      _values.assign(values, values + num_elements);
+      rebuild_level_offsets();
+  }
+
+  OccupancyVoxelGrid to_voxel_grid()
+  {
+      int resolution = pow(2, _max_level);
+      OccupancyVoxelGrid ret(resolution, resolution, resolution);
+
+      // the occupied cells are decoded in batches
+      KEY keys[Base::BATCH_SIZE];
+      VALUE values[Base::BATCH_SIZE];
+      uint32_t x[Base::BATCH_SIZE], y[Base::BATCH_SIZE], z[Base::BATCH_SIZE];
+      int ind = 0;
+      while(ind < _keys.size())
+      {
+          int num = 0;
+          for(; ind < _keys.size() && num < Base::BATCH_SIZE; ind++)
+          {
+              if(!_values[ind]) continue;
+              keys[num] = _keys[ind];
+              values[num] = _values[ind];
+              num++;
+          }
+          compute_coords(_max_level, keys, x, y, z, num);
+
+          for(int n=0; n<num; n++)
+          {
+              int len = 1 << (_max_level - compute_level(keys[n]));
+              for(int i=0; i < len; i++)
+              {
+                  for(int j=0; j < len; j++)
+                  {
+                      for(int k=0; k < len; k++)
+                      {
+                          ret.set_element(x[n] + i, y[n] + j, z[n] + k, values[n]);
+                      }
+                  }
+              }
+          }
+      }
+      return ret;
+  }
+
+  template <class GRID>
+  void from_voxel_grid(GRID& vg, int min_level)
+  {
+      std::vector<std::pair<KEY, VALUE> > cells;
+      int max_level;
+      Base::collect_voxel_grid_cells(vg, min_level, max_level, cells);
+      assign(cells.begin(), cells.end());
+      _max_level = max_level;
+  }
+
+  void to_file(std::string fname)
+  {
+      std::ofstream ff(fname.c_str(), std::ios_base::binary);
+      boost::archive::text_oarchive oarch(ff);
+      std::map<KEY, VALUE> tmp_hash;
+      for(int i=0; i<_keys.size(); i++)
+      {
+        tmp_hash.insert(tmp_hash.end(), std::pair<KEY, VALUE>(_keys[i], _values[i]));
+      }
+      oarch << tmp_hash;
+      ff.flush();
+      ff.close();
+  }
+
+  void to_binary_file(std::string fname)
+  {
+      Base::write_binary_file(fname, _max_level, _keys.data(), _values.data(), _keys.size());
+  }
+
+  /// Appends the octree as a record of a shard file, see OctreeBase::write_binary_record.
+  void to_shard(std::ostream& ff)
+  {
+      Base::write_binary_record(ff, _max_level, _keys.data(), _values.data(), _keys.size(), true);
+  }
+
+  /// Reads both the boost text and the binary format; binary files are
+  /// already sorted and are read straight into the key and value arrays.
+  /// Returns false as GeneralOctree::from_file.
+  bool from_file(std::string fname)
+  {
+      if(Base::is_binary_file(fname))
+      {
+          std::vector<KEY> keys;
+          std::vector<VALUE> values;
+          int max_level;
+          if(!Base::read_binary_file(fname, max_level, keys, values)) return false;
+
+          if(_keys.empty())
+          {
+              _keys.swap(keys);
+              _values.swap(values);
+              rebuild_level_offsets();
+          }
+          else
+          {
+              for(size_t i=0; i<keys.size(); i++) add_element(keys[i], values[i]);
+          }
+          if(max_level > _max_level) _max_level = max_level;
+          return true;
+      }
+
+      std::ifstream ff(fname.c_str(), std::ios_base::binary);
+      if(!ff.good())
+      {
+          std::cerr << "Error: cannot open " << fname << std::endl;
+          return false;
+      }
+      boost::archive::text_iarchive iarch(ff);
+      std::map<KEY, VALUE> tmp_map;
+      iarch >> tmp_map;
+      ff.close();
+
+      for(typename std::map<KEY, VALUE>::iterator it=tmp_map.begin(); it!=tmp_map.end(); it++)
+      {
+        add_element(it->first, it->second);
+        int level = compute_level(it->first);
+        if(level > _max_level) _max_level = level;
+      }
+      return true;
+  }
+
+};
+
+#endif //SORTED_OCTREE_H_
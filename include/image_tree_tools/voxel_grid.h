@@ -3,9 +3,11 @@
 
 #include <boost/shared_array.hpp>
 
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 //OCCUPANCY SIGNAL VALUES
 #define CLASS_EMPTY 0
@@ -22,6 +24,8 @@ protected:
     boost::shared_array<VALUE> _voxels;
 
 public:
+    typedef VALUE value_type;
+
     GeneralVoxelGrid()
     {
         _depth = 0; _height = 0; _width = 0;
@@ -45,8 +49,56 @@ public:
 
     VALUE get_element(int i, int j, int k) {return _voxels[i * _width * _height + j * _height + k];}
     void set_element(int i, int j, int k, VALUE val) {_voxels[i * _width * _height + j * _height + k] = val;}
+
+    /// Returns true and the common value if the size^3 block at (i, j, k) is
+    /// known to be uniform without scanning it; only single voxels are.
+    bool uniform_block(int i, int j, int k, int size, VALUE& value)
+    {
+        if(size != 1) return false;
+        value = get_element(i, j, k);
+        return true;
+    }
 };
 
+/// Reads the header of a binvox file up to and including the "data" line.
+inline bool read_binvox_header(std::istream& input, int& depth, int& height, int& width)
+{
+    std::string line;
+    std::string version;
+    input >> line;  // #binvox
+    if (line.compare("#binvox") != 0) {
+      std::cout << "Error: first line reads [" << line << "] instead of [#binvox]" << std::endl;
+      return false;
+    }
+    input >> version;
+
+    depth = -1;
+    int done = 0;
+    while(input.good() && !done) {
+      input >> line;
+      if (line.compare("data") == 0) done = 1;
+      else if (line.compare("dim") == 0) {
+        input >> depth >> height >> width;
+      }
+      else {
+        char c;
+        do {  // skip until end of line
+          c = input.get();
+        } while(input.good() && (c != '\n'));
+
+      }
+    }
+    if (!done) {
+      std::cout << "  error reading header" << std::endl;
+      return false;
+    }
+    if (depth == -1) {
+      std::cout << "  missing dimensions in header" << std::endl;
+      return false;
+    }
+    return true;
+}
+
 class OccupancyVoxelGrid : public GeneralVoxelGrid<byte>
 {
 
@@ -80,7 +132,10 @@ public:
               count = 0;
           }
       }
-      
+      // the last run, including the last voxel
+      output << prev_value;
+      output << byte(count + 1);
+
       output.close();
       return 0;
   }
@@ -90,40 +145,10 @@ public:
       std::ifstream *input = new std::ifstream(filespec.c_str(), std::ios::in | std::ios::binary);
 
       // read header
-      std::string line;
-      std::string version;
-      *input >> line;  // #binvox
-      if (line.compare("#binvox") != 0) {
-        std::cout << "Error: first line reads [" << line << "] instead of [#binvox]" << std::endl;
+      if (!read_binvox_header(*input, _depth, _height, _width)) {
         delete input;
         return 0;
       }
-      *input >> version;
-
-      _depth = -1;
-      int done = 0;
-      while(input->good() && !done) {
-        *input >> line;
-        if (line.compare("data") == 0) done = 1;
-        else if (line.compare("dim") == 0) {
-          *input >> _depth >> _height >> _width;
-        }
-        else {
-          char c;
-          do {  // skip until end of line
-            c = input->get();
-          } while(input->good() && (c != '\n'));
-
-        }
-      }
-      if (!done) {
-        std::cout << "  error reading header" << std::endl;
-        return 0;
-      }
-      if (_depth == -1) {
-        std::cout << "  missing dimensions in header" << std::endl;
-        return 0;
-      }
 
       _voxels = boost::shared_array<byte>(new byte[this->size()]);
       if (!_voxels) {
@@ -163,4 +188,98 @@ public:
   }
 };
 
+/// Occupancy grid kept in the run-length encoding of binvox files: the voxels,
+/// in the order of GeneralVoxelGrid, as maximal runs of equal values. Memory
+/// is proportional to the number of runs, so large grids can be converted to
+/// octrees without ever being expanded.
+class RunLengthVoxelGrid
+{
+
+protected:
+    int _depth, _height, _width;
+    // run r covers the voxel indices [_run_starts[r], _run_starts[r + 1])
+    std::vector<int> _run_starts;
+    std::vector<byte> _run_values;
+
+    int find_run(int index)
+    {
+        return std::upper_bound(_run_starts.begin(), _run_starts.end() - 1, index) - _run_starts.begin() - 1;
+    }
+
+public:
+    typedef byte value_type;
+
+    RunLengthVoxelGrid()
+    {
+        _depth = 0; _height = 0; _width = 0;
+    }
+
+    int size() {return _depth * _height * _width;}
+
+    int depth() {return _depth;}
+
+    int width() {return _width;}
+
+    int height() {return _height;}
+
+    int num_runs() {return _run_values.size();}
+
+    byte get_element(int i, int j, int k) {return _run_values[find_run(i * _width * _height + j * _height + k)];}
+
+    /// Returns true and the common value if the size^3 block at (i, j, k) is
+    /// uniform; checks one run per row of the block.
+    bool uniform_block(int i, int j, int k, int size, byte& value)
+    {
+        int run = -1;
+        for(int ii=i; ii<i+size; ii++)
+        {
+            for(int jj=j; jj<j+size; jj++)
+            {
+                const int first = ii * _width * _height + jj * _height + k;
+                if(run < 0 || first < _run_starts[run] || first >= _run_starts[run + 1]) run = find_run(first);
+                if(run < 0) return false;
+                if(ii == i && jj == j) value = _run_values[run];
+                if(_run_values[run] != value || first + size > _run_starts[run + 1]) return false;
+            }
+        }
+        return true;
+    }
+
+    int read_binvox(std::string filespec)
+    {
+        std::ifstream input(filespec.c_str(), std::ios::in | std::ios::binary);
+        if (!read_binvox_header(input, _depth, _height, _width)) return 0;
+
+        _run_starts.clear();
+        _run_values.clear();
+
+        byte value;
+        byte count;
+        int index = 0;
+
+        input.unsetf(std::ios::skipws);  // need to read every byte now (!)
+        input >> value;  // read the linefeed char
+
+        while(index < size() && input.good()) {
+          input >> value >> count;
+          if (!input.good()) break;
+          if (index + count > size()) return 0;
+          if (!count) continue;
+
+          value = value ? CLASS_FILLED : CLASS_EMPTY;
+          if (_run_values.empty() || _run_values.back() != value) {
+            _run_starts.push_back(index);
+            _run_values.push_back(value);
+          }
+          index += count;
+        }
+        if (index < size()) {
+          std::cout << "  binvox data ends after " << index << " of " << size() << " voxels" << std::endl;
+          return 0;
+        }
+        _run_starts.push_back(index);
+        return 1;
+    }
+};
+
 #endif // VOXEL_GRID_H
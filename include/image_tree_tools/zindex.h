@@ -4,8 +4,17 @@
 #include <cmath>
 #include <vector>
 
+#include <stddef.h>
 #include <stdint.h>
 
+// The batch functions below dispatch at runtime to BMI2 and AVX2 versions on
+// x86-64. Not for nvcc, whose front end does not support target attributes;
+// host code compiled there uses the scalar versions.
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__CUDACC__)
+#define ZINDEX_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 /*!
  *  Computes the morton number for three 10-bit integers
  *
@@ -68,4 +77,361 @@ inline void inverse_morton_3d(uint32_t& x, uint32_t& y, uint32_t& z, uint32_t in
 }
 
 
+/*!
+ *  Computes the morton number for three 21-bit integers
+ *
+ *  \param x  Integer that uses up to 21 bit
+ *  \param y  Integer that uses up to 21 bit
+ *  \param z  Integer that uses up to 21 bit
+ *
+ *  \return   The morton number as 64-bit int with 63 bits used.
+ */
+inline uint64_t morton_3d(uint64_t x, uint64_t y, uint64_t z)
+{
+  x = (x | (x << 32)) & 0x001F00000000FFFFull;
+  x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+  x = (x | (x <<  8)) & 0x100F00F00F00F00Full;
+  x = (x | (x <<  4)) & 0x10C30C30C30C30C3ull;
+  x = (x | (x <<  2)) & 0x1249249249249249ull;
+
+  y = (y | (y << 32)) & 0x001F00000000FFFFull;
+  y = (y | (y << 16)) & 0x001F0000FF0000FFull;
+  y = (y | (y <<  8)) & 0x100F00F00F00F00Full;
+  y = (y | (y <<  4)) & 0x10C30C30C30C30C3ull;
+  y = (y | (y <<  2)) & 0x1249249249249249ull;
+
+  z = (z | (z << 32)) & 0x001F00000000FFFFull;
+  z = (z | (z << 16)) & 0x001F0000FF0000FFull;
+  z = (z | (z <<  8)) & 0x100F00F00F00F00Full;
+  z = (z | (z <<  4)) & 0x10C30C30C30C30C3ull;
+  z = (z | (z <<  2)) & 0x1249249249249249ull;
+
+  return x | (y << 1) | (z << 2);
+}
+
+
+/*!
+ *  Computes the non-interleaved inputs from the given 64-bit morton number
+ *
+ *  \param x      Output parameter. stores as 21-bit integer
+ *  \param y      Output parameter. stores as 21-bit integer
+ *  \param z      Output parameter. stores as 21-bit integer
+ *  \param input  Input morton number with 63 bits. The most significant
+ *                bit must be 0.
+ */
+inline void inverse_morton_3d(uint64_t& x, uint64_t& y, uint64_t& z, uint64_t input)
+{
+  x = input &        0x1249249249249249ull;
+  y = (input >> 1) & 0x1249249249249249ull;
+  z = (input >> 2) & 0x1249249249249249ull;
+
+  x = ((x >> 2) | x) & 0x10C30C30C30C30C3ull;
+  x = ((x >> 4) | x) & 0x100F00F00F00F00Full;
+  x = ((x >> 8) | x) & 0x001F0000FF0000FFull;
+  x = ((x >>16) | x) & 0x001F00000000FFFFull;
+  x = ((x >>32) | x) & 0x00000000001FFFFFull;
+
+  y = ((y >> 2) | y) & 0x10C30C30C30C30C3ull;
+  y = ((y >> 4) | y) & 0x100F00F00F00F00Full;
+  y = ((y >> 8) | y) & 0x001F0000FF0000FFull;
+  y = ((y >>16) | y) & 0x001F00000000FFFFull;
+  y = ((y >>32) | y) & 0x00000000001FFFFFull;
+
+  z = ((z >> 2) | z) & 0x10C30C30C30C30C3ull;
+  z = ((z >> 4) | z) & 0x100F00F00F00F00Full;
+  z = ((z >> 8) | z) & 0x001F0000FF0000FFull;
+  z = ((z >>16) | z) & 0x001F00000000FFFFull;
+  z = ((z >>32) | z) & 0x00000000001FFFFFull;
+}
+
+
+/*!
+ *  Bits of the x coordinate in a 32-bit or 64-bit morton number. The bits of
+ *  y and z are this mask shifted by 1 and 2.
+ */
+inline uint32_t morton_3d_x_mask(uint32_t) { return 0x49249249; }
+inline uint64_t morton_3d_x_mask(uint64_t) { return 0x9249249249249249ull; }
+
+/*!
+ *  Adds two dilated integers, i.e. the bits of one coordinate of two morton
+ *  numbers, without decoding them: the bits outside the mask are set, so that
+ *  carries propagate over them. Wraps around modulo the mask.
+ *
+ *  \param a     Morton number masked to one coordinate
+ *  \param b     Morton number masked to the same coordinate
+ *  \param mask  Bits of the coordinate, see morton_3d_x_mask
+ */
+template <class CODE>
+inline CODE dilated_add(CODE a, CODE b, CODE mask)
+{
+  return ((a | ~mask) + b) & mask;
+}
+
+/*!
+ *  Subtracts the dilated integer b from a, see dilated_add. The borrows
+ *  propagate over the cleared bits outside the mask.
+ */
+template <class CODE>
+inline CODE dilated_sub(CODE a, CODE b, CODE mask)
+{
+  return (a - b) & mask;
+}
+
+/*!
+ *  Implementations of the batch morton functions. MORTON_BMI2 uses the
+ *  pdep / pext instructions, MORTON_AVX2 runs the bit spreading of the
+ *  scalar functions on 8 (32-bit) or 4 (64-bit) numbers at once.
+ */
+enum MortonBatchImpl
+{
+  MORTON_SCALAR,
+  MORTON_BMI2,
+  MORTON_AVX2
+};
+
+inline bool morton_batch_impl_supported(MortonBatchImpl impl)
+{
+#ifdef ZINDEX_X86_DISPATCH
+  __builtin_cpu_init();
+  if(impl == MORTON_BMI2) return __builtin_cpu_supports("bmi2");
+  if(impl == MORTON_AVX2) return __builtin_cpu_supports("avx2");
+#endif
+  return impl == MORTON_SCALAR;
+}
+
+/*!
+ *  The default implementation of the batch functions for morton numbers of
+ *  code_size bytes, among those the CPU supports (detected on the first call).
+ *  AVX2 processes 8 32-bit but only 4 64-bit numbers at once, so pdep / pext
+ *  are preferred for 64-bit numbers. Note that these are microcoded and slow
+ *  on AMD CPUs before Zen 3.
+ */
+inline MortonBatchImpl morton_batch_impl(size_t code_size)
+{
+  static const bool avx2 = morton_batch_impl_supported(MORTON_AVX2);
+  static const bool bmi2 = morton_batch_impl_supported(MORTON_BMI2);
+  if(code_size > sizeof(uint32_t)) return bmi2 ? MORTON_BMI2 : (avx2 ? MORTON_AVX2 : MORTON_SCALAR);
+  return avx2 ? MORTON_AVX2 : (bmi2 ? MORTON_BMI2 : MORTON_SCALAR);
+}
+
+
+inline void morton_3d_batch_scalar(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* codes, size_t n)
+{
+  for(size_t i=0; i<n; i++) codes[i] = morton_3d(x[i], y[i], z[i]);
+}
+
+inline void morton_3d_batch_scalar(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* codes, size_t n)
+{
+  for(size_t i=0; i<n; i++) codes[i] = morton_3d(uint64_t(x[i]), uint64_t(y[i]), uint64_t(z[i]));
+}
+
+inline void inverse_morton_3d_batch_scalar(const uint32_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  for(size_t i=0; i<n; i++) inverse_morton_3d(x[i], y[i], z[i], codes[i]);
+}
+
+inline void inverse_morton_3d_batch_scalar(const uint64_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  for(size_t i=0; i<n; i++)
+  {
+    uint64_t x64, y64, z64;
+    inverse_morton_3d(x64, y64, z64, codes[i]);
+    x[i] = x64;
+    y[i] = y64;
+    z[i] = z64;
+  }
+}
+
+
+#ifdef ZINDEX_X86_DISPATCH
+
+__attribute__((target("bmi2")))
+inline void morton_3d_batch_bmi2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* codes, size_t n)
+{
+  for(size_t i=0; i<n; i++)
+  {
+    codes[i] = _pdep_u32(x[i], 0x09249249) | _pdep_u32(y[i], 0x12492492) | _pdep_u32(z[i], 0x24924924);
+  }
+}
+
+__attribute__((target("bmi2")))
+inline void morton_3d_batch_bmi2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* codes, size_t n)
+{
+  for(size_t i=0; i<n; i++)
+  {
+    codes[i] = _pdep_u64(x[i], 0x1249249249249249ull) | _pdep_u64(y[i], 0x2492492492492492ull) |
+        _pdep_u64(z[i], 0x4924924924924924ull);
+  }
+}
+
+__attribute__((target("bmi2")))
+inline void inverse_morton_3d_batch_bmi2(const uint32_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  for(size_t i=0; i<n; i++)
+  {
+    x[i] = _pext_u32(codes[i], 0x09249249);
+    y[i] = _pext_u32(codes[i], 0x12492492);
+    z[i] = _pext_u32(codes[i], 0x24924924);
+  }
+}
+
+__attribute__((target("bmi2")))
+inline void inverse_morton_3d_batch_bmi2(const uint64_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  for(size_t i=0; i<n; i++)
+  {
+    x[i] = _pext_u64(codes[i], 0x1249249249249249ull);
+    y[i] = _pext_u64(codes[i], 0x2492492492492492ull);
+    z[i] = _pext_u64(codes[i], 0x4924924924924924ull);
+  }
+}
+
+__attribute__((target("avx2")))
+inline __m256i morton_spread_avx2_32(__m256i v)
+{
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 16)), _mm256_set1_epi32(0x030000FF));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  8)), _mm256_set1_epi32(0x0300F00F));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  4)), _mm256_set1_epi32(0x030C30C3));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  2)), _mm256_set1_epi32(0x09249249));
+  return v;
+}
+
+__attribute__((target("avx2")))
+inline __m256i morton_compact_avx2_32(__m256i v)
+{
+  v = _mm256_and_si256(v, _mm256_set1_epi32(0x09249249));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  2)), _mm256_set1_epi32(0x030C30C3));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  4)), _mm256_set1_epi32(0x0300F00F));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  8)), _mm256_set1_epi32(0x030000FF));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 16)), _mm256_set1_epi32(0x000003FF));
+  return v;
+}
+
+__attribute__((target("avx2")))
+inline __m256i morton_spread_avx2_64(__m256i v)
+{
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 32)), _mm256_set1_epi64x(0x001F00000000FFFFll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 16)), _mm256_set1_epi64x(0x001F0000FF0000FFll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  8)), _mm256_set1_epi64x(0x100F00F00F00F00Fll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  4)), _mm256_set1_epi64x(0x10C30C30C30C30C3ll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  2)), _mm256_set1_epi64x(0x1249249249249249ll));
+  return v;
+}
+
+/// Compacts the 64-bit lanes of v and returns them as 4 32-bit numbers.
+__attribute__((target("avx2")))
+inline __m128i morton_compact_avx2_64(__m256i v)
+{
+  v = _mm256_and_si256(v, _mm256_set1_epi64x(0x1249249249249249ll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  2)), _mm256_set1_epi64x(0x10C30C30C30C30C3ll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  4)), _mm256_set1_epi64x(0x100F00F00F00F00Fll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  8)), _mm256_set1_epi64x(0x001F0000FF0000FFll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v, 16)), _mm256_set1_epi64x(0x001F00000000FFFFll));
+  v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v, 32)), _mm256_set1_epi64x(0x00000000001FFFFFll));
+  return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+}
+
+__attribute__((target("avx2")))
+inline void morton_3d_batch_avx2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* codes, size_t n)
+{
+  size_t i = 0;
+  for(; i+8<=n; i+=8)
+  {
+    __m256i vx = morton_spread_avx2_32(_mm256_loadu_si256((const __m256i*)(x + i)));
+    __m256i vy = morton_spread_avx2_32(_mm256_loadu_si256((const __m256i*)(y + i)));
+    __m256i vz = morton_spread_avx2_32(_mm256_loadu_si256((const __m256i*)(z + i)));
+    __m256i code = _mm256_or_si256(vx, _mm256_or_si256(_mm256_slli_epi32(vy, 1), _mm256_slli_epi32(vz, 2)));
+    _mm256_storeu_si256((__m256i*)(codes + i), code);
+  }
+  morton_3d_batch_scalar(x + i, y + i, z + i, codes + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void morton_3d_batch_avx2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* codes, size_t n)
+{
+  size_t i = 0;
+  for(; i+4<=n; i+=4)
+  {
+    __m256i vx = morton_spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(x + i))));
+    __m256i vy = morton_spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(y + i))));
+    __m256i vz = morton_spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(z + i))));
+    __m256i code = _mm256_or_si256(vx, _mm256_or_si256(_mm256_slli_epi64(vy, 1), _mm256_slli_epi64(vz, 2)));
+    _mm256_storeu_si256((__m256i*)(codes + i), code);
+  }
+  morton_3d_batch_scalar(x + i, y + i, z + i, codes + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void inverse_morton_3d_batch_avx2(const uint32_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  size_t i = 0;
+  for(; i+8<=n; i+=8)
+  {
+    __m256i code = _mm256_loadu_si256((const __m256i*)(codes + i));
+    _mm256_storeu_si256((__m256i*)(x + i), morton_compact_avx2_32(code));
+    _mm256_storeu_si256((__m256i*)(y + i), morton_compact_avx2_32(_mm256_srli_epi32(code, 1)));
+    _mm256_storeu_si256((__m256i*)(z + i), morton_compact_avx2_32(_mm256_srli_epi32(code, 2)));
+  }
+  inverse_morton_3d_batch_scalar(codes + i, x + i, y + i, z + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void inverse_morton_3d_batch_avx2(const uint64_t* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+  size_t i = 0;
+  for(; i+4<=n; i+=4)
+  {
+    __m256i code = _mm256_loadu_si256((const __m256i*)(codes + i));
+    _mm_storeu_si128((__m128i*)(x + i), morton_compact_avx2_64(code));
+    _mm_storeu_si128((__m128i*)(y + i), morton_compact_avx2_64(_mm256_srli_epi64(code, 1)));
+    _mm_storeu_si128((__m128i*)(z + i), morton_compact_avx2_64(_mm256_srli_epi64(code, 2)));
+  }
+  inverse_morton_3d_batch_scalar(codes + i, x + i, y + i, z + i, n - i);
+}
+
+#endif // ZINDEX_X86_DISPATCH
+
+
+/*!
+ *  Computes the morton numbers of n coordinate triples, as morton_3d.
+ *
+ *  \param x      Array of n integers that use up to 10 (32-bit codes) or 21
+ *                (64-bit codes) bit
+ *  \param y      See x
+ *  \param z      See x
+ *  \param codes  Output array of n 32-bit or 64-bit morton numbers
+ *  \param impl   Implementation; must be supported by the CPU
+ */
+template <class CODE>
+inline void morton_3d_batch(const uint32_t* x, const uint32_t* y, const uint32_t* z, CODE* codes, size_t n,
+    MortonBatchImpl impl = morton_batch_impl(sizeof(CODE)))
+{
+#ifdef ZINDEX_X86_DISPATCH
+  if(impl == MORTON_AVX2) return morton_3d_batch_avx2(x, y, z, codes, n);
+  if(impl == MORTON_BMI2) return morton_3d_batch_bmi2(x, y, z, codes, n);
+#endif
+  morton_3d_batch_scalar(x, y, z, codes, n);
+}
+
+/*!
+ *  Computes the coordinates of n morton numbers, as inverse_morton_3d.
+ *
+ *  \param codes  Array of n 32-bit or 64-bit morton numbers
+ *  \param x      Output array of n integers
+ *  \param y      See x
+ *  \param z      See x
+ *  \param impl   Implementation; must be supported by the CPU
+ */
+template <class CODE>
+inline void inverse_morton_3d_batch(const CODE* codes, uint32_t* x, uint32_t* y, uint32_t* z, size_t n,
+    MortonBatchImpl impl = morton_batch_impl(sizeof(CODE)))
+{
+#ifdef ZINDEX_X86_DISPATCH
+  if(impl == MORTON_AVX2) return inverse_morton_3d_batch_avx2(codes, x, y, z, n);
+  if(impl == MORTON_BMI2) return inverse_morton_3d_batch_bmi2(codes, x, y, z, n);
+#endif
+  inverse_morton_3d_batch_scalar(codes, x, y, z, n);
+}
+
+
 #endif /* ZINDEX_H_ */
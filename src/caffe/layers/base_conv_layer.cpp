@@ -122,6 +122,15 @@ void BaseConvolutionLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_EQ(channels_ % group_, 0);
   CHECK_EQ(num_output_ % group_, 0)
       << "Number of output should be multiples of group.";
+  // int8 is only used at inference, see ConvolutionParameter.int8.
+  int8_ = conv_param.int8() && this->phase_ == TEST;
+  if (conv_param.int8() && !int8_) {
+    LOG(WARNING) << "int8 is only used for inference, "
+        << this->layer_param_.name() << " runs in float";
+  }
+  if (int8_) {
+    CHECK_EQ(group_, 1) << "int8 requires group = 1.";
+  }
   if (reverse_dimensions()) {
     conv_out_channels_ = channels_;
     conv_in_channels_ = num_output_;
@@ -297,6 +306,44 @@ void BaseConvolutionLayer<Dtype>::backward_cpu_gemm(const Dtype* output,
   }
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::quantize_weights_int8() {
+  const Blob<Dtype>& weights = *this->blobs_[0];
+  if (reverse_dimensions()) {
+    // the GEMM of backward_cpu_gemm, with the weights transposed
+    int8_gemm_.set_weights(weights, kernel_dim_, conv_out_channels_, true,
+        kernel_dim_ / conv_in_channels_);
+  } else {
+    int8_gemm_.set_weights(weights, conv_out_channels_, kernel_dim_, false, 1);
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_gemm_int8(const Dtype* input,
+    Dtype* output) {
+  const Dtype* col_buff = input;
+  if (!is_1x1_) {
+    conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+    col_buff = col_buffer_.cpu_data();
+  }
+  int8_gemm_.gemm(col_buff, conv_out_spatial_dim_,
+      this->layer_param_.convolution_param().input_scale(), output);
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_cpu_gemm_int8(const Dtype* output,
+    Dtype* input) {
+  Dtype* col_buff = col_buffer_.mutable_cpu_data();
+  if (is_1x1_) {
+    col_buff = input;
+  }
+  int8_gemm_.gemm(output, conv_out_spatial_dim_,
+      this->layer_param_.convolution_param().input_scale(), col_buff);
+  if (!is_1x1_) {
+    conv_col2im_cpu(col_buff, input);
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::weight_cpu_gemm(const Dtype* input,
     const Dtype* output, Dtype* weights) {
@@ -1,4 +1,7 @@
+#include <algorithm>
+
 #include "caffe/layers/ogn_conv_layer.hpp"
+#include "caffe/layers/ogn_prop_layer.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
 
@@ -14,6 +17,13 @@ void OGNConvLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 	_num_output_channels = this->layer_param_.ogn_conv_param().output_channels();
 	_num_input_channels = bottom[0]->shape(1);
+	this->_packed = this->layer_param_.ogn_conv_param().packed();
+	const int stride = this->layer_param_.ogn_conv_param().stride();
+	CHECK(stride == 1 || stride == 2) << "OGNConv: only strides 1 and 2 are supported";
+	CHECK(stride == 1 || !is_deconv) << "OGNConv: deconvolutions cannot be strided";
+	const bool int8 = this->layer_param_.ogn_conv_param().int8();
+	_quantized = int8 && this->phase_ == TEST;
+	if(int8 && !_quantized) LOG(WARNING) << "OGNConv: int8 is only used for inference, " << this->layer_param_.name() << " runs in float";
 
 	this->blobs_.resize(2);
 
@@ -51,17 +61,38 @@ void OGNConvLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void OGNConvLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-	_batch_size = bottom[0]->shape(0);
-    _num_input_pixels = bottom[0]->shape(2);
-
     const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
     const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int scale = is_deconv ? 8 : 1;
 
-    if(is_deconv) _num_output_pixels = 8 * _num_input_pixels;
-    else _num_output_pixels = _num_input_pixels;
+    // the key layer, and thus the packed sizes, are only available after net initialization
+    const bool packed_output = resolve_key_layer() && this->_packed;
+    const bool strided = this->layer_param_.ogn_conv_param().stride() > 1;
+    _fused_prop.reset();
+    if(_key_layer && is_deconv)
+    {
+        boost::shared_ptr<OGNPropLayer<Dtype> > prop = boost::dynamic_pointer_cast<OGNPropLayer<Dtype> >(_key_layer);
+        if(prop && prop->is_fused()) _fused_prop = prop;
+    }
+    _num_input_pixels = _fused_prop ? _fused_prop->get_num_output_pixels() : bottom[0]->shape(2);
+    if(_key_layer)
+    {
+        // a strided convolution outputs the parent cells, which are needed for the output size
+        if(strided) this->pool_keys(*_key_layer, NULL);
+        OGNLayer<Dtype>& output_cells = strided ? *this : *_key_layer;
+        _batch_size = _key_layer->get_batch_size();
+        if(packed_output) _num_output_pixels = scale * std::max(output_cells.get_num_cells(), 1);
+        else if(_key_layer->is_packed() || strided) _num_output_pixels = scale * std::max(output_cells.get_max_cells(), 1);
+        else _num_output_pixels = scale * _num_input_pixels;
+    }
+    else
+    {
+        _batch_size = bottom[0]->shape(0);
+        _num_output_pixels = scale * _num_input_pixels;
+    }
 
     vector<int> features_shape;
-    features_shape.push_back(_batch_size);
+    features_shape.push_back(packed_output ? 1 : _batch_size);
     features_shape.push_back(_num_output_channels);
     features_shape.push_back(_num_output_pixels);
     top[0]->Reshape(features_shape);
@@ -72,48 +103,158 @@ void OGNConvLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     else _col_buffer_shape.push_back(_num_output_pixels);
 
     _col_buffer.Reshape(_col_buffer_shape);
+    this->record_buffer_bytes(_col_buffer.count() * sizeof(Dtype));
+}
+
+template <typename Dtype>
+bool OGNConvLayer<Dtype>::resolve_key_layer()
+{
+    if(!_key_layer)
+    {
+        std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
+        if(!this->parent_net()->has_layer(key_layer_name)) return false;
+        boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
+        _key_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    }
+    return true;
 }
 
 template <typename Dtype>
 void OGNConvLayer<Dtype>::propagate_keys_cpu()
 {
 	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+	OGNStatsTimer timer(this->stats_timer(&OGNStats::keys_ms));
+
+    resolve_key_layer();
+    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = _key_layer;
+
+    // a strided convolution pools the cells in Reshape already
+    if(this->layer_param_.ogn_conv_param().stride() > 1) return;
+
+    // a convolution keeps the cells of its key layer
+    if(!is_deconv)
+    {
+        this->share_octrees(*l_ptr);
+        return;
+    }
+
+    OGNOctrees& octrees = this->mutable_octrees();
+    octrees.keys.resize(_batch_size);
+    octrees.prop.resize(_batch_size);
+    octrees.inherit_origin(l_ptr->get_octrees());
+
+    // the 8 children of every cell, in one pass; they are in morton order if the parents are
+    OGN_PARALLEL_FOR
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        KeyOctree& parent_keys = l_ptr->get_keys_octree(n);
+        KeyOctree& parent_prop = l_ptr->get_prop_octree(n);
+        const int num_children = 8 * parent_keys.num_elements();
+        std::vector<KeyType> child_keys(num_children);
+        std::vector<int> child_values(num_children);
+        std::vector<int> child_prop(num_children);
+
+        int output_counter = 0;
+        for(typename KeyOctree::iterator it=parent_keys.begin(); it!=parent_keys.end(); it++)
+        {
+            const KeyType key = it->first;
+            const int prop = parent_prop.get_value(key);
+            for(int i=0; i<8; i++)
+            {
+                child_keys[output_counter] = (key << 3) | i;
+                child_values[output_counter] = output_counter;
+                child_prop[output_counter] = prop;
+                output_counter++;
+            }
+        }
+        octrees.keys[n].assign(child_keys.data(), child_values.data(), num_children);
+        octrees.prop[n].assign(child_keys.data(), child_prop.data(), num_children);
+    }
+    octrees.update_batch_offsets();
+}
 
-	this->_octree_keys.clear();
-    this->_octree_prop.clear();
+template <typename Dtype>
+void OGNConvLayer<Dtype>::build_neighbor_table_cpu()
+{
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const bool strided = this->layer_param_.ogn_conv_param().stride() > 1;
+    const int num_neighbors = filter_size * filter_size * filter_size;
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::keys_ms));
 
-    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    // the rows are the coarser cells and the neighbors are looked up among the finer
+    // ones: the output cells of a strided convolution, the input cells of a deconvolution
+    OGNLayer<Dtype>& row_layer = strided ? *this : *_key_layer;
+    OGNLayer<Dtype>& lookup_layer = strided ? *_key_layer : *this;
 
+    _key_offsets.resize(_batch_size + 1);
+    _key_offsets[0] = 0;
     for (int n = 0; n < _batch_size; ++n)
     {
-        GeneralOctree<int> octree_keys;
-        GeneralOctree<int> octree_prop;
+        _key_offsets[n + 1] = _key_offsets[n] + row_layer.get_keys_octree(n).num_elements();
+    }
 
-        if(is_deconv)
+    _neighbor_table.assign(_key_offsets[_batch_size] * num_neighbors, -1);
+    const OGNOctrees& octrees = this->get_octrees();
+
+    OGN_PARALLEL_FOR
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        int* table = _neighbor_table.data() + _key_offsets[n] * num_neighbors;
+        const int table_size = (_key_offsets[n + 1] - _key_offsets[n]) * num_neighbors;
+        OGNStructureCache* cache = octrees.cache_for(n);
+        if(cache)
+        {
+            boost::shared_ptr<const OGNCachedStructure> cached = cache->find(octrees.model_ids[n], this);
+            if(cached && cached->indices.size() == table_size)
+            {
+                std::copy(cached->indices.begin(), cached->indices.end(), table);
+                continue;
+            }
+        }
+
+        KeyOctree& octree_keys = lookup_layer.get_keys_octree(n);
+        KeyOctree& key_layer_keys = row_layer.get_keys_octree(n);
+
+        // the neighbors are looked up in batches of cells
+        KeyType keys[KeyOctree::BATCH_SIZE];
+        int rows[KeyOctree::BATCH_SIZE];
+        std::vector<int> neighbors(KeyOctree::BATCH_SIZE * num_neighbors);
+        typename KeyOctree::iterator it = key_layer_keys.begin();
+        while(it != key_layer_keys.end())
         {
-            int output_counter = 0;
-            for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(n).begin(); it!=l_ptr->get_keys_octree(n).end(); it++)
+            int num_keys = 0;
+            for(; it != key_layer_keys.end() && num_keys < KeyOctree::BATCH_SIZE; it++)
             {
                 KeyType key = it->first;
-                for(int i=0; i<8; i++)
-                {
-                    unsigned int new_key = (key << 3) | i;
-                    octree_keys.add_element(new_key, output_counter);
-                    octree_prop.add_element(new_key, l_ptr->get_prop_octree(n).get_value(key));
-                    output_counter++;
-                }
+                if(is_deconv || strided) key = key << 3;
+                if(!key) continue;
+                keys[num_keys] = key;
+                rows[num_keys] = it->second;
+                num_keys++;
+            }
+
+            octree_keys.get_neighbor_values(keys, num_keys, filter_size, neighbors.data());
+            for(int m=0; m<num_keys; m++)
+            {
+                std::copy(neighbors.begin() + m * num_neighbors, neighbors.begin() + (m + 1) * num_neighbors,
+                    table + rows[m] * num_neighbors);
             }
-            this->_octree_keys.push_back(octree_keys);
-            this->_octree_prop.push_back(octree_prop);
         }
-        else
+
+        if(cache)
         {
-            this->_octree_keys.push_back(l_ptr->get_keys_octree(n));
-            this->_octree_prop.push_back(l_ptr->get_prop_octree(n));
+            boost::shared_ptr<OGNCachedStructure> structure(new OGNCachedStructure());
+            structure->indices.assign(table, table + table_size);
+            cache->insert(octrees.model_ids[n], this, structure);
         }
     }
+
+    if(this->_collect_stats)
+    {
+        this->_stats.neighbor_lookups += _neighbor_table.size();
+        this->_stats.neighbor_hits += _neighbor_table.size() - std::count(_neighbor_table.begin(), _neighbor_table.end(), -1);
+    }
 }
 
 template <typename Dtype>
@@ -121,24 +262,72 @@ void OGNConvLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
 	propagate_keys_cpu();
+	build_neighbor_table_cpu();
+	this->update_stats();
+
+	if(!_key_layer->matches_layout(*bottom[0]))
+	{
+		LOG(FATAL) << "OGNConv: bottom blob is not in the layout (packed or padded) of the key layer "
+			<< this->layer_param_.ogn_conv_param().key_layer();
+	}
+
+	// an empty frontier, e.g. beyond the maximum output level, leaves nothing to compute
+	if(!_key_offsets[_batch_size])
+	{
+		caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+		return;
+	}
+
+	if(this->layer_param_.ogn_conv_param().engine() == OGNConvParameter_Engine_DIRECT)
+	{
+		if(_quantized) LOG_FIRST_N(WARNING, 1) << "OGNConv: the DIRECT engine has no int8 path, " << this->layer_param_.name() << " runs in float";
+		forward_direct_cpu(bottom, top);
+		return;
+	}
+	if(_quantized) quantize_weights_cpu();
+	if(this->layer_param_.ogn_conv_param().batched_gemm() || this->_packed || _key_layer->is_packed())
+	{
+		forward_batched_cpu(bottom, top);
+		return;
+	}
 
 	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+	if(is_deconv) caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+	if(_fused_prop)
+	{
+		vector<int> fused_shape;
+		fused_shape.push_back(_num_input_channels);
+		fused_shape.push_back(_num_input_pixels);
+		_packed_bottom.Reshape(fused_shape);
+		this->record_buffer_bytes((_col_buffer.count() + _packed_bottom.count()) * sizeof(Dtype));
+	}
+
 	for (int n=0; n<_batch_size; n++)
     {
-    	int num_elements = this->_octree_keys[n].num_elements();
+    	int num_elements = this->get_keys_octree(n).num_elements();
         if(is_deconv)
         {
         	resize_computation_buffers_cpu(num_elements);
-            backward_cpu_gemm(bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, this->blobs_[0]->cpu_data(),
+        	const Dtype* input = bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels;
+        	if(_fused_prop)
+        	{
+        		gather_fused_input_cpu(n, _packed_bottom.mutable_cpu_data(), _num_input_pixels, _num_input_pixels);
+        		input = _packed_bottom.cpu_data();
+        	}
+            if(_quantized) quantized_gemm_cpu(input, _col_buffer.mutable_cpu_data());
+            else backward_cpu_gemm(input, this->blobs_[0]->cpu_data(),
                     _col_buffer.mutable_cpu_data());
-            col2im_octree_cpu(n, bottom, top);
+            col2im_octree_cpu(n, _col_buffer.cpu_data(), _col_buffer_shape[1],
+                top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels, _num_output_pixels);
             forward_cpu_bias(top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels, this->blobs_[1]->cpu_data());
         }
         else
         {
             resize_computation_buffers_cpu(num_elements);
-            im2col_octree_cpu(n, bottom, top);
-            forward_cpu_gemm(this->blobs_[0]->cpu_data(), _col_buffer.mutable_cpu_data(),
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, _num_input_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
+            if(_quantized) quantized_gemm_cpu(_col_buffer.cpu_data(), top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels);
+            else forward_cpu_gemm(this->blobs_[0]->cpu_data(), _col_buffer.mutable_cpu_data(),
                 top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels);
             forward_cpu_bias(top[0]->mutable_cpu_data() +
                 n * _num_output_channels * _num_output_pixels, this->blobs_[1]->cpu_data());
@@ -151,37 +340,501 @@ template <typename Dtype>
 void OGNConvLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
+	// fusion is only used if the net needs no gradients of this layer, so
+	// this is e.g. `caffe time` in the TEST phase; the gradients are left unchanged
+	if(_fused_prop)
+	{
+		if(propagate_down[0]) LOG(FATAL) << "OGNConv: the input of " << this->layer_param_.name() << " is fused for inference "
+			"and has no gradients; set fuse_deconv: false in " << _fused_prop->layer_param().name();
+		LOG_FIRST_N(WARNING, 1) << "OGNConv: the input of " << this->layer_param_.name() << " is fused for inference, "
+			"skipping the backward pass; set fuse_deconv: false in " << _fused_prop->layer_param().name() << " for gradients";
+		return;
+	}
+	if(this->layer_param_.ogn_conv_param().engine() == OGNConvParameter_Engine_DIRECT)
+	{
+		backward_direct_cpu(top, bottom);
+		return;
+	}
+	if(this->layer_param_.ogn_conv_param().batched_gemm() || this->_packed || _key_layer->is_packed())
+	{
+		backward_batched_cpu(top, bottom);
+		return;
+	}
+
 	Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
     Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
     const Dtype* top_diff = top[0]->cpu_diff();
     const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
 
+    if(!is_deconv) caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+
     for (int n = 0; n < _batch_size; ++n)
     {
         if(is_deconv)
         {
-            resize_computation_buffers_cpu(this->_octree_keys[n].num_elements());
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
             backward_cpu_bias(bias_diff, top_diff + n * _num_output_pixels * _num_output_channels);
-            im2col_octree_cpu(n, bottom, top);
+            im2col_octree_cpu(n, top_diff + n * _num_output_channels * _num_output_pixels, _num_output_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
             weight_cpu_gemm(_col_buffer.cpu_data(), bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, weight_diff);
             forward_cpu_gemm(this->blobs_[0]->cpu_data(), _col_buffer.cpu_data(), bottom[0]->mutable_cpu_diff() + n * _num_input_pixels * _num_input_channels);
         }
         else
         {
-            resize_computation_buffers_cpu(this->_octree_keys[n].num_elements());
-            im2col_octree_cpu(n, bottom, top);
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, _num_input_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
             weight_cpu_gemm(_col_buffer.mutable_cpu_data(),
                 top_diff + n * _num_output_channels * _num_output_pixels, weight_diff);
             backward_cpu_bias(bias_diff, top_diff + n * _num_output_channels * _num_output_pixels);
             backward_cpu_gemm(top_diff + n * _num_output_channels * _num_output_pixels,
                 this->blobs_[0]->cpu_data(), _col_buffer.mutable_cpu_data());
-            col2im_octree_cpu(n, bottom, top);
+            col2im_octree_cpu(n, _col_buffer.cpu_data(), _col_buffer_shape[1],
+                bottom[0]->mutable_cpu_diff() + n * _num_input_channels * _num_input_pixels, _num_input_pixels);
+        }
+    }
+
+}
+
+/// Batched mode: the active cells of all batch items are packed next to each other,
+/// so that every GEMM of the layer is issued once per batch instead of once per item.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::resize_batched_buffers_cpu()
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int num_cells = _key_offsets[_batch_size];
+    const int num_output_cells = is_deconv ? 8 * num_cells : num_cells;
+
+    _col_buffer_shape[1] = num_cells;
+    _col_buffer.Reshape(_col_buffer_shape);
+
+    vector<int> packed_shape;
+    packed_shape.push_back(_num_input_channels);
+    packed_shape.push_back(num_cells);
+    _packed_bottom.Reshape(packed_shape);
+
+    packed_shape[0] = _num_output_channels;
+    packed_shape[1] = num_output_cells;
+    _packed_top.Reshape(packed_shape);
+
+    vector<int> bias_multiplier_shape;
+    bias_multiplier_shape.push_back(num_output_cells); bias_multiplier_shape.push_back(1);
+    _bias_multiplier.Reshape(bias_multiplier_shape);
+    caffe_set(num_output_cells, Dtype(1), _bias_multiplier.mutable_cpu_data());
+
+    this->record_buffer_bytes((_col_buffer.count() + _packed_bottom.count() + _packed_top.count()) * sizeof(Dtype));
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::forward_batched_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int num_cells = _key_offsets[_batch_size];
+    const int scale = is_deconv ? 8 : 1;
+
+    if(!num_cells)
+    {
+        caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+        return;
+    }
+
+    resize_batched_buffers_cpu();
+    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    // packed blobs are used in place
+    Dtype* packed_top = this->_packed ? top[0]->mutable_cpu_data() : _packed_top.mutable_cpu_data();
+
+    if(is_deconv)
+    {
+        const Dtype* packed_bottom = bottom[0]->cpu_data();
+        if(_fused_prop)
+        {
+            for (int n = 0; n < _batch_size; ++n)
+            {
+                gather_fused_input_cpu(n, _packed_bottom.mutable_cpu_data() + _key_offsets[n], num_cells,
+                    _key_offsets[n + 1] - _key_offsets[n]);
+            }
+            packed_bottom = _packed_bottom.cpu_data();
+        }
+        else if(!_key_layer->is_packed())
+        {
+            pack_features_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, 1, _packed_bottom.mutable_cpu_data());
+            packed_bottom = _packed_bottom.cpu_data();
+        }
+        if(_quantized) quantized_gemm_cpu(packed_bottom, col_buff);
+        else backward_cpu_gemm(packed_bottom, this->blobs_[0]->cpu_data(), col_buff);
+        caffe_set(scale * num_cells * _num_output_channels, Dtype(0), packed_top);
+        for (int n = 0; n < _batch_size; ++n)
+        {
+            col2im_octree_cpu(n, col_buff + _key_offsets[n], num_cells,
+                packed_top + 8 * _key_offsets[n], 8 * num_cells);
+        }
+    }
+    else
+    {
+        for (int n = 0; n < _batch_size; ++n)
+        {
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + _key_layer->get_item_offset(*bottom[0], n), _num_input_pixels,
+                col_buff + _key_offsets[n], num_cells, _key_offsets[n + 1] - _key_offsets[n]);
+        }
+        if(_quantized) quantized_gemm_cpu(col_buff, packed_top);
+        else forward_cpu_gemm(this->blobs_[0]->cpu_data(), col_buff, packed_top);
+    }
+
+    forward_cpu_bias(packed_top, this->blobs_[1]->cpu_data());
+    if(!this->_packed)
+        unpack_features_cpu(packed_top, _num_output_channels, _num_output_pixels, scale, top[0]->mutable_cpu_data());
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::backward_batched_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<Blob<Dtype>*>& bottom)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const bool packed_bottom_blob = _key_layer->is_packed();
+    const int num_cells = _key_offsets[_batch_size];
+
+    Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+    Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+    const Dtype* top_diff = top[0]->cpu_diff();
+
+    if(!num_cells)
+    {
+        caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+        return;
+    }
+
+    resize_batched_buffers_cpu();
+    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+
+    const Dtype* packed_top = top_diff;
+    if(!this->_packed)
+    {
+        pack_features_cpu(top_diff, _num_output_channels, _num_output_pixels, is_deconv ? 8 : 1, _packed_top.mutable_cpu_data());
+        packed_top = _packed_top.cpu_data();
+    }
+    backward_cpu_bias(bias_diff, packed_top);
+
+    if(is_deconv)
+    {
+        for (int n = 0; n < _batch_size; ++n)
+        {
+            im2col_octree_cpu(n, top_diff + this->get_item_offset(*top[0], n), _num_output_pixels,
+                col_buff + _key_offsets[n], num_cells, _key_offsets[n + 1] - _key_offsets[n]);
+        }
+        const Dtype* packed_bottom = bottom[0]->cpu_data();
+        if(!packed_bottom_blob)
+        {
+            pack_features_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, 1, _packed_bottom.mutable_cpu_data());
+            packed_bottom = _packed_bottom.cpu_data();
+        }
+        weight_cpu_gemm(col_buff, packed_bottom, weight_diff);
+        if(packed_bottom_blob)
+        {
+            forward_cpu_gemm(this->blobs_[0]->cpu_data(), col_buff, bottom[0]->mutable_cpu_diff());
+        }
+        else
+        {
+            forward_cpu_gemm(this->blobs_[0]->cpu_data(), col_buff, _packed_bottom.mutable_cpu_data());
+            unpack_features_cpu(_packed_bottom.cpu_data(), _num_input_channels, _num_input_pixels, 1, bottom[0]->mutable_cpu_diff());
+        }
+    }
+    else
+    {
+        for (int n = 0; n < _batch_size; ++n)
+        {
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + _key_layer->get_item_offset(*bottom[0], n), _num_input_pixels,
+                col_buff + _key_offsets[n], num_cells, _key_offsets[n + 1] - _key_offsets[n]);
+        }
+        weight_cpu_gemm(col_buff, packed_top, weight_diff);
+        backward_cpu_gemm(packed_top, this->blobs_[0]->cpu_data(), col_buff);
+
+        caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+        for (int n = 0; n < _batch_size; ++n)
+        {
+            col2im_octree_cpu(n, col_buff + _key_offsets[n], num_cells,
+                bottom[0]->mutable_cpu_diff() + _key_layer->get_item_offset(*bottom[0], n), _num_input_pixels);
+        }
+    }
+}
+
+/// DIRECT engine: for every filter element, gathers the features of the cells that
+/// have the corresponding neighbor, multiplies them with the weights of that element
+/// and scatters the result. Needs buffers of (channels x cells) instead of the
+/// (channels * filter_size^3 x cells) column buffer.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::resize_direct_buffers_cpu()
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+
+    vector<int> weights_shape;
+    weights_shape.push_back(num_neighbors);
+    weights_shape.push_back(_num_output_channels);
+    weights_shape.push_back(_num_input_channels);
+    _direct_weights.Reshape(weights_shape);
+    _direct_weight_diff.Reshape(weights_shape);
+
+    vector<int> buffer_shape;
+    buffer_shape.push_back(_num_input_channels);
+    buffer_shape.push_back(_num_input_pixels);
+    _direct_input_buffer.Reshape(buffer_shape);
+    buffer_shape[0] = _num_output_channels;
+    _direct_output_buffer.Reshape(buffer_shape);
+
+    _direct_src.resize(_num_input_pixels);
+    _direct_dst.resize(_num_input_pixels);
+    this->record_buffer_bytes((_direct_input_buffer.count() + _direct_output_buffer.count()) * sizeof(Dtype));
+
+    const Dtype* weights = this->blobs_[0]->cpu_data();
+    Dtype* direct_weights = _direct_weights.mutable_cpu_data();
+    for(int el=0; el<num_neighbors; el++)
+    {
+        for(int o=0; o<_num_output_channels; o++)
+        {
+            for(int i=0; i<_num_input_channels; i++)
+            {
+                int w_ind;
+                if(is_deconv) w_ind = (i * _num_output_channels + o) * num_neighbors + el;
+                else w_ind = (o * _num_input_channels + i) * num_neighbors + el;
+                direct_weights[(el * _num_output_channels + o) * _num_input_channels + i] = weights[w_ind];
+            }
+        }
+    }
+}
+
+/// Collects the (input column, output column) pairs connected by filter element el.
+template <typename Dtype>
+int OGNConvLayer<Dtype>::collect_direct_pairs(int batch_ind, int el)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+    const int num_cells = _key_offsets[batch_ind + 1] - _key_offsets[batch_ind];
+
+    const int* table = _neighbor_table.data() + _key_offsets[batch_ind] * num_neighbors;
+
+    int num_pairs = 0;
+    for(int col=0; col<num_cells; col++)
+    {
+        const int feature_ind = table[col * num_neighbors + el];
+        if(feature_ind < 0) continue;
+        _direct_src[num_pairs] = is_deconv ? col : feature_ind;
+        _direct_dst[num_pairs] = is_deconv ? feature_ind : col;
+        num_pairs++;
+    }
+    return num_pairs;
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::gather_columns_cpu(const Dtype* input, int rows, int cols, int num_pairs,
+      const int* ind, Dtype* output)
+{
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gather_ms));
+
+    OGN_PARALLEL_FOR
+    for(int r=0; r<rows; r++)
+    {
+        const Dtype* input_row = input + r * cols;
+        Dtype* output_row = output + r * num_pairs;
+        for(int p=0; p<num_pairs; p++) output_row[p] = input_row[ind[p]];
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::scatter_add_columns_cpu(const Dtype* input, int rows, int num_pairs,
+      const int* ind, Dtype* output, int cols)
+{
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::scatter_ms));
+
+    OGN_PARALLEL_FOR
+    for(int r=0; r<rows; r++)
+    {
+        const Dtype* input_row = input + r * num_pairs;
+        Dtype* output_row = output + r * cols;
+        for(int p=0; p<num_pairs; p++) output_row[ind[p]] += input_row[p];
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::forward_direct_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+
+    resize_direct_buffers_cpu();
+    const Dtype* direct_weights = _direct_weights.cpu_data();
+    Dtype* input_buff = _direct_input_buffer.mutable_cpu_data();
+    Dtype* output_buff = _direct_output_buffer.mutable_cpu_data();
+
+    caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        const Dtype* input = bottom[0]->cpu_data() + _key_layer->get_item_offset(*bottom[0], n);
+        Dtype* output = top[0]->mutable_cpu_data() + this->get_item_offset(*top[0], n);
+
+        for(int el=0; el<num_neighbors; el++)
+        {
+            const int num_pairs = collect_direct_pairs(n, el);
+            if(!num_pairs) continue;
+
+            gather_columns_cpu(input, _num_input_channels, _num_input_pixels, num_pairs, _direct_src.data(), input_buff);
+            {
+                OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
+                caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_output_channels, num_pairs, _num_input_channels,
+                    (Dtype)1., direct_weights + el * _num_output_channels * _num_input_channels, input_buff,
+                    (Dtype)0., output_buff);
+            }
+            scatter_add_columns_cpu(output_buff, _num_output_channels, num_pairs, _direct_dst.data(), output, _num_output_pixels);
+        }
+
+        if(!this->_packed)
+        {
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
+            forward_cpu_bias(output, this->blobs_[1]->cpu_data());
+        }
+    }
+
+    if(this->_packed)
+    {
+        resize_computation_buffers_cpu(_num_output_pixels);
+        forward_cpu_bias(top[0]->mutable_cpu_data(), this->blobs_[1]->cpu_data());
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::backward_direct_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<Blob<Dtype>*>& bottom)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+
+    resize_direct_buffers_cpu();
+    const Dtype* direct_weights = _direct_weights.cpu_data();
+    Dtype* direct_weight_diff = _direct_weight_diff.mutable_cpu_data();
+    Dtype* input_buff = _direct_input_buffer.mutable_cpu_data();
+    Dtype* output_buff = _direct_output_buffer.mutable_cpu_data();
+
+    caffe_set(_direct_weight_diff.count(), Dtype(0), direct_weight_diff);
+    caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        const Dtype* input = bottom[0]->cpu_data() + _key_layer->get_item_offset(*bottom[0], n);
+        const Dtype* output_diff = top[0]->cpu_diff() + this->get_item_offset(*top[0], n);
+        Dtype* input_diff = bottom[0]->mutable_cpu_diff() + _key_layer->get_item_offset(*bottom[0], n);
+
+        if(!this->_packed)
+        {
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
+            backward_cpu_bias(this->blobs_[1]->mutable_cpu_diff(), output_diff);
+        }
+
+        for(int el=0; el<num_neighbors; el++)
+        {
+            const int num_pairs = collect_direct_pairs(n, el);
+            if(!num_pairs) continue;
+
+            const int weights_offset = el * _num_output_channels * _num_input_channels;
+            gather_columns_cpu(output_diff, _num_output_channels, _num_output_pixels, num_pairs, _direct_dst.data(), output_buff);
+            gather_columns_cpu(input, _num_input_channels, _num_input_pixels, num_pairs, _direct_src.data(), input_buff);
+            {
+                OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
+                caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_output_channels, _num_input_channels, num_pairs,
+                    (Dtype)1., output_buff, input_buff, (Dtype)1., direct_weight_diff + weights_offset);
+                caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _num_input_channels, num_pairs, _num_output_channels,
+                    (Dtype)1., direct_weights + weights_offset, output_buff, (Dtype)0., input_buff);
+            }
+            scatter_add_columns_cpu(input_buff, _num_input_channels, num_pairs, _direct_src.data(), input_diff, _num_input_pixels);
+        }
+    }
+
+    if(this->_packed)
+    {
+        resize_computation_buffers_cpu(_num_output_pixels);
+        backward_cpu_bias(this->blobs_[1]->mutable_cpu_diff(), top[0]->cpu_diff());
+    }
+
+    Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+    for(int el=0; el<num_neighbors; el++)
+    {
+        for(int o=0; o<_num_output_channels; o++)
+        {
+            for(int i=0; i<_num_input_channels; i++)
+            {
+                int w_ind;
+                if(is_deconv) w_ind = (i * _num_output_channels + o) * num_neighbors + el;
+                else w_ind = (o * _num_input_channels + i) * num_neighbors + el;
+                weight_diff[w_ind] += direct_weight_diff[(el * _num_output_channels + o) * _num_input_channels + i];
+            }
         }
     }
+}
 
+/// Gathers the input features of batch item batch_ind from the source of the
+/// fused OGNProp key layer into num_cols columns of output, in the order of the
+/// propagated cells; columns past the cells of the item are zero-filled.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::gather_fused_input_cpu(int batch_ind, Dtype* output, int output_cols, int num_cols)
+{
+    const Blob<Dtype>& source = _fused_prop->get_source_features();
+    const Dtype* input = source.cpu_data() + _fused_prop->get_source_key_layer().get_item_offset(source, batch_ind);
+    const int input_cols = source.count(2);
+    const std::vector<int>& indices = _fused_prop->get_source_indices(batch_ind);
+    const int num_cells = indices.size();
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gather_ms));
+
+    OGN_PARALLEL_FOR
+    for(int ch=0; ch<_num_input_channels; ch++)
+    {
+        const Dtype* input_row = input + ch * input_cols;
+        Dtype* output_row = output + ch * output_cols;
+        for(int col=0; col<num_cells; col++) output_row[col] = input_row[indices[col]];
+        for(int col=num_cells; col<num_cols; col++) output_row[col] = Dtype(0);
+    }
 }
 
+/// Copies the active cells of every batch item from a (batch x channels x pixels)
+/// array into a (channels x active cells) array. Batch item n has scale * (number of
+/// its active key cells) active pixels.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::pack_features_cpu(const Dtype* input, int channels, int pixels, int scale, Dtype* output)
+{
+    const int num_cols = scale * _key_offsets[_batch_size];
+    OGN_PARALLEL_FOR
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        const int len = scale * (_key_offsets[n + 1] - _key_offsets[n]);
+        for(int ch=0; ch<channels; ch++)
+        {
+            const Dtype* input_row = input + (n * channels + ch) * pixels;
+            std::copy(input_row, input_row + len, output + ch * num_cols + scale * _key_offsets[n]);
+        }
+    }
+}
 
+/// Inverse of pack_features_cpu; inactive pixels are set to zero.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::unpack_features_cpu(const Dtype* input, int channels, int pixels, int scale, Dtype* output)
+{
+    const int num_cols = scale * _key_offsets[_batch_size];
+    OGN_PARALLEL_FOR
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        const int len = scale * (_key_offsets[n + 1] - _key_offsets[n]);
+        for(int ch=0; ch<channels; ch++)
+        {
+            Dtype* output_row = output + (n * channels + ch) * pixels;
+            const Dtype* input_row = input + ch * num_cols + scale * _key_offsets[n];
+            std::copy(input_row, input_row + len, output_row);
+            caffe_set(pixels - len, Dtype(0), output_row + len);
+        }
+    }
+}
 
 template <typename Dtype>
 void OGNConvLayer<Dtype>::resize_computation_buffers_cpu(int batch_num_pixels)
@@ -191,13 +844,13 @@ void OGNConvLayer<Dtype>::resize_computation_buffers_cpu(int batch_num_pixels)
     _bias_multiplier.Reshape(bias_multiplier_shape);
     caffe_set(_num_output_pixels, Dtype(0), _bias_multiplier.mutable_cpu_data());
     caffe_set(batch_num_pixels, Dtype(1), _bias_multiplier.mutable_cpu_data());
-    memset(_col_buffer.mutable_cpu_data(), 0, sizeof(Dtype)*_col_buffer_shape[0]*_col_buffer_shape[1]);
 }
 
 template <typename Dtype>
 void OGNConvLayer<Dtype>::backward_cpu_gemm(const Dtype* top_diff, const Dtype* weights, Dtype* col_buff)
 {
 	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
 
     caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _weight_shape[1] * filter_size * filter_size * filter_size,
         _col_buffer_shape[1], _weight_shape[0],
@@ -208,6 +861,7 @@ void OGNConvLayer<Dtype>::backward_cpu_gemm(const Dtype* top_diff, const Dtype*
 template <typename Dtype>
 void OGNConvLayer<Dtype>::forward_cpu_gemm(const Dtype* weights, const Dtype* input, Dtype* output)
 {
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _weight_shape[0],
         _col_buffer_shape[1], _col_buffer_shape[0],
         (Dtype)1., weights, input,
@@ -217,7 +871,7 @@ void OGNConvLayer<Dtype>::forward_cpu_gemm(const Dtype* weights, const Dtype* in
 template <typename Dtype>
 void OGNConvLayer<Dtype>::forward_cpu_bias(Dtype* output, const Dtype* bias)
 {
-    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _bias_shape[0], _num_output_pixels, 1,
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _bias_shape[0], _bias_multiplier.count(), 1,
                           (Dtype)1., bias, _bias_multiplier.cpu_data(),
                           (Dtype)1., output);
 }
@@ -225,129 +879,99 @@ void OGNConvLayer<Dtype>::forward_cpu_bias(Dtype* output, const Dtype* bias)
 template <typename Dtype>
 void OGNConvLayer<Dtype>::backward_cpu_bias(Dtype* bias, const Dtype* input)
 {
-    caffe_cpu_gemv<Dtype>(CblasNoTrans, _num_output_channels, _num_output_pixels, 1.,
+    caffe_cpu_gemv<Dtype>(CblasNoTrans, _num_output_channels, _bias_multiplier.count(), 1.,
       input, _bias_multiplier.cpu_data(), (Dtype)1., bias);
 }
 
 template <typename Dtype>
 void OGNConvLayer<Dtype>::weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype* weights)
 {
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
     const Dtype* col_buff = input;
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _weight_shape[0],
                           _col_buffer_shape[0], _col_buffer_shape[1],
                           (Dtype)1., output, col_buff, (Dtype)1., weights);
 }
 
+/// Quantizes the weights into the (rows x depth) matrix of the GEMM of the
+/// forward pass: the weights of a convolution, the transposed weights of a
+/// deconvolution. Int8Gemm only quantizes them again after they changed.
 template <typename Dtype>
-void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top)
+void OGNConvLayer<Dtype>::quantize_weights_cpu()
 {
-	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
-	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+    if(is_deconv) _int8_gemm.set_weights(*this->blobs_[0], _num_output_channels * num_neighbors,
+        _num_input_channels, true, num_neighbors);
+    else _int8_gemm.set_weights(*this->blobs_[0], _num_output_channels,
+        _num_input_channels * num_neighbors, false, 1);
+}
 
-    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+/// The GEMM of the forward pass in int8 on the columns of the column buffer,
+/// with the input scale of OGNConvParameter.input_scale.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::quantized_gemm_cpu(const Dtype* input, Dtype* output)
+{
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gemm_ms));
+    _int8_gemm.gemm(input, _col_buffer_shape[1], this->layer_param_.ogn_conv_param().input_scale(), output);
+}
 
-    Dtype* output_arr;
-    int output_rows, output_cols;
-    if(is_deconv)
-    {
-        output_arr = top[0]->mutable_cpu_data();
-        output_rows = _num_output_channels;
-        output_cols = _num_output_pixels;
-    }
-    else
-    {
-        output_arr = bottom[0]->mutable_cpu_diff();
-        output_rows = _num_input_channels;
-        output_cols = _num_input_pixels;
-    }
+/// Scatters num_active_cells(batch_ind) columns of the column buffer, whose rows are
+/// col_cols apart, into the feature array of one batch item, whose rows are output_cols apart.
+template <typename Dtype>
+void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const Dtype* col_buff, int col_cols,
+      Dtype* output, int output_cols)
+{
+	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+    const int output_rows = _weight_shape[1];
+    const int num_cells = _key_offsets[batch_ind + 1] - _key_offsets[batch_ind];
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::scatter_ms));
 
-    if(!batch_ind) memset(output_arr, 0, sizeof(Dtype) * _batch_size * output_rows * output_cols);
+    const int* table = _neighbor_table.data() + _key_offsets[batch_ind] * num_neighbors;
 
-    for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(batch_ind).begin(); it!=l_ptr->get_keys_octree(batch_ind).end(); it++)
+    OGN_PARALLEL_FOR
+    for(int ch=0; ch<output_rows; ch++)
     {
-        KeyType key = it->first;
-
-        if(is_deconv) key = key << 3;
-
-        std::vector<KeyType> neighbors = this->_octree_keys[batch_ind].get_neighbor_keys(key, filter_size);
-        for(int ch=0; ch<output_rows; ch++)
+        for(int el=0; el<num_neighbors; el++)
         {
-            for(int el=0; el<filter_size*filter_size*filter_size; el++)
+            const Dtype* col_row = col_buff + (ch * num_neighbors + el) * col_cols;
+            for(int col=0; col<num_cells; col++)
             {
-                int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + el * _col_buffer_shape[1] + it->second;
-
-                if(neighbors[el] != GeneralOctree<int>::INVALID_KEY())
-                {
-                    unsigned int nbh_key = neighbors[el];
-                    int feature_ind = batch_ind * output_rows * output_cols +
-                                  ch * output_cols + this->_octree_keys[batch_ind].get_value(nbh_key);
-
-                    output_arr[feature_ind] += _col_buffer.mutable_cpu_data()[col_buff_ind];
-                }
+                const int feature_ind = table[col * num_neighbors + el];
+                if(feature_ind >= 0) output[ch * output_cols + feature_ind] += col_row[col];
             }
         }
     }
-
-    memset(_col_buffer.mutable_cpu_data(), 0, sizeof(Dtype)*_col_buffer_shape[0]*_col_buffer_shape[1]);
 }
 
+/// Gathers the neighborhoods of one batch item into num_cols columns of the column buffer;
+/// columns past the active cells of the item are zero-filled.
 template <typename Dtype>
-void OGNConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top)
+void OGNConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const Dtype* input, int input_cols,
+      Dtype* col_buff, int col_cols, int num_cols)
 {
 	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
-	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int num_neighbors = filter_size * filter_size * filter_size;
+    const int input_rows = _weight_shape[1];
+    const int num_cells = _key_offsets[batch_ind + 1] - _key_offsets[batch_ind];
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::gather_ms));
 
-    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    const int* table = _neighbor_table.data() + _key_offsets[batch_ind] * num_neighbors;
 
-    int input_rows, input_cols;
-    if(is_deconv)
+    OGN_PARALLEL_FOR
+    for(int ch=0; ch<input_rows; ch++)
     {
-        input_rows = _num_output_channels;
-        input_cols = _num_output_pixels;
-    }
-    else
-    {
-        input_rows = _num_input_channels;
-        input_cols = _num_input_pixels;
-    }
-
-    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
-
-    for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(batch_ind).begin(); it!=l_ptr->get_keys_octree(batch_ind).end(); it++)
-    {
-        KeyType key = it->first;
-        if(is_deconv) key = key << 3;
-
-        if(key)
+        for(int el=0; el<num_neighbors; el++)
         {
-            std::vector<KeyType> neighbors = this->_octree_keys[batch_ind].get_neighbor_keys(key, filter_size);
-
-            for(int ch=0; ch<input_rows; ch++)
+            Dtype* col_row = col_buff + (ch * num_neighbors + el) * col_cols;
+            for(int col=0; col<num_cells; col++)
             {
-                for(int el=0; el<neighbors.size(); el++)
-                {
-                    int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + el * _col_buffer_shape[1] + it->second;
-
-                    if(neighbors[el] != GeneralOctree<int>::INVALID_KEY())
-                    {
-                        KeyType nbh_key = neighbors[el];
-                        int feature_ind = batch_ind * input_rows * input_cols +
-                                      ch * input_cols + this->_octree_keys[batch_ind].get_value(nbh_key);
-                        if(is_deconv) col_buff[col_buff_ind] = top[0]->cpu_diff()[feature_ind];
-                        else col_buff[col_buff_ind] = bottom[0]->cpu_data()[feature_ind];
-                    }
-                    else
-                    {
-                        col_buff[col_buff_ind] = 0;
-                    }
-                }
+                const int feature_ind = table[col * num_neighbors + el];
+                col_row[col] = feature_ind >= 0 ? input[ch * input_cols + feature_ind] : Dtype(0);
             }
+            for(int col=num_cells; col<num_cols; col++) col_row[col] = Dtype(0);
         }
     }
 }
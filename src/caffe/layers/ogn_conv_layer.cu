@@ -2,26 +2,58 @@
 
 namespace caffe {
 
+/// The GPU path runs the per-item float GEMMs only; the options of the CPU
+/// engines are reported once, so that timings are not attributed to them.
+static void warn_gpu_ignored_options(const LayerParameter& param, bool forward)
+{
+    const OGNConvParameter& conv_param = param.ogn_conv_param();
+    if(conv_param.engine() == OGNConvParameter_Engine_DIRECT)
+        LOG_FIRST_N(WARNING, 1) << "OGNConv: the DIRECT engine is CPU-only, " << param.name() << " runs the IM2COL engine on the GPU";
+    if(conv_param.batched_gemm())
+        LOG_FIRST_N(WARNING, 1) << "OGNConv: batched_gemm is CPU-only, " << param.name() << " runs per-item GEMMs on the GPU";
+    if(forward && conv_param.int8())
+        LOG_FIRST_N(WARNING, 1) << "OGNConv: int8 is CPU-only, " << param.name() << " runs in float on the GPU";
+}
+
 template <typename Dtype>
 void OGNConvLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
+    // packed blobs are handled by the batched CPU path
+    if(this->_packed || _key_layer->is_packed())
+    {
+        Forward_cpu(bottom, top);
+        return;
+    }
+    warn_gpu_ignored_options(this->layer_param_, true);
+
     bool is_deconv = this->layer_param().ogn_conv_param().is_deconv();
     const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 
     propagate_keys_cpu();
+    build_neighbor_table_cpu();
+    this->update_stats();
+
+    if(!_key_offsets[_batch_size])
+    {
+        caffe_gpu_set(top[0]->count(), Dtype(0), top[0]->mutable_gpu_data());
+        return;
+    }
+
+    if(is_deconv) caffe_gpu_set(top[0]->count(), Dtype(0), top[0]->mutable_gpu_data());
 
     for (int n = 0; n < _batch_size; n++)
     {
-        int num_elements = this->_octree_keys[n].num_elements();
+        int num_elements = this->get_keys_octree(n).num_elements();
         if(is_deconv)
         {
-            resize_computation_buffers_cpu(this->_octree_keys[n].num_elements());
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
             caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _weight_shape[1] * filter_size * filter_size * filter_size,
                                   _num_input_pixels, _weight_shape[0],
                                   (Dtype)1., this->blobs_[0]->gpu_data(), bottom[0]->gpu_data() + n * _num_input_channels * _num_input_pixels,
                                   (Dtype)0., _col_buffer.mutable_gpu_data());
-            col2im_octree_cpu(n, bottom, top);
+            col2im_octree_cpu(n, _col_buffer.cpu_data(), _col_buffer_shape[1],
+                top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels, _num_output_pixels);
             caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_output_channels, _num_output_pixels, 1,
                           (Dtype)1., this->blobs_[1]->gpu_data(), _bias_multiplier.gpu_data(),
                           (Dtype)1., top[0]->mutable_gpu_data() + n * _num_output_channels * _num_output_pixels);
@@ -29,7 +61,8 @@ void OGNConvLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
         else
         {
             resize_computation_buffers_cpu(num_elements);
-            im2col_octree_cpu(n, bottom, top);
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, _num_input_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
             caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _weight_shape[0],
                     _col_buffer_shape[1], _col_buffer_shape[0],
                     (Dtype)1., this->blobs_[0]->gpu_data(), _col_buffer.mutable_gpu_data(),
@@ -46,20 +79,30 @@ template <typename Dtype>
 void OGNConvLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
+    if(this->_packed || _key_layer->is_packed())
+    {
+        Backward_cpu(top, propagate_down, bottom);
+        return;
+    }
+    warn_gpu_ignored_options(this->layer_param_, false);
+
     bool is_deconv = this->layer_param().ogn_conv_param().is_deconv();
     const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 
+    if(!is_deconv) caffe_gpu_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_gpu_diff());
+
     for (int n = 0; n < _batch_size; ++n)
     {
         if(is_deconv)
         {
-            resize_computation_buffers_cpu(this->_octree_keys[n].num_elements());
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
 
             caffe_gpu_gemv<Dtype>(CblasNoTrans, _num_output_channels, _num_output_pixels, 1.,
                 top[0]->gpu_diff() + n * _num_output_pixels * _num_output_channels, _bias_multiplier.gpu_data(), 1.,
                 this->blobs_[1]->mutable_gpu_diff());
 
-            im2col_octree_cpu(n, bottom, top);
+            im2col_octree_cpu(n, top[0]->cpu_diff() + n * _num_output_channels * _num_output_pixels, _num_output_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
 
             caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _weight_shape[0],
                           _col_buffer_shape[0], _col_buffer_shape[1],
@@ -73,8 +116,9 @@ void OGNConvLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
         }
         else
         {
-            resize_computation_buffers_cpu(this->_octree_keys[n].num_elements());
-            im2col_octree_cpu(n, bottom, top);
+            resize_computation_buffers_cpu(this->get_keys_octree(n).num_elements());
+            im2col_octree_cpu(n, bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels, _num_input_pixels,
+                _col_buffer.mutable_cpu_data(), _col_buffer_shape[1], _col_buffer_shape[1]);
 
             caffe_gpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _weight_shape[0], _col_buffer_shape[0], _col_buffer_shape[1],
                 (Dtype)1., top[0]->gpu_diff() + n * _num_output_channels * _num_output_pixels, _col_buffer.mutable_gpu_data(), (Dtype)1., this->blobs_[0]->mutable_gpu_diff());
@@ -86,7 +130,8 @@ void OGNConvLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
                 _col_buffer_shape[1], _weight_shape[0], (Dtype)1., this->blobs_[0]->gpu_data(),
                 top[0]->gpu_diff() + n * _num_output_channels * _num_output_pixels, (Dtype)0., _col_buffer.mutable_gpu_data());
 
-            col2im_octree_cpu(n, bottom, top);
+            col2im_octree_cpu(n, _col_buffer.cpu_data(), _col_buffer_shape[1],
+                bottom[0]->mutable_cpu_diff() + n * _num_input_channels * _num_input_pixels, _num_input_pixels);
         }
     }
 }
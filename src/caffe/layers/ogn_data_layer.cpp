@@ -1,4 +1,7 @@
+#include <boost/thread.hpp>
+
 #include "caffe/layers/ogn_data_layer.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
@@ -7,9 +10,40 @@ using namespace std;
 template <typename Dtype>
 void OGNDataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+    const OGNDataParameter& param = this->layer_param_.ogn_data_param();
     _model_counter = 0;
     _done_initial_reshape = false;
+    this->_packed = param.packed();
     load_data_from_disk();
+
+    if(param.num_shards() < 1 || param.shard_id() >= param.num_shards())
+        LOG(FATAL) << "Invalid shard " << param.shard_id() << " of " << param.num_shards() << ".";
+    if(param.shard_id() >= _file_names.size())
+        LOG(FATAL) << "Shard " << param.shard_id() << " has no models.";
+    if(param.shuffle())
+    {
+        const unsigned int seed = param.seed() ? param.seed() : caffe_rng_rand();
+        _sampling_rng.reset(new Caffe::RNG(seed));
+    }
+    if(param.structure_cache_mb() > 0)
+        _structure_cache.reset(new OGNStructureCache((long long)param.structure_cache_mb() << 20));
+    _epoch = -1;
+    start_epoch();
+
+    // models selected through a bottom blob are only known at Reshape time
+    const int prefetch = this->layer_param_.ogn_data_param().prefetch();
+    _prefetching = prefetch > 0 && bottom.size() == 0;
+    if(!_prefetching) return;
+
+    _prefetch.resize(prefetch);
+    for(int i=0; i<prefetch; i++)
+    {
+        _prefetch[i].reset(new OGNBatch<Dtype>());
+        _prefetch[i]->labels_.Reshape(vector<int>(1, this->layer_param_.ogn_data_param().batch_size()));
+        _prefetch[i]->labels_.mutable_cpu_data();
+        _prefetch_free.push(_prefetch[i].get());
+    }
+    StartInternalThread();
 }
 
 template <typename Dtype>
@@ -27,23 +61,24 @@ void OGNDataLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
         values_shape.push_back(batch_size); values_shape.push_back(1);
         _done_initial_reshape = true;
     }
+    else if(_prefetching)
+    {
+        // the shape of the next prefetched batch is set in Forward_cpu
+        return;
+    }
     else
     {
         vector<int> batch_elements;
-        for(int bt=0; bt<batch_size; bt++)
+        if(bottom.size() == 0)
         {
-            if(bottom.size() == 0)
-            {
-                batch_elements.push_back(_model_counter++);
-                if(_model_counter == _file_names.size()) _model_counter = 0;
-            }
-            else
-            {
-                batch_elements.push_back(bottom[0]->cpu_data()[bt]);
-            }
+            batch_elements = next_batch_labels();
+        }
+        else
+        {
+            for(int bt=0; bt<batch_size; bt++) batch_elements.push_back(bottom[0]->cpu_data()[bt]);
         }
         int num_elements = select_next_batch_models(batch_elements);
-        values_shape.push_back(batch_size); values_shape.push_back(num_elements);
+        values_shape.push_back(this->_packed ? 1 : batch_size); values_shape.push_back(num_elements);
     }
 
     top[0]->Reshape(values_shape);
@@ -54,63 +89,218 @@ template <typename Dtype>
 void OGNDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
-    this->_octree_keys.clear();
+    if(_prefetching)
+    {
+        if(_prefetch_current) _prefetch_free.push(_prefetch_current);
+        _prefetch_current = _prefetch_full.pop("Waiting for octree data");
+
+        top[0]->ReshapeLike(_prefetch_current->values_);
+        top[0]->set_cpu_data(_prefetch_current->values_.mutable_cpu_data());
+        top[1]->ReshapeLike(_prefetch_current->labels_);
+        top[1]->set_cpu_data(_prefetch_current->labels_.mutable_cpu_data());
+        // the batch gets the previous key octrees back and overwrites them when it is reused
+        OGNOctrees& octrees = this->mutable_octrees();
+        octrees.keys.swap(_prefetch_current->octree_keys_);
+        this->update_batch_offsets();
+        octrees.sorted_keys.swap(_prefetch_current->sorted_keys_);
+        set_model_ids(top[1]->cpu_data());
+        this->update_stats();
+        return;
+    }
+
+    OGNOctrees& octrees = this->mutable_octrees();
+    OGNOctreeBatch<SortedKeyOctree> sorted_keys;
+    fill_batch(top[0]->mutable_cpu_data(), top[0]->shape(1), top[1]->mutable_cpu_data(), octrees.keys, sorted_keys);
+    this->update_batch_offsets();
+    octrees.sorted_keys.swap(sorted_keys);
+    set_model_ids(top[1]->cpu_data());
+    this->update_stats();
+}
+
+/// Marks the cells of the current batch as determined by the models in labels,
+/// for the structure cache.
+template <typename Dtype>
+void OGNDataLayer<Dtype>::set_model_ids(const Dtype* labels)
+{
+    OGNOctrees& octrees = this->mutable_octrees();
+    octrees.model_ids.resize(octrees.keys.size());
+    for(int bt=0; bt<octrees.keys.size(); bt++) octrees.model_ids[bt] = labels[bt];
+    octrees.structure_cache = _structure_cache;
+}
+
+template <typename Dtype>
+void OGNDataLayer<Dtype>::InternalThreadEntry() {
+    try
+    {
+        while(!must_stop())
+        {
+            OGNBatch<Dtype>* batch = _prefetch_free.pop();
+            load_batch(batch);
+            _prefetch_full.push(batch);
+        }
+    }
+    catch (boost::thread_interrupted&)
+    {
+        // Interrupted exception is expected on shutdown
+    }
+}
+
+template <typename Dtype>
+void OGNDataLayer<Dtype>::load_batch(OGNBatch<Dtype>* batch)
+{
     const int batch_size = this->layer_param_.ogn_data_param().batch_size();
-    int num_elements = top[0]->shape(1);
+    int num_elements = select_next_batch_models(next_batch_labels());
 
-    Dtype* top_values = top[0]->mutable_cpu_data();
-    Dtype* top_labels = top[1]->mutable_cpu_data();
+    vector<int> values_shape;
+    values_shape.push_back(this->_packed ? 1 : batch_size); values_shape.push_back(num_elements);
+    batch->values_.Reshape(values_shape);
+    fill_batch(batch->values_.mutable_cpu_data(), num_elements, batch->labels_.mutable_cpu_data(), batch->octree_keys_,
+        batch->sorted_keys_);
+}
+
+/// Writes the models of the current batch into the values array, padded with zeros
+/// to (batch x num_elements) or packed into (1 x num_elements), and builds their key
+/// octrees. With the hash backend, the keys are also sorted into sorted_keys, see
+/// OGNLayer::get_sorted_keys_octree.
+template <typename Dtype>
+void OGNDataLayer<Dtype>::fill_batch(Dtype* top_values, int num_elements, Dtype* top_labels,
+      OGNOctreeBatch<KeyOctree>& octree_keys, OGNOctreeBatch<SortedKeyOctree>& sorted_keys)
+{
+    const int batch_size = this->layer_param_.ogn_data_param().batch_size();
+    octree_keys.clear();
+    octree_keys.resize(batch_size);
+    sorted_keys.clear();
+#ifndef USE_SORTED_OCTREE
+    sorted_keys.resize(batch_size);
+#endif
 
-    memset(top_values, 0, sizeof(Dtype) * top[0]->count());
-    memset(top_labels, 0, sizeof(Dtype) * top[1]->count());
+    vector<int> item_offsets(batch_size, 0);
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        if(!this->_packed) item_offsets[bt] = bt * num_elements;
+        else if(bt > 0) item_offsets[bt] = item_offsets[bt - 1] + _batch_octrees[bt - 1].num_elements();
+    }
 
+    memset(top_values, 0, sizeof(Dtype) * (this->_packed ? 1 : batch_size) * num_elements);
+    memset(top_labels, 0, sizeof(Dtype) * batch_size);
+
+    OGN_PARALLEL_FOR
     for(int bt=0; bt<batch_size; bt++)
     {
-        GeneralOctree<int> octree_keys;
-        int counter = 0;
-        for(Octree::iterator it=_batch_octrees[bt].begin(); it!=_batch_octrees[bt].end(); it++)
+        KeyOctree& keys_octree = octree_keys[bt];
+        const OctreeModel& model = _batch_octrees[bt];
+        const KeyType* keys = model.keys();
+        const SignalType* values = model.values();
+        vector<int> indices(model.num_elements());
+        for(int counter=0; counter<model.num_elements(); counter++)
         {
-            int top_index = bt * num_elements + counter;
-            top_values[top_index] = (Dtype)(it->second);
-            octree_keys.add_element(it->first, counter);
-            counter++;
+            int top_index = item_offsets[bt] + counter;
+            top_values[top_index] = (Dtype)(values[counter]);
+            indices[counter] = counter;
         }
+        // models are sorted by key, so both backends are built in linear time
+        keys_octree.assign(keys, indices.data(), model.num_elements());
+#ifndef USE_SORTED_OCTREE
+        sorted_keys[bt].assign(keys, indices.data(), model.num_elements());
+#endif
         top_labels[bt] = _batch_labels[bt];
-        this->_octree_keys.push_back(octree_keys);
     }
 }
 
 template <typename Dtype>
 void OGNDataLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-        LOG(FATAL) << "Backward not implemented";
+        // only fails if a gradient is actually requested, so that `caffe time` can run OGN nets
+        for(int i=0; i<propagate_down.size(); i++)
+        {
+            if(propagate_down[i]) LOG(FATAL) << "Backward not implemented";
+        }
 }
 
 template <typename Dtype>
-int OGNDataLayer<Dtype>::select_next_batch_models(vector<int> labels)
+vector<int> OGNDataLayer<Dtype>::next_batch_labels()
 {
-    const bool preload_data = this->layer_param_.ogn_data_param().preload_data();
-    int num_elements = 0;
-    _batch_octrees.clear();
-    _batch_labels.clear();
+    const int batch_size = this->layer_param_.ogn_data_param().batch_size();
+    vector<int> labels;
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        labels.push_back(_epoch_order[_model_counter++]);
+        if(_model_counter == _epoch_order.size()) start_epoch();
+    }
+    return labels;
+}
+
+/// Computes the order in which the models of this shard are visited in the next epoch.
+template <typename Dtype>
+void OGNDataLayer<Dtype>::start_epoch()
+{
+    const OGNDataParameter& param = this->layer_param_.ogn_data_param();
+    const int batch_size = param.batch_size();
+    _model_counter = 0;
+    _epoch++;
 
-    for(int bt=0; bt<labels.size(); bt++)
+    _epoch_order.clear();
+    for(int i=param.shard_id(); i<_file_names.size(); i+=param.num_shards()) _epoch_order.push_back(i);
+
+    caffe::rng_t* rng = _sampling_rng ? static_cast<caffe::rng_t*>(_sampling_rng->generator()) : NULL;
+    if(rng) shuffle(_epoch_order.begin(), _epoch_order.end(), rng);
+
+    if(param.bucket_batches() > 0)
     {
-        int len = 0;
-        _batch_labels.push_back(labels[bt]);
-        if(preload_data)
+        const int window = param.bucket_batches() * batch_size;
+        vector<pair<int, int> > sized_order;
+        for(int i=0; i<_epoch_order.size(); i++)
+            sized_order.push_back(pair<int, int>(_model_sizes[_epoch_order[i]], _epoch_order[i]));
+        for(int start=0; start<sized_order.size(); start+=window)
         {
-            _batch_octrees.push_back(_octrees[labels[bt]]);
-            len = _octrees[labels[bt]].num_elements();
+            int end = std::min<int>(start + window, sized_order.size());
+            std::stable_sort(sized_order.begin() + start, sized_order.begin() + end);
         }
-        else
+
+        vector<int> batch_starts;
+        for(int start=0; start<sized_order.size(); start+=batch_size) batch_starts.push_back(start);
+        if(rng) shuffle(batch_starts.begin(), batch_starts.end(), rng);
+
+        _epoch_order.clear();
+        for(int b=0; b<batch_starts.size(); b++)
         {
-            Octree tree;
-            tree.from_file(_file_names[labels[bt]]);
-            _batch_octrees.push_back(tree);
-            len = tree.num_elements();
+            int end = std::min<int>(batch_starts[b] + batch_size, sized_order.size());
+            for(int i=batch_starts[b]; i<end; i++) _epoch_order.push_back(sized_order[i].second);
         }
-        if(len > num_elements) num_elements = len;
+    }
+
+    if(param.shuffle() || param.bucket_batches() > 0)
+        LOG(INFO) << this->layer_param_.name() << ": starting epoch " << _epoch << " with " << _epoch_order.size() << " models";
+    if(_structure_cache && _epoch > 0)
+    {
+        LOG(INFO) << this->layer_param_.name() << ": structure cache of " << (_structure_cache->memory_bytes() >> 20)
+            << " MB, " << _structure_cache->hits() << " hits, " << _structure_cache->misses() << " misses";
+    }
+}
+
+template <typename Dtype>
+int OGNDataLayer<Dtype>::select_next_batch_models(vector<int> labels)
+{
+    const bool preload_data = this->layer_param_.ogn_data_param().preload_data();
+    const int batch_size = labels.size();
+    _batch_octrees.clear();
+    _batch_octrees.resize(batch_size);
+    _batch_labels = labels;
+
+    OGN_PARALLEL_FOR
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        if(preload_data) _batch_octrees[bt] = _octrees[labels[bt]];
+        else CHECK(_batch_octrees[bt].from_file(_file_names[labels[bt]])) << "OGNData: cannot read " << _file_names[labels[bt]];
+    }
+
+    // number of value columns: the largest model, or all models when packed
+    int num_elements = 0;
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        int len = _batch_octrees[bt].num_elements();
+        if(this->_packed) num_elements += len;
+        else if(len > num_elements) num_elements = len;
     }
     return num_elements;
 }
@@ -124,18 +314,42 @@ void OGNDataLayer<Dtype>::load_data_from_disk()
 
     ifstream infile(source.c_str());
     string name;
-    int counter = 0;
     while(infile >> name)
     {
         _file_names.push_back(name);
-        if(preload_data)
+    }
+
+    if(preload_data)
+    {
+        const int num_files = _file_names.size();
+        _octrees.resize(num_files);
+        OGN_PARALLEL_FOR
+        for(int i=0; i<num_files; i++)
+        {
+            CHECK(_octrees[i].from_file(_file_names[i])) << "OGNData: cannot read " << _file_names[i];
+        }
+        for(int i=0; i<num_files; i++) cout << _file_names[i] << endl;
+    }
+
+    // size-bucketed sampling needs the number of cells of every model
+    if(this->layer_param_.ogn_data_param().bucket_batches() > 0)
+    {
+        const int num_files = _file_names.size();
+        _model_sizes.resize(num_files);
+        OGN_PARALLEL_FOR
+        for(int i=0; i<num_files; i++)
         {
-            Octree tree;
-            tree.from_file(name);
-            _octrees.push_back(tree);
-            cout << name << endl;
+            if(preload_data)
+            {
+                _model_sizes[i] = _octrees[i].num_elements();
+            }
+            else
+            {
+                OctreeModel model;
+                CHECK(model.from_file(_file_names[i])) << "OGNData: cannot read " << _file_names[i];
+                _model_sizes[i] = model.num_elements();
+            }
         }
-        counter++;
     }
 
     std::cout << "Done." << std::endl;
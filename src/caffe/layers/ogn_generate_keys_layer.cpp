@@ -21,47 +21,67 @@ void OGNGenerateKeysLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
         if(level > this->_level) this->_level = level;
     }
 
-    this->_octree_keys.clear();
-    this->_octree_prop.clear();
-
     int batch_size = bottom[0]->shape(0);
     int xsize = bottom[0]->shape(2);
     int ysize = bottom[0]->shape(3);
     int zsize = bottom[0]->shape(4);
+    CHECK_LE(this->_level, KeyOctree::MAX_LEVEL()) << "OGNGenerateKeys: octree levels beyond "
+        << KeyOctree::MAX_LEVEL() << " need 64-bit keys (USE_64BIT_KEYS)";
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::keys_ms));
 
-    for(int bt=0; bt<batch_size; bt++)
+    // the keys only depend on the grid size, so they are kept, and shared with
+    // the following layers, until it changes; all batch items share one octree
+    const vector<int> grid_shape(bottom[0]->shape().begin() + 2, bottom[0]->shape().end());
+    if(grid_shape == _grid_shape && this->get_batch_size() == batch_size) return;
+    if(grid_shape != _grid_shape)
     {
-        GeneralOctree<int> octree_keys;
-        GeneralOctree<int> octree_prop;
-        for(int x=0; x<xsize; x++)
+        _grid_shape = grid_shape;
+
+        // cell x*ysize*zsize + y*zsize + z is voxel (x, y, z)
+        const int num_cells = xsize * ysize * zsize;
+        std::vector<uint32_t> xs(num_cells), ys(num_cells), zs(num_cells);
+        std::vector<int> values(num_cells);
+        for(int x=0, ind=0; x<xsize; x++)
         {
             for(int y=0; y<ysize; y++)
             {
-                for(int z=0; z<zsize; z++)
+                for(int z=0; z<zsize; z++, ind++)
                 {
-                    OctreeCoord c;
-                    c.x = x; c.y = y; c.z = z; c.l = this->_level;
-                    KeyType key = Octree::compute_key(c);
-
-                    octree_keys.add_element(key, x*ysize*zsize + y*zsize + z);
-                    octree_prop.add_element(key, 1);
+                    xs[ind] = x; ys[ind] = y; zs[ind] = z;
+                    values[ind] = ind;
                 }
             }
         }
-        this->_octree_keys.push_back(octree_keys);
-        this->_octree_prop.push_back(octree_prop);
+        std::vector<KeyType> keys(num_cells);
+        KeyOctree::compute_keys(this->_level, xs.data(), ys.data(), zs.data(), keys.data(), num_cells);
+        const std::vector<int> prop(num_cells, 1);
+
+        // new octrees, as the old ones may still be used by the previous batch
+        _keys.reset(new KeyOctree());
+        _prop.reset(new KeyOctree());
+        _keys->assign(keys.data(), values.data(), num_cells);
+        _prop->assign(keys.data(), prop.data(), num_cells);
     }
+    OGNOctrees& octrees = this->mutable_octrees();
+    octrees.keys.assign(batch_size, _keys);
+    octrees.prop.assign(batch_size, _prop);
+    this->update_batch_offsets();
 }
 
 template <typename Dtype>
 void OGNGenerateKeysLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+    this->update_stats();
 }
 
 template <typename Dtype>
 void OGNGenerateKeysLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-    LOG(FATAL) << "Backward not implemented";
+    // only fails if a gradient is actually requested, so that `caffe time` can run OGN nets
+    for(int i=0; i<propagate_down.size(); i++)
+    {
+        if(propagate_down[i]) LOG(FATAL) << "Backward not implemented";
+    }
 }
 
 INSTANTIATE_CLASS(OGNGenerateKeysLayer);
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "caffe/layers/ogn_layer.hpp"
+
+namespace caffe {
+
+/// The parents of the cells of an item are found by sorting the cells by
+/// parent key, so they come out numbered in key order.
+template <typename Dtype>
+void OGNLayer<Dtype>::pool_keys(OGNLayer<Dtype>& source, std::vector<std::vector<int> >* parent_indices)
+{
+    OGNStatsTimer timer(stats_timer(&OGNStats::keys_ms));
+    const int num = source.get_batch_size();
+    OGNOctrees& octrees = mutable_octrees();
+    octrees.keys.resize(num);
+    octrees.prop.resize(num);
+    octrees.inherit_origin(source.get_octrees());
+    if(parent_indices) parent_indices->resize(num);
+
+    OGN_PARALLEL_FOR
+    for(int n=0; n<num; n++)
+    {
+        KeyOctree& child_keys = source.get_keys_octree(n);
+        // (parent key, child index) of every cell; the root is its own parent
+        std::vector<std::pair<KeyType, int> > cells;
+        cells.reserve(child_keys.num_elements());
+        for(typename KeyOctree::iterator it=child_keys.begin(); it!=child_keys.end(); it++)
+        {
+            const KeyType key = it->first;
+            cells.push_back(std::pair<KeyType, int>(key > 1 ? key >> 3 : key, it->second));
+        }
+        std::sort(cells.begin(), cells.end());
+
+        std::vector<KeyType> keys;
+        std::vector<int> values;
+        if(parent_indices) (*parent_indices)[n].assign(cells.size(), -1);
+        for(int i=0; i<cells.size(); i++)
+        {
+            if(!i || cells[i].first != cells[i - 1].first)
+            {
+                values.push_back(keys.size());
+                keys.push_back(cells[i].first);
+            }
+            if(parent_indices) (*parent_indices)[n][cells[i].second] = keys.size() - 1;
+        }
+        std::vector<int> prop(keys.size(), PROP_TRUE);
+        octrees.keys[n].assign(keys.data(), values.data(), keys.size());
+        octrees.prop[n].assign(keys.data(), prop.data(), keys.size());
+    }
+    update_batch_offsets();
+}
+
+INSTANTIATE_CLASS(OGNLayer);
+
+}  // namespace caffe
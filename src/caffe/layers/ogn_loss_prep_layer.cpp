@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "caffe/layers/ogn_loss_prep_layer.hpp"
 #include "caffe/layers/ogn_data_layer.hpp"
 #include "caffe/net.hpp"
@@ -36,11 +38,6 @@ template <typename Dtype>
 void OGNLossPrepLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
-    int batch_size = bottom[0]->shape(0);
-    int num_pixels = bottom[0]->shape(2);
-
-    int gt_num_pixels = bottom[1]->shape(1);
-
     const string gt_key_layer_name = this->layer_param_.ogn_loss_prep_param().gt_key_layer();
     const string pr_key_layer_name = this->layer_param_.ogn_loss_prep_param().pr_key_layer();
     const bool use_voxel_grid = this->layer_param_.ogn_loss_prep_param().use_voxel_grid();
@@ -51,36 +48,51 @@ void OGNLossPrepLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     shared_ptr<OGNLayer<Dtype> > gt_key_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(gt_raw_ptr);
     shared_ptr<OGNLayer<Dtype> > pr_key_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(pr_raw_ptr);
 
+    // the output follows the layout of the predicted features
+    const int batch_size = pr_key_layer->get_batch_size();
+
     const Dtype* gt_values = bottom[1]->cpu_data();
 
     Dtype* output_classification = top[0]->mutable_cpu_data();
 
-    const int dim = batch_size * top[0]->shape(1) * top[0]->shape(2);
-    caffe_set(dim, (Dtype)CLASS_IGNORE, output_classification);
+    caffe_set(top[0]->count(), (Dtype)CLASS_IGNORE, output_classification);
+    gt_key_layer->build_sorted_keys();
 
+    OGN_PARALLEL_FOR
     for(int bt = 0; bt<batch_size; bt++)
     {
         //multi-class classification
         if(top.size() == 1)
         {
-            GeneralOctree<int> &pr_keys_octree = pr_key_layer->get_keys_octree(bt);
-            GeneralOctree<int> &pr_prop_octree = pr_key_layer->get_prop_octree(bt);
-            GeneralOctree<int> &gt_keys_octree = gt_key_layer->get_keys_octree(bt);
-
-            for(GeneralOctree<int>::iterator it=pr_keys_octree.begin(); it!=pr_keys_octree.end(); it++)
+            KeyOctree &pr_keys_octree = pr_key_layer->get_keys_octree(bt);
+            KeyOctree &pr_prop_octree = pr_key_layer->get_prop_octree(bt);
+            SortedKeyOctree &gt_keys_octree = gt_key_layer->get_sorted_keys_octree(bt);
+            const Dtype* item_gt_values = gt_values + gt_key_layer->get_item_offset(*bottom[1], bt);
+            Dtype* item_output = output_classification + pr_key_layer->get_item_offset(*top[0], bt);
+
+            // the ground truth of all propagated cells is looked up at once, in key order;
+            // the other cells stay ignored
+            std::vector<std::pair<KeyType, int> > cells;
+            cells.reserve(pr_keys_octree.num_elements());
+            for(KeyOctree::iterator it=pr_keys_octree.begin(); it!=pr_keys_octree.end(); it++)
             {
                 if(pr_prop_octree.get_value(it->first) == PROP_TRUE)
-                {
-                    SignalType gt_value;
-                    int gt_ind = gt_keys_octree.get_value(it->first, use_voxel_grid);
-                    if(gt_ind != -1) gt_value = gt_values[bt * gt_num_pixels + gt_ind];
-                    else gt_value = CLASS_MIXED;
-                    output_classification[bt * num_pixels + it->second] = gt_value;
-                }
-                else
-                {
-                    output_classification[bt * num_pixels + it->second] = CLASS_IGNORE;   
-                }
+                    cells.push_back(std::pair<KeyType, int>(it->first, it->second));
+            }
+            std::sort(cells.begin(), cells.end());
+
+            const int num_cells = cells.size();
+            std::vector<KeyType> keys(num_cells);
+            std::vector<int> gt_inds(num_cells);
+            for(int i=0; i<num_cells; i++) keys[i] = cells[i].first;
+            gt_keys_octree.get_values(keys.data(), num_cells, use_voxel_grid, gt_inds.data());
+
+            for(int i=0; i<num_cells; i++)
+            {
+                SignalType gt_value;
+                if(gt_inds[i] != -1) gt_value = item_gt_values[gt_inds[i]];
+                else gt_value = CLASS_MIXED;
+                item_output[cells[i].second] = gt_value;
             }
         }
         //regression
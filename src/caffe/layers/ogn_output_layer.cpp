@@ -1,3 +1,5 @@
+#include <boost/thread.hpp>
+
 #include "caffe/layers/ogn_output_layer.hpp"
 #include "caffe/net.hpp"
 
@@ -7,58 +9,100 @@ namespace caffe {
 
 using namespace std;
 
+template <typename Dtype>
+OGNOutputLayer<Dtype>::~OGNOutputLayer()
+{
+    // wait for the queued batches to be written
+    if(_writing)
+    {
+        for(int i=0; i<_write_batches.size(); i++) _write_free.pop("Waiting for octrees to be written");
+        this->StopInternalThread();
+    }
+}
+
 template <typename Dtype>
 void OGNOutputLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+    const OGNOutputParameter& param = this->layer_param_.ogn_output_param();
     _output_num = 0;
-    _done_initial_reshape = false;
+    _writing = false;
+
+    if(param.key_layer_size() != bottom.size())
+        LOG(FATAL) << "Number of key layers does not match the number of input blobs.";
+    if(param.shard() && param.format() != OGNOutputParameter_Format_BINARY)
+        LOG(FATAL) << "OGNOutput: shard files require the BINARY format.";
+    if(param.output_path().empty()) return;
+
+    if(param.shard())
+    {
+        std::string shard_name = param.output_path() + "shard.ots";
+        _shard.open(shard_name.c_str(), std::ios_base::binary);
+        if(!_shard.good()) LOG(FATAL) << "OGNOutput: cannot write " << shard_name;
+    }
+
+    const int queue_size = param.write_queue_size();
+    _writing = queue_size > 0;
+    if(!_writing) return;
+
+    _write_batches.resize(queue_size);
+    for(int i=0; i<queue_size; i++)
+    {
+        _write_batches[i].reset(new OGNOutputBatch());
+        _write_free.push(_write_batches[i].get());
+    }
+    StartInternalThread();
 }
 
 template <typename Dtype>
 void OGNOutputLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+}
 
-    if(!_done_initial_reshape)
-    {
-        _done_initial_reshape = true;
-        return;
-    }
-
-    int batch_size = bottom[0]->shape(0);
-    std::string output_path = this->layer_param_.ogn_output_param().output_path();
+template <typename Dtype>
+void OGNOutputLayer<Dtype>::build_octrees(const vector<Blob<Dtype>*>& bottom, std::vector<Octree>& octrees)
+{
     int key_layer_size = this->layer_param_.ogn_output_param().key_layer_size();
 
-    if(key_layer_size != bottom.size())
-            LOG(FATAL) << "Number of key layers does not match the number of input blobs.";
+    std::vector<boost::shared_ptr<OGNLayer<Dtype> > > key_layers;
+    std::vector<const Dtype*> bottom_data;
+    for(int i=0; i<key_layer_size; i++)
+    {
+        std::string key_layer_name = this->layer_param_.ogn_output_param().key_layer(i);
+        boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
+        key_layers.push_back(boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr));
+        bottom_data.push_back(bottom[i]->cpu_data());
+    }
+    const int batch_size = key_layers[0]->get_batch_size();
 
+    octrees.clear();
+    octrees.resize(batch_size);
+    OGN_PARALLEL_FOR
     for(int bt=0; bt<batch_size; bt++)
     {
-        Octree octr;
+        Octree& octr = octrees[bt];
 
         for(int i=0; i<key_layer_size; i++)
-        {   
-            std::string key_layer_name = this->layer_param_.ogn_output_param().key_layer(i);
-            boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-            boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
-    
-            for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(bt).begin(); it!=l_ptr->get_keys_octree(bt).end(); it++)
+        {
+            boost::shared_ptr<OGNLayer<Dtype> > l_ptr = key_layers[i];
+
+            for(typename KeyOctree::iterator it=l_ptr->get_keys_octree(bt).begin(); it!=l_ptr->get_keys_octree(bt).end(); it++)
             {
                 SignalType value;
                 //ground truth case
                 if(bottom[0]->num_axes() == 2)
                 {
-                    int num_pixels = bottom[i]->shape(1);
-                    int value_index = bt * num_pixels + it->second;
-                    value = (SignalType)bottom[i]->cpu_data()[value_index];
+                    int value_index = l_ptr->get_item_offset(*bottom[i], bt) + it->second;
+                    value = (SignalType)bottom_data[i][value_index];
                 }
                 //prediction case
                 else
                 {
                     int num_pixels = bottom[i]->shape(2);
+                    int item_offset = l_ptr->get_item_offset(*bottom[i], bt);
                     Dtype max_val = 0;
                     for(int cl=0; cl<OGN_NUM_CLASSES; cl++)
                     {
-                        Dtype val = bottom[i]->cpu_data()[bt * OGN_NUM_CLASSES * num_pixels + cl * num_pixels + it->second];
+                        Dtype val = bottom_data[i][item_offset + cl * num_pixels + it->second];
                         if(val > max_val)
                         {
                             max_val = val;
@@ -66,23 +110,68 @@ void OGNOutputLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
                         }
                     }
                 }
+                // no finer cells follow at the maximum output level
+                if(value == CLASS_MIXED && this->_max_output_level >= 0 &&
+                    KeyOctree::compute_level(it->first) >= this->_max_output_level) value = CLASS_FILLED;
                 if(value != CLASS_MIXED) octr.add_element(it->first, value);
             }
         }
+    }
+}
+
+template <typename Dtype>
+void OGNOutputLayer<Dtype>::write_batch(OGNOutputBatch* batch)
+{
+    const OGNOutputParameter& param = this->layer_param_.ogn_output_param();
+    for(int bt=0; bt<batch->octrees_.size(); bt++)
+    {
+        if(param.shard())
+        {
+            batch->octrees_[bt].to_shard(_shard);
+            continue;
+        }
 
-        if(output_path.length() > 0)
+        std::stringstream ss;
+        ss << param.output_path() << std::setfill('0') << std::setw(4) << batch->first_output_num_ + bt << ".ot";
+        std::string output_file_name = ss.str();
+        if(param.format() == OGNOutputParameter_Format_BINARY) batch->octrees_[bt].to_binary_file(output_file_name);
+        else batch->octrees_[bt].to_file(output_file_name);
+    }
+    if(param.shard()) _shard.flush();
+    batch->octrees_.clear();
+}
+
+template <typename Dtype>
+void OGNOutputLayer<Dtype>::InternalThreadEntry() {
+    try
+    {
+        while(!must_stop())
         {
-            std::stringstream ss;
-            ss << output_path << std::setfill('0') << std::setw(4) << _output_num++ << ".ot";
-            std::string output_file_name = ss.str();
-            octr.to_file(output_file_name);
+            OGNOutputBatch* batch = _write_full.pop();
+            write_batch(batch);
+            _write_free.push(batch);
         }
     }
+    catch (boost::thread_interrupted&)
+    {
+        // Interrupted exception is expected on shutdown
+    }
 }
 
 template <typename Dtype>
 void OGNOutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+
+    if(this->layer_param_.ogn_output_param().output_path().empty()) return;
+
+    OGNOutputBatch sync_batch;
+    OGNOutputBatch* batch = _writing ? _write_free.pop("Waiting for the octree writer") : &sync_batch;
+    build_octrees(bottom, batch->octrees_);
+    batch->first_output_num_ = _output_num;
+    _output_num += batch->octrees_.size();
+
+    if(_writing) _write_full.push(batch);
+    else write_batch(batch);
 }
 
 template <typename Dtype>
@@ -0,0 +1,167 @@
+#include <algorithm>
+
+#include "caffe/layers/ogn_pool_layer.hpp"
+#include "caffe/net.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+namespace caffe {
+
+using namespace std;
+
+template <typename Dtype>
+void OGNPoolLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    this->_packed = this->layer_param_.ogn_pool_param().packed();
+}
+
+template <typename Dtype>
+void OGNPoolLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const OGNPoolParameter& param = this->layer_param_.ogn_pool_param();
+    int num = bottom[0]->shape(0);
+    int num_pixels = 1;
+
+    // the key layer is only available after net initialization
+    if(this->parent_net()->has_layer(param.key_layer()))
+    {
+        if(!_key_layer)
+        {
+            _key_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(this->parent_net()->layer_by_name(param.key_layer()));
+            if(!_key_layer) LOG(FATAL) << "OGNPool: " << param.key_layer() << " is not an OGN layer";
+        }
+        if(!_key_layer->matches_layout(*bottom[0]))
+        {
+            LOG(FATAL) << "OGNPool: bottom blob is not in the layout (packed or padded) of the key layer " << param.key_layer();
+        }
+        this->pool_keys(*_key_layer, &_parent_indices);
+        num = this->_packed ? 1 : this->get_batch_size();
+        num_pixels = this->_packed ? this->get_num_cells() : this->get_max_cells();
+    }
+
+    vector<int> features_shape;
+    features_shape.push_back(num);
+    features_shape.push_back(bottom[0]->shape(1));
+    features_shape.push_back(std::max(num_pixels, 1));
+    top[0]->Reshape(features_shape);
+    if(param.pool() == OGNPoolParameter_PoolMethod_MAX) _max_indices.Reshape(features_shape);
+}
+
+template <typename Dtype>
+void OGNPoolLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    this->update_stats();
+
+    const bool max_pool = this->layer_param_.ogn_pool_param().pool() == OGNPoolParameter_PoolMethod_MAX;
+    const int channels = bottom[0]->shape(1);
+    const int input_cols = bottom[0]->count(2);
+    const int output_cols = top[0]->count(2);
+    const Dtype* input = bottom[0]->cpu_data();
+    Dtype* output = top[0]->mutable_cpu_data();
+    int* max_indices = max_pool ? _max_indices.mutable_cpu_data() : NULL;
+
+    caffe_set(top[0]->count(), Dtype(0), output);
+    if(max_pool) caffe_set(_max_indices.count(), -1, max_indices);
+
+    const int num = this->get_batch_size();
+    _num_children.resize(num);
+
+    OGN_PARALLEL_FOR
+    for(int bt=0; bt<num; bt++)
+    {
+        const Dtype* item_input = input + _key_layer->get_item_offset(*bottom[0], bt);
+        const int item_offset = this->get_item_offset(*top[0], bt);
+        Dtype* item_output = output + item_offset;
+        const std::vector<int>& parents = _parent_indices[bt];
+        const int num_cells = parents.size();
+
+        if(max_pool)
+        {
+            int* item_max = max_indices + item_offset;
+            for(int ch=0; ch<channels; ch++)
+            {
+                for(int i=0; i<num_cells; i++)
+                {
+                    const int out_ind = ch * output_cols + parents[i];
+                    const Dtype val = item_input[ch * input_cols + i];
+                    if(item_max[out_ind] < 0 || val > item_output[out_ind])
+                    {
+                        item_output[out_ind] = val;
+                        item_max[out_ind] = i;
+                    }
+                }
+            }
+        }
+        else
+        {
+            std::vector<int>& num_children = _num_children[bt];
+            num_children.assign(this->get_keys_octree(bt).num_elements(), 0);
+            for(int i=0; i<num_cells; i++) num_children[parents[i]]++;
+            for(int ch=0; ch<channels; ch++)
+            {
+                for(int i=0; i<num_cells; i++)
+                {
+                    item_output[ch * output_cols + parents[i]] += item_input[ch * input_cols + i] / num_children[parents[i]];
+                }
+            }
+        }
+    }
+}
+
+template <typename Dtype>
+void OGNPoolLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if(!propagate_down[0]) return;
+
+    const bool max_pool = this->layer_param_.ogn_pool_param().pool() == OGNPoolParameter_PoolMethod_MAX;
+    const int channels = bottom[0]->shape(1);
+    const int input_cols = bottom[0]->count(2);
+    const int output_cols = top[0]->count(2);
+    const Dtype* top_diff = top[0]->cpu_diff();
+    Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+    const int* max_indices = max_pool ? _max_indices.cpu_data() : NULL;
+
+    caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+
+    const int num = this->get_batch_size();
+
+    OGN_PARALLEL_FOR
+    for(int bt=0; bt<num; bt++)
+    {
+        Dtype* item_bottom_diff = bottom_diff + _key_layer->get_item_offset(*bottom[0], bt);
+        const int item_offset = this->get_item_offset(*top[0], bt);
+        const Dtype* item_top_diff = top_diff + item_offset;
+        const std::vector<int>& parents = _parent_indices[bt];
+        const int num_cells = parents.size();
+
+        if(max_pool)
+        {
+            const int* item_max = max_indices + item_offset;
+            const int num_parents = this->get_keys_octree(bt).num_elements();
+            for(int ch=0; ch<channels; ch++)
+            {
+                for(int p=0; p<num_parents; p++)
+                {
+                    const int i = item_max[ch * output_cols + p];
+                    if(i >= 0) item_bottom_diff[ch * input_cols + i] += item_top_diff[ch * output_cols + p];
+                }
+            }
+        }
+        else
+        {
+            const std::vector<int>& num_children = _num_children[bt];
+            for(int ch=0; ch<channels; ch++)
+            {
+                for(int i=0; i<num_cells; i++)
+                {
+                    item_bottom_diff[ch * input_cols + i] = item_top_diff[ch * output_cols + parents[i]] / num_children[parents[i]];
+                }
+            }
+        }
+    }
+}
+
+INSTANTIATE_CLASS(OGNPoolLayer);
+REGISTER_LAYER_CLASS(OGNPool);
+
+}  // namespace caffe
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "caffe/net.hpp"
 #include "caffe/layers/ogn_prop_layer.hpp"
 #include "caffe/layers/ogn_conv_layer.hpp"
@@ -14,13 +16,14 @@ void OGNPropLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 
 	_done_initial_reshape = false;
 	_done_building_graph = false;
+	this->_packed = this->layer_param_.ogn_prop_param().packed();
 }
 
 template <typename Dtype>
 void OGNPropLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
-	const int num = bottom[0]->shape(0);
+	int num = bottom[0]->shape(0);
     const int channels = bottom[0]->shape(1);
 
 	if(!_done_initial_reshape)
@@ -58,53 +61,124 @@ void OGNPropLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 			}
 	
 			_nbh_prop_size = graph.compute_neighborhood_size();
+			_fused = can_fuse_deconv(top[0]);
 			_done_building_graph = true;
 		}
 		compute_pixel_propagation(bottom, top);
+		num = this->get_batch_size();
+		if(this->_packed)
+		{
+			num = 1;
+			_num_output_pixels = this->get_num_cells();
+		}
 	}
 
 	if(!_num_output_pixels) _num_output_pixels = 1;
 
+	// a fused output keeps its batch and channel dimensions for the deconvolution, but no features
 	vector<int> shape_features;
-    shape_features.push_back(num); shape_features.push_back(channels); shape_features.push_back(_num_output_pixels);
+    shape_features.push_back(num); shape_features.push_back(channels); shape_features.push_back(_fused ? 1 : _num_output_pixels);
     top[0]->Reshape(shape_features);
 }
 
+/// The output can be fused into the following layer at CPU inference if that
+/// layer is its only consumer, a deconvolution keyed by this layer, and has no
+/// gradients to compute in the net, e.g. with force_backward.
+template <typename Dtype>
+bool OGNPropLayer<Dtype>::can_fuse_deconv(const Blob<Dtype>* top_blob)
+{
+	if(!this->layer_param_.ogn_prop_param().fuse_deconv()) return false;
+	if(this->phase_ != TEST || Caffe::mode() != Caffe::CPU) return false;
+
+	const Net<Dtype>& net = *this->parent_net();
+	int consumer = -1;
+	for(int i=0; i<net.layers().size(); i++)
+	{
+		const vector<Blob<Dtype>*>& layer_bottom = net.bottom_vecs()[i];
+		if(std::find(layer_bottom.begin(), layer_bottom.end(), top_blob) == layer_bottom.end()) continue;
+		if(consumer >= 0) return false;
+		consumer = i;
+	}
+	if(consumer < 0 || std::string(net.layers()[consumer]->type()) != "OGNConv") return false;
+	if(net.layer_need_backward()[consumer]) return false;
+
+	const OGNConvParameter& conv_param = net.layers()[consumer]->layer_param().ogn_conv_param();
+	return conv_param.is_deconv() && conv_param.key_layer() == this->layer_param_.name() &&
+		conv_param.engine() != OGNConvParameter_Engine_DIRECT;
+}
+
 template <typename Dtype>
 void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top)
 {
-	this->_octree_keys.clear();
-	this->_octree_prop.clear();
+	const Dtype* input_values = bottom[1]->cpu_data();
+    const int values_pixels = bottom[1]->count(2);
+    OGNStatsTimer timer(this->stats_timer(&OGNStats::keys_ms));
+
+	std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
+	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
+	_key_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+	_source_features = bottom[0];
+	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = _key_layer;
+	const int num = l_ptr->get_batch_size();
+	if(!l_ptr->matches_layout(*bottom[0]) || !l_ptr->matches_layout(*bottom[1]))
+	{
+		LOG(FATAL) << "OGNProp: bottom blobs are not in the layout (packed or padded) of the key layer " << key_layer_name;
+	}
 
-	_num_output_pixels = 0;
-    const Dtype* input_values = bottom[1]->cpu_data();
-    const int num = bottom[0]->shape(0);
-    const int pixels = bottom[0]->shape(2);
+	OGNOctrees& octrees = this->mutable_octrees();
+	octrees.keys.clear();
+	octrees.prop.clear();
+	octrees.keys.resize(num);
+	octrees.prop.resize(num);
+	_source_indices.resize(num);
+	std::vector<int> num_pixels(num, 0);
 
+	const OGNPropParameter_PropagationMode prop_mode = this->layer_param().ogn_prop_param().prop_mode();
+	set_cells_origin(l_ptr->get_octrees(), octrees);
+
+    OGN_PARALLEL_FOR
     for(int bt=0; bt<num; bt++)
     {
     	int counter_top = 0;
-    	GeneralOctree<int> octree_keys;
-    	GeneralOctree<int> octree_prop;
-
-    	std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
-    	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    	const Dtype* item_values = input_values + l_ptr->get_item_offset(*bottom[1], bt);
+    	KeyOctree& octree_keys = octrees.keys[bt];
+    	KeyOctree& octree_prop = octrees.prop[bt];
+    	KeyOctree& source_keys = l_ptr->get_keys_octree(bt);
+    	std::vector<int>& source_indices = _source_indices[bt];
+    	source_indices.clear();
+    	std::vector<KeyType> neighbors(_nbh_prop_size * _nbh_prop_size * _nbh_prop_size);
+
+    	// the refinement stops at the maximum output level, leaving the following layers without cells
+    	if(this->_max_output_level >= 0 && source_keys.num_elements() &&
+    		KeyOctree::compute_level(source_keys.begin()->first) >= this->_max_output_level) continue;
+
+    	OGNStructureCache* cache = octrees.cache_for(bt);
+    	if(cache)
+    	{
+    		boost::shared_ptr<const OGNCachedStructure> cached = cache->find(octrees.model_ids[bt], this);
+    		if(cached)
+    		{
+    			octree_keys = cached->keys;
+    			octree_prop = cached->prop;
+    			source_indices = cached->indices;
+    			num_pixels[bt] = source_indices.size();
+    			continue;
+    		}
+    	}
 
-    	for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(bt).begin(); it!=l_ptr->get_keys_octree(bt).end(); it++)
+    	for(typename KeyOctree::iterator it=l_ptr->get_keys_octree(bt).begin(); it!=l_ptr->get_keys_octree(bt).end(); it++)
     	{
     		if(l_ptr->get_prop_octree(bt).get_value(it->first) != PROP_TRUE) continue;
 
     		SignalType v;
-    		OGNPropParameter_PropagationMode prop_mode = this->layer_param().ogn_prop_param().prop_mode();
 
 			if(prop_mode == OGNPropParameter_PropagationMode_PROP_PRED)
 			{
 				Dtype max_val = 0;
 				for(int cl=0; cl<OGN_NUM_CLASSES; cl++)
 				{
-					Dtype val = input_values[bt * OGN_NUM_CLASSES * pixels + cl * pixels + it->second];
+					Dtype val = item_values[cl * values_pixels + it->second];
 					if(val > max_val)
 					{
 						max_val = val;
@@ -114,23 +188,24 @@ void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>&
 			}
 			else if(prop_mode == OGNPropParameter_PropagationMode_PROP_KNOWN)
 			{
-				v = input_values[bt * pixels + it->second];
+				v = item_values[it->second];
 			}
 
 			if(v == CLASS_MIXED)
 			{
 				if(_nbh_prop_size > 1)
 				{
-					std::vector<KeyType> neighbors = l_ptr->get_keys_octree(bt).get_neighbor_keys(it->first, _nbh_prop_size);
+					l_ptr->get_keys_octree(bt).get_neighbor_keys(it->first, _nbh_prop_size, neighbors.data());
 					for(int i=0; i<neighbors.size(); i++)
                     {
-                    	if(neighbors[i] != GeneralOctree<int>::INVALID_KEY())
+                    	if(neighbors[i] != KeyOctree::INVALID_KEY())
                         {
                             KeyType nbh_key = neighbors[i];
                             if(octree_keys.get_value(nbh_key) == -1)
 							{
 								octree_keys.add_element(nbh_key, counter_top);
 								octree_prop.add_element(nbh_key, PROP_FALSE);
+								source_indices.push_back(source_keys.get_value(nbh_key));
 								counter_top++;
 							}
                         }
@@ -141,6 +216,7 @@ void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>&
 				{
 					octree_keys.add_element(it->first, counter_top);
 					octree_prop.add_element(it->first, PROP_TRUE);
+					source_indices.push_back(it->second);
 					counter_top++;
 				}
 				else
@@ -150,37 +226,73 @@ void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>&
 			}
     	}
 
-    	if(counter_top > _num_output_pixels) _num_output_pixels = counter_top;
-    	this->_octree_keys.push_back(octree_keys);
-    	this->_octree_prop.push_back(octree_prop);
+    	num_pixels[bt] = counter_top;
+    	if(cache)
+    	{
+    		boost::shared_ptr<OGNCachedStructure> structure(new OGNCachedStructure());
+    		structure->keys = octree_keys;
+    		structure->prop = octree_prop;
+    		structure->indices = source_indices;
+    		cache->insert(octrees.model_ids[bt], this, structure);
+    	}
+    }
+    this->update_batch_offsets();
+    this->update_stats();
+
+    _num_output_pixels = 0;
+    for(int bt=0; bt<num; bt++)
+    {
+    	if(num_pixels[bt] > _num_output_pixels) _num_output_pixels = num_pixels[bt];
     }
 }
 
+/// The propagated cells only depend on the training models if they follow the
+/// ground truth from cells that did not depend on predictions either; their
+/// structures are then cached by the models of gt_key_layer.
+template <typename Dtype>
+void OGNPropLayer<Dtype>::set_cells_origin(const OGNOctrees& source, OGNOctrees& octrees)
+{
+	const OGNPropParameter& param = this->layer_param_.ogn_prop_param();
+	octrees.predicted = source.predicted || param.prop_mode() == OGNPropParameter_PropagationMode_PROP_PRED;
+	octrees.model_ids.clear();
+	octrees.structure_cache.reset();
+	if(octrees.predicted || param.gt_key_layer().empty() || this->_max_output_level >= 0) return;
+
+	boost::shared_ptr<OGNLayer<Dtype> > gt_layer = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(
+		this->parent_net()->layer_by_name(param.gt_key_layer()));
+	if(!gt_layer) LOG(FATAL) << "OGNProp: " << param.gt_key_layer() << " is not an OGN layer";
+	octrees.model_ids = gt_layer->get_octrees().model_ids;
+	octrees.structure_cache = gt_layer->get_octrees().structure_cache;
+}
+
 template <typename Dtype>
 void OGNPropLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
+	// the following deconvolution gathers the features itself
+	if(_fused) return;
+
 	const Dtype* input_features = bottom[0]->cpu_data();
 	Dtype* output_features = top[0]->mutable_cpu_data();
 
-	const int num = bottom[0]->shape(0);
     const int channels = bottom[0]->shape(1);
     const int input_pixels = bottom[0]->shape(2);
 
-    memset(output_features, 0, sizeof(Dtype)*num*channels*_num_output_pixels);
+    memset(output_features, 0, sizeof(Dtype)*top[0]->count());
 
-    std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    const int num = this->get_batch_size();
 
+    OGN_PARALLEL_FOR
     for(int bt=0; bt<num; bt++)
     {
-        for(typename GeneralOctree<int>::iterator it=this->_octree_keys[bt].begin(); it!=this->_octree_keys[bt].end(); it++)
+        Dtype* item_output = output_features + this->get_item_offset(*top[0], bt);
+        const Dtype* item_input = input_features + _key_layer->get_item_offset(*bottom[0], bt);
+        const std::vector<int>& source_indices = _source_indices[bt];
+        for(int ch=0; ch<channels; ch++)
         {
-            for(int ch=0; ch<channels; ch++)
+            for(int i=0; i<source_indices.size(); i++)
             {
-                output_features[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second] =
-                    input_features[bt * channels * input_pixels + ch * input_pixels + l_ptr->get_keys_octree(bt).get_value(it->first)];
+                item_output[ch * _num_output_pixels + i] = item_input[ch * input_pixels + source_indices[i]];
             }
         }
     }
@@ -191,27 +303,35 @@ template <typename Dtype>
 void OGNPropLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
-	const int num = bottom[0]->shape(0);
+	// the fused deconvolution has no gradient to propagate
+	if(_fused)
+	{
+		if(propagate_down[0]) LOG(FATAL) << "OGNProp: " << this->layer_param_.name() << " is fused for inference and has no gradients; "
+			"set fuse_deconv: false";
+		return;
+	}
+
     const int channels = bottom[0]->shape(1);
     const int pixels = bottom[0]->shape(2);
 
     const Dtype* top_diff = top[0]->cpu_diff();
     Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
 
-    memset(bottom_diff, 0, sizeof(Dtype)*num*channels*pixels);
+    memset(bottom_diff, 0, sizeof(Dtype)*bottom[0]->count());
 
-    std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    const int num = this->get_batch_size();
 
+    OGN_PARALLEL_FOR
     for(int bt=0; bt<num; bt++)
     {
-        for(typename GeneralOctree<int>::iterator it=this->_octree_keys[bt].begin(); it!=this->_octree_keys[bt].end(); it++)
+        Dtype* item_bottom_diff = bottom_diff + _key_layer->get_item_offset(*bottom[0], bt);
+        const Dtype* item_top_diff = top_diff + this->get_item_offset(*top[0], bt);
+        const std::vector<int>& source_indices = _source_indices[bt];
+        for(int ch=0; ch<channels; ch++)
         {
-            for(int ch=0; ch<channels; ch++)
+            for(int i=0; i<source_indices.size(); i++)
             {
-                bottom_diff[bt * channels * pixels + ch * pixels + l_ptr->get_keys_octree(bt).get_value(it->first)] +=
-                    top_diff[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second];
+                item_bottom_diff[ch * pixels + source_indices[i]] += item_top_diff[ch * _num_output_pixels + i];
             }
         }
     }
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/util/int8_gemm.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class Int8GemmTest : public ::testing::Test {
+ protected:
+  // sizes that are no multiples of the panels and vectors of the kernels
+  Int8GemmTest() : rows_(13), depth_(37), cols_(101) {}
+
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    weights_.Reshape(rows_, depth_, 1, 1);
+    input_.Reshape(depth_, cols_, 1, 1);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(&weights_);
+    filler.Fill(&input_);
+    output_.resize(rows_ * cols_);
+  }
+
+  void Gemm(Int8GemmImpl impl, Dtype input_scale, Dtype* output) {
+    Int8Gemm<Dtype> gemm(impl);
+    gemm.set_weights(weights_, rows_, depth_, false, 1);
+    gemm.gemm(input_.cpu_data(), cols_, input_scale, output);
+  }
+
+  const int rows_;
+  const int depth_;
+  const int cols_;
+  Blob<Dtype> weights_;
+  Blob<Dtype> input_;
+  std::vector<Dtype> output_;
+};
+
+TYPED_TEST_CASE(Int8GemmTest, TestDtypes);
+
+TYPED_TEST(Int8GemmTest, TestMatchesFloatGemm) {
+  const int rows = this->rows_, depth = this->depth_, cols = this->cols_;
+  const TypeParam* w = this->weights_.cpu_data();
+  const TypeParam* x = this->input_.cpu_data();
+  std::vector<TypeParam> expected(rows * cols);
+  caffe_cpu_gemm<TypeParam>(CblasNoTrans, CblasNoTrans, rows, cols, depth, 1.,
+      w, x, 0., &expected[0]);
+  this->Gemm(int8_gemm_impl(), 0, &this->output_[0]);
+
+  // every product is off by at most half a quantization step of each factor
+  TypeParam max_input = 0;
+  for (int i = 0; i < depth * cols; ++i) {
+    max_input = std::max(max_input, std::abs(x[i]));
+  }
+  const TypeParam input_scale = max_input / 127;
+  for (int r = 0; r < rows; ++r) {
+    TypeParam max_abs = 0;
+    for (int k = 0; k < depth; ++k) {
+      max_abs = std::max(max_abs, std::abs(w[r * depth + k]));
+    }
+    const TypeParam weight_scale = max_abs / 127;
+    for (int c = 0; c < cols; ++c) {
+      TypeParam bound = 1e-4;
+      for (int k = 0; k < depth; ++k) {
+        bound += std::abs(w[r * depth + k]) * input_scale / 2 +
+            std::abs(x[k * cols + c]) * weight_scale / 2 +
+            weight_scale * input_scale / 4;
+      }
+      EXPECT_NEAR(this->output_[r * cols + c], expected[r * cols + c], bound);
+    }
+  }
+}
+
+TYPED_TEST(Int8GemmTest, TestImplsAgree) {
+  const int count = this->rows_ * this->cols_;
+  std::vector<TypeParam> expected(count);
+  // 0.01 saturates most of the input
+  const TypeParam input_scales[] = {0, TypeParam(0.01)};
+  for (int s = 0; s < 2; ++s) {
+    this->Gemm(INT8_GEMM_SCALAR, input_scales[s], &expected[0]);
+    const Int8GemmImpl impls[] = {INT8_GEMM_AVX2, INT8_GEMM_AVX512_VNNI};
+    for (int i = 0; i < 2; ++i) {
+      if (!int8_gemm_impl_supported(impls[i])) {
+        continue;
+      }
+      this->Gemm(impls[i], input_scales[s], &this->output_[0]);
+      for (int j = 0; j < count; ++j) {
+        EXPECT_EQ(this->output_[j], expected[j]) << "impl " << impls[i];
+      }
+    }
+  }
+}
+
+TYPED_TEST(Int8GemmTest, TestImplsAgreeOnBlocks) {
+  // enough columns for several blocks of packed input
+  const int cols = 60013;
+  this->input_.Reshape(this->depth_, cols, 1, 1);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(&this->input_);
+  std::vector<TypeParam> expected(this->rows_ * cols);
+  std::vector<TypeParam> output(this->rows_ * cols);
+  Int8Gemm<TypeParam> scalar(INT8_GEMM_SCALAR);
+  scalar.set_weights(this->weights_, this->rows_, this->depth_, false, 1);
+  scalar.gemm(this->input_.cpu_data(), cols, 0, &expected[0]);
+  Int8Gemm<TypeParam> gemm;
+  gemm.set_weights(this->weights_, this->rows_, this->depth_, false, 1);
+  gemm.gemm(this->input_.cpu_data(), cols, 0, &output[0]);
+  for (int i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(output[i], expected[i]);
+  }
+}
+
+TYPED_TEST(Int8GemmTest, TestTransposed) {
+  const int rows = this->rows_, depth = this->depth_;
+  Blob<TypeParam> transposed(depth, rows, 1, 1);
+  for (int r = 0; r < rows; ++r) {
+    for (int k = 0; k < depth; ++k) {
+      transposed.mutable_cpu_data()[k * rows + r] =
+          this->weights_.cpu_data()[r * depth + k];
+    }
+  }
+  std::vector<TypeParam> expected(rows * this->cols_);
+  this->Gemm(int8_gemm_impl(), 0, &expected[0]);
+  Int8Gemm<TypeParam> gemm;
+  gemm.set_weights(transposed, rows, depth, true, 1);
+  gemm.gemm(this->input_.cpu_data(), this->cols_, 0, &this->output_[0]);
+  for (int i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(this->output_[i], expected[i]);
+  }
+}
+
+TYPED_TEST(Int8GemmTest, TestRequantizeAfterUpdate) {
+  const int count = this->rows_ * this->cols_;
+  Int8Gemm<TypeParam> gemm;
+  gemm.set_weights(this->weights_, this->rows_, this->depth_, false, 1);
+  gemm.gemm(this->input_.cpu_data(), this->cols_, 0, &this->output_[0]);
+  const std::vector<TypeParam> before(this->output_);
+  // doubling the weights doubles their scales but not their int8 values
+  caffe_scal(this->weights_.count(), TypeParam(2),
+      this->weights_.mutable_cpu_data());
+  gemm.set_weights(this->weights_, this->rows_, this->depth_, false, 1);
+  gemm.gemm(this->input_.cpu_data(), this->cols_, 0, &this->output_[0]);
+  for (int i = 0; i < count; ++i) {
+    EXPECT_FLOAT_EQ(this->output_[i], 2 * before[i]);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,384 @@
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
+#include "image_tree_tools/image_tree_tools.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+typedef ::testing::Types<uint32_t, uint64_t> TestKeyTypes;
+
+template <typename KEY>
+class OctreeTest : public ::testing::Test {
+ protected:
+  typedef OctreeBase<KEY> Base;
+  typedef GeneralOctree<int, KEY> HashOctree;
+  typedef SortedOctree<int, KEY> ArrayOctree;
+
+  OctreeTest() : max_level_(5) {
+    Caffe::set_random_seed(1701);
+  }
+
+  static KEY RandomKey(int level) {
+    OctreeCoord c;
+    c.l = level;
+    c.x = caffe_rng_rand() % (1 << level);
+    c.y = caffe_rng_rand() % (1 << level);
+    c.z = caffe_rng_rand() % (1 << level);
+    return Base::compute_key(c);
+  }
+
+  // num distinct cells of levels up to max_level_, in random order.
+  void RandomCells(int num, vector<KEY>* keys, vector<int>* values) {
+    std::map<KEY, int> cells;
+    while (static_cast<int>(cells.size()) < num) {
+      cells[RandomKey(caffe_rng_rand() % (max_level_ + 1))] =
+          caffe_rng_rand() % 1000;
+    }
+    vector<std::pair<KEY, int> > elements(cells.begin(), cells.end());
+    shuffle(elements.begin(), elements.end());
+    keys->clear();
+    values->clear();
+    for (int i = 0; i < elements.size(); ++i) {
+      keys->push_back(elements[i].first);
+      values->push_back(elements[i].second);
+    }
+  }
+
+  // The cells of any octree backend, sorted by key.
+  template <class OCTREE>
+  static std::map<KEY, int> Cells(OCTREE* octree) {
+    std::map<KEY, int> cells;
+    for (typename OCTREE::iterator it = octree->begin(); it != octree->end();
+        ++it) {
+      cells[it->first] = it->second;
+    }
+    return cells;
+  }
+
+  const int max_level_;
+};
+
+TYPED_TEST_CASE(OctreeTest, TestKeyTypes);
+
+TYPED_TEST(OctreeTest, TestSortedMatchesHash) {
+  typedef TypeParam KEY;
+  vector<KEY> keys;
+  vector<int> values;
+  this->RandomCells(500, &keys, &values);
+  typename TestFixture::HashOctree hash_octree(this->max_level_);
+  typename TestFixture::ArrayOctree sorted_octree(this->max_level_);
+  typename TestFixture::ArrayOctree assigned_octree(this->max_level_);
+  for (int i = 0; i < keys.size(); ++i) {
+    hash_octree.add_element(keys[i], values[i]);
+    sorted_octree.add_element(keys[i], values[i]);
+  }
+  // adding a key again replaces its value
+  for (int i = 0; i < keys.size(); i += 7) {
+    values[i] += 1000;
+    hash_octree.add_element(keys[i], values[i]);
+    sorted_octree.add_element(keys[i], values[i]);
+  }
+  assigned_octree.assign(keys.data(), values.data(), keys.size());
+  const int num_cells = keys.size();
+  EXPECT_EQ(hash_octree.num_elements(), num_cells);
+  EXPECT_EQ(sorted_octree.num_elements(), num_cells);
+  EXPECT_EQ(assigned_octree.num_elements(), num_cells);
+
+  // the sorted backends iterate in ascending key order
+  std::map<KEY, int> cells = TestFixture::Cells(&hash_octree);
+  typename std::map<KEY, int>::iterator cell = cells.begin();
+  typename TestFixture::ArrayOctree::iterator it = sorted_octree.begin();
+  typename TestFixture::ArrayOctree::iterator it2 = assigned_octree.begin();
+  for (; cell != cells.end(); ++cell, ++it, ++it2) {
+    ASSERT_TRUE(it != sorted_octree.end());
+    EXPECT_EQ(it->first, cell->first);
+    EXPECT_EQ(it->second, cell->second);
+    EXPECT_EQ(it2->first, cell->first);
+    EXPECT_EQ(it2->second, cell->second);
+  }
+  EXPECT_TRUE(it == sorted_octree.end());
+  EXPECT_TRUE(it2 == assigned_octree.end());
+
+  // cells and random queries, with and without the ancestor fallback
+  vector<KEY> queries(keys);
+  for (int i = 0; i < 500; ++i) {
+    const int level = caffe_rng_rand() % (this->max_level_ + 1);
+    queries.push_back(this->RandomKey(level));
+  }
+  for (int i = 0; i < queries.size(); ++i) {
+    EXPECT_EQ(sorted_octree.get_value(queries[i]),
+        hash_octree.get_value(queries[i]));
+    EXPECT_EQ(sorted_octree.get_value(queries[i], true),
+        hash_octree.get_value(queries[i], true));
+  }
+  std::sort(queries.begin(), queries.end());
+  queries.erase(std::unique(queries.begin(), queries.end()), queries.end());
+  for (int use_vg_info = 0; use_vg_info < 2; ++use_vg_info) {
+    vector<int> hash_values(queries.size()), sorted_values(queries.size());
+    hash_octree.get_values(queries.data(), queries.size(), use_vg_info,
+        hash_values.data());
+    sorted_octree.get_values(queries.data(), queries.size(), use_vg_info,
+        sorted_values.data());
+    for (int i = 0; i < queries.size(); ++i) {
+      EXPECT_EQ(sorted_values[i], hash_values[i]);
+      EXPECT_EQ(sorted_values[i], hash_octree.get_value(queries[i],
+          use_vg_info));
+    }
+  }
+
+  // neighbors of every cell, one at a time and batched, and their values
+  for (int nbh_size = 2; nbh_size <= 3; ++nbh_size) {
+    const int num_neighbors = nbh_size * nbh_size * nbh_size;
+    vector<KEY> hash_neighbors(keys.size() * num_neighbors);
+    vector<KEY> sorted_neighbors(keys.size() * num_neighbors);
+    hash_octree.get_neighbor_keys(keys.data(), keys.size(), nbh_size,
+        hash_neighbors.data());
+    sorted_octree.get_neighbor_keys(keys.data(), keys.size(), nbh_size,
+        sorted_neighbors.data());
+    vector<int> hash_values(keys.size() * num_neighbors);
+    vector<int> sorted_values(keys.size() * num_neighbors);
+    hash_octree.get_neighbor_values(keys.data(), keys.size(), nbh_size,
+        hash_values.data());
+    sorted_octree.get_neighbor_values(keys.data(), keys.size(), nbh_size,
+        sorted_values.data());
+    for (int i = 0; i < keys.size(); ++i) {
+      vector<KEY> neighbors = sorted_octree.get_neighbor_keys(keys[i],
+          nbh_size);
+      for (int j = 0; j < num_neighbors; ++j) {
+        const KEY neighbor = neighbors[j];
+        EXPECT_EQ(neighbor, hash_neighbors[i * num_neighbors + j]);
+        EXPECT_EQ(neighbor, sorted_neighbors[i * num_neighbors + j]);
+        const int value = neighbor == TestFixture::Base::INVALID_KEY() ? -1 :
+            hash_octree.get_value(neighbor);
+        if (neighbor != TestFixture::Base::INVALID_KEY()) {
+          EXPECT_NE(value, -1);
+        }
+        EXPECT_EQ(hash_values[i * num_neighbors + j], value);
+        EXPECT_EQ(sorted_values[i * num_neighbors + j], value);
+      }
+    }
+  }
+}
+
+TYPED_TEST(OctreeTest, TestMortonRoundTrip) {
+  typedef TypeParam KEY;
+  const MortonBatchImpl impls[] = {MORTON_SCALAR, MORTON_BMI2, MORTON_AVX2};
+  // a multiple of neither 4 nor 8, so that the vector tails are covered
+  const int n = 1003;
+  const uint32_t max_coord =
+      (uint32_t(1) << TestFixture::Base::MAX_LEVEL()) - 1;
+  vector<uint32_t> x(n), y(n), z(n);
+  for (int i = 0; i < n; ++i) {
+    x[i] = caffe_rng_rand() & max_coord;
+    y[i] = caffe_rng_rand() & max_coord;
+    z[i] = caffe_rng_rand() & max_coord;
+  }
+  x[0] = y[0] = z[0] = 0;
+  x[1] = y[1] = z[1] = max_coord;
+  x[2] = max_coord;
+  y[3] = max_coord;
+  z[4] = max_coord;
+  for (int m = 0; m < 3; ++m) {
+    if (!morton_batch_impl_supported(impls[m])) {
+      LOG(INFO) << "Skipping unsupported morton implementation " << impls[m];
+      continue;
+    }
+    vector<KEY> codes(n);
+    vector<uint32_t> x2(n), y2(n), z2(n);
+    morton_3d_batch(x.data(), y.data(), z.data(), codes.data(), n, impls[m]);
+    inverse_morton_3d_batch(codes.data(), x2.data(), y2.data(), z2.data(), n,
+        impls[m]);
+    for (int i = 0; i < n; ++i) {
+      EXPECT_EQ(codes[i], morton_3d(KEY(x[i]), KEY(y[i]), KEY(z[i])));
+      EXPECT_EQ(x2[i], x[i]);
+      EXPECT_EQ(y2[i], y[i]);
+      EXPECT_EQ(z2[i], z[i]);
+    }
+  }
+}
+
+TYPED_TEST(OctreeTest, TestNeighborKeysReference) {
+  typedef TypeParam KEY;
+  typedef typename TestFixture::Base Base;
+  const int levels[] = {1, 2, 3, Base::MAX_LEVEL()};
+  for (int l = 0; l < 4; ++l) {
+    const int level = levels[l];
+    const int res = 1 << level;
+    // coordinates at and next to the boundaries of the grid
+    vector<int> coords;
+    coords.push_back(0);
+    coords.push_back(1);
+    coords.push_back(res / 2);
+    coords.push_back(res - 2);
+    coords.push_back(res - 1);
+    for (int nbh_size = 1; nbh_size <= 5; ++nbh_size) {
+      const int num_neighbors = nbh_size * nbh_size * nbh_size;
+      int min_ind = -nbh_size / 2;
+      if (nbh_size % 2 == 0) { min_ind += 1; }
+      vector<KEY> neighbors(num_neighbors);
+      for (int cx = 0; cx < coords.size(); ++cx) {
+        for (int cy = 0; cy < coords.size(); ++cy) {
+          for (int cz = 0; cz < coords.size(); ++cz) {
+            OctreeCoord c;
+            c.l = level;
+            c.x = coords[cx];
+            c.y = coords[cy];
+            c.z = coords[cz];
+            const KEY key = Base::compute_key(c);
+            Base::compute_neighbor_keys(key, nbh_size, res, neighbors.data());
+            // decode, offset and encode every neighbor
+            int ind = 0;
+            for (int i = min_ind; i <= nbh_size / 2; ++i) {
+              for (int j = min_ind; j <= nbh_size / 2; ++j) {
+                for (int k = min_ind; k <= nbh_size / 2; ++k, ++ind) {
+                  OctreeCoord nc = Base::compute_coord(key);
+                  nc.x += i;
+                  nc.y += j;
+                  nc.z += k;
+                  EXPECT_EQ(neighbors[ind], Base::compute_key(nc));
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(OctreeTest, TestFileRoundTrip) {
+  typedef TypeParam KEY;
+  vector<KEY> keys;
+  vector<int> values;
+  this->RandomCells(300, &keys, &values);
+  typename TestFixture::HashOctree octree(this->max_level_);
+  for (int i = 0; i < keys.size(); ++i) {
+    octree.add_element(keys[i], values[i]);
+  }
+  const std::map<KEY, int> cells = TestFixture::Cells(&octree);
+  for (int binary = 0; binary < 2; ++binary) {
+    string fname;
+    MakeTempFilename(&fname);
+    if (binary) {
+      octree.to_binary_file(fname);
+    } else {
+      octree.to_file(fname);
+    }
+    EXPECT_EQ(TestFixture::Base::is_binary_file(fname), binary == 1);
+    typename TestFixture::HashOctree hash_octree;
+    typename TestFixture::ArrayOctree sorted_octree;
+    MappedOctree<int, KEY> mapped_octree;
+    ASSERT_TRUE(hash_octree.from_file(fname));
+    ASSERT_TRUE(sorted_octree.from_file(fname));
+    ASSERT_TRUE(mapped_octree.from_file(fname));
+    EXPECT_TRUE(TestFixture::Cells(&hash_octree) == cells);
+    EXPECT_TRUE(TestFixture::Cells(&sorted_octree) == cells);
+    // mapped octrees are sorted by key in both formats
+    ASSERT_EQ(mapped_octree.num_elements(), static_cast<int>(cells.size()));
+    typename std::map<KEY, int>::const_iterator cell = cells.begin();
+    for (int i = 0; i < mapped_octree.num_elements(); ++i, ++cell) {
+      EXPECT_EQ(mapped_octree.keys()[i], cell->first);
+      EXPECT_EQ(mapped_octree.values()[i], cell->second);
+    }
+    EXPECT_EQ(mapped_octree.max_level(), this->max_level_);
+
+    // the sorted backend writes the same binary file
+    if (binary) {
+      string fname2;
+      MakeTempFilename(&fname2);
+      sorted_octree.to_binary_file(fname2);
+      typename TestFixture::HashOctree octree2;
+      ASSERT_TRUE(octree2.from_file(fname2));
+      EXPECT_TRUE(TestFixture::Cells(&octree2) == cells);
+    }
+  }
+}
+
+TYPED_TEST(OctreeTest, TestCorruptFile) {
+  typedef TypeParam KEY;
+  typename TestFixture::HashOctree octree(this->max_level_);
+  for (int i = 0; i < 100; ++i) {
+    octree.add_element(this->RandomKey(this->max_level_), i);
+  }
+  string fname;
+  MakeTempFilename(&fname);
+  octree.to_binary_file(fname);
+  // drop the last value
+  boost::filesystem::resize_file(fname,
+      boost::filesystem::file_size(fname) - sizeof(int));
+  typename TestFixture::HashOctree hash_octree;
+  typename TestFixture::ArrayOctree sorted_octree;
+  MappedOctree<int, KEY> mapped_octree;
+  EXPECT_FALSE(hash_octree.from_file(fname));
+  EXPECT_FALSE(sorted_octree.from_file(fname));
+  EXPECT_FALSE(mapped_octree.from_file(fname));
+  EXPECT_EQ(hash_octree.num_elements(), 0);
+  EXPECT_FALSE(hash_octree.from_file(fname + ".missing"));
+}
+
+// Binary files with the other key width are converted on reading.
+template <typename FILE_KEY, typename KEY>
+void TestKeyWidthConversion(int max_level) {
+  GeneralOctree<int, FILE_KEY> octree(max_level);
+  vector<FILE_KEY> file_keys;
+  for (int level = 0; level <= max_level; ++level) {
+    OctreeCoord c;
+    c.l = level;
+    c.x = c.y = 0;
+    c.z = (1 << level) - 1;
+    file_keys.push_back(OctreeBase<FILE_KEY>::compute_key(c));
+    octree.add_element(file_keys.back(), level);
+  }
+  string fname;
+  MakeTempFilename(&fname);
+  octree.to_binary_file(fname);
+  GeneralOctree<int, KEY> hash_octree;
+  SortedOctree<int, KEY> sorted_octree;
+  MappedOctree<int, KEY> mapped_octree;
+  ASSERT_TRUE(hash_octree.from_file(fname));
+  ASSERT_TRUE(sorted_octree.from_file(fname));
+  ASSERT_TRUE(mapped_octree.from_file(fname));
+  ASSERT_EQ(mapped_octree.num_elements(), static_cast<int>(file_keys.size()));
+  for (int i = 0; i < file_keys.size(); ++i) {
+    // keys of a level both widths support have the same value
+    EXPECT_EQ(hash_octree.get_value(KEY(file_keys[i])), i);
+    EXPECT_EQ(sorted_octree.get_value(KEY(file_keys[i])), i);
+    EXPECT_EQ(mapped_octree.keys()[i], KEY(file_keys[i]));
+  }
+}
+
+TEST(OctreeFileTest, TestKeyWidthConversion) {
+  TestKeyWidthConversion<uint32_t, uint64_t>(OctreeBase<uint32_t>::MAX_LEVEL());
+  TestKeyWidthConversion<uint64_t, uint32_t>(OctreeBase<uint32_t>::MAX_LEVEL());
+}
+
+TEST(OctreeFileTest, TestTooManyLevels) {
+  // 64-bit files with levels beyond 32-bit keys cannot be read with them
+  GeneralOctree<int, uint64_t> octree;
+  OctreeCoord c;
+  c.l = OctreeBase<uint32_t>::MAX_LEVEL() + 1;
+  c.x = c.y = c.z = 1;
+  octree.add_element(OctreeBase<uint64_t>::compute_key(c), 1);
+  string fname;
+  MakeTempFilename(&fname);
+  octree.to_binary_file(fname);
+  GeneralOctree<int, uint32_t> hash_octree;
+  MappedOctree<int, uint32_t> mapped_octree;
+  EXPECT_FALSE(hash_octree.from_file(fname));
+  EXPECT_FALSE(mapped_octree.from_file(fname));
+}
+
+}  // namespace caffe
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class OGNConvLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  // A batch of two octrees with different cells: OGNProp keeps the cells of
+  // a dense 4x4x4 grid that random probabilities predict as mixed, and their
+  // neighbors, "deconv" refines them to octree level 3, followed by a
+  // convolution "conv" and a strided convolution "conv_s2" back to level 2.
+  // conv_param is added to the parameters of these three layers, packed to
+  // them and OGNProp.
+  void InitNet(const string& conv_param, bool packed, bool force_backward) {
+    const string layout = packed ? " packed: true " : "";
+    const string fillers =
+        " weight_filler { type: 'gaussian' std: 0.1 } "
+        " bias_filler { type: 'gaussian' std: 0.1 } ";
+    const string proto =
+        "name: 'OGNConvTestNetwork' " +
+        string(force_backward ? "force_backward: true " : "") +
+        "layer { name: 'input' type: 'DummyData' top: 'dense' top: 'solid' "
+        "  top: 'mixed' dummy_data_param { "
+        "    shape { dim: 2 dim: 2 dim: 4 dim: 4 dim: 4 } "
+        "    shape { dim: 2 dim: 2 dim: 64 } shape { dim: 2 dim: 1 dim: 64 } "
+        "    data_filler { type: 'gaussian' } "
+        "    data_filler { type: 'uniform' min: 0 max: 1 } "
+        "    data_filler { type: 'uniform' min: 0 max: 0.3 } } } "
+        "layer { name: 'keys' type: 'OGNGenerateKeys' bottom: 'dense' } "
+        "layer { name: 'flat' type: 'Reshape' bottom: 'dense' top: 'f0' "
+        "  reshape_param { shape { dim: 0 dim: 0 dim: -1 } } } "
+        "layer { name: 'prob' type: 'Concat' bottom: 'solid' bottom: 'mixed' "
+        "  top: 'prob' } "
+        "layer { name: 'prop' type: 'OGNProp' bottom: 'f0' bottom: 'prob' "
+        "  top: 'p0' ogn_prop_param { key_layer: 'keys' prop_mode: PROP_PRED "
+        + layout + "} } "
+        "layer { name: 'deconv' type: 'OGNConv' bottom: 'p0' top: 'f1' "
+        "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: 3 "
+        "    key_layer: 'prop' " + layout + conv_param + fillers + "} } "
+        "layer { name: 'conv' type: 'OGNConv' bottom: 'f1' top: 'f2' "
+        "  ogn_conv_param { filter_size: 3 output_channels: 4 "
+        "    key_layer: 'deconv' " + layout + conv_param + fillers + "} } "
+        "layer { name: 'conv_s2' type: 'OGNConv' bottom: 'f2' top: 'f3' "
+        "  ogn_conv_param { filter_size: 3 output_channels: 2 stride: 2 "
+        "    key_layer: 'conv' " + layout + conv_param + fillers + "} } ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    Caffe::set_random_seed(1701);
+    net_.reset(new Net<Dtype>(param));
+  }
+
+  OGNLayer<Dtype>* GetOGNLayer(const string& name) {
+    return dynamic_cast<OGNLayer<Dtype>*>(net_->layer_by_name(name).get());
+  }
+
+  // The features of blob_name in the cells of the OGN layer layer_name, item
+  // by item and channel by channel, in the same order for both layouts.
+  vector<Dtype> ItemFeatures(const string& layer_name,
+      const string& blob_name) {
+    OGNLayer<Dtype>* layer = GetOGNLayer(layer_name);
+    const Blob<Dtype>& blob = *net_->blob_by_name(blob_name);
+    vector<Dtype> features;
+    for (int n = 0; n < layer->get_batch_size(); ++n) {
+      const int num_cells =
+          layer->get_batch_offset(n + 1) - layer->get_batch_offset(n);
+      const Dtype* item = blob.cpu_data() + layer->get_item_offset(blob, n);
+      for (int c = 0; c < blob.shape(1); ++c) {
+        const Dtype* row = item + c * blob.count(2);
+        features.insert(features.end(), row, row + num_cells);
+      }
+    }
+    return features;
+  }
+
+  void CheckGradient(const string& layer_name) {
+    net_->Forward();
+    int index = 0;
+    while (net_->layer_names()[index] != layer_name) {
+      ++index;
+    }
+    GradientChecker<Dtype> checker(1e-2, 1e-2);
+    // the layers are set up by the net already, as they look up their key
+    // layers in it
+    checker.CheckGradientSingle(net_->layers()[index].get(),
+        net_->bottom_vecs()[index], net_->top_vecs()[index], -1, -1, -1);
+  }
+
+  boost::scoped_ptr<Net<Dtype> > net_;
+};
+
+TYPED_TEST_CASE(OGNConvLayerTest, TestDtypes);
+
+TYPED_TEST(OGNConvLayerTest, TestSetUp) {
+  this->InitNet("", false, false);
+  this->net_->Forward();
+  OGNLayer<TypeParam>* prop = this->GetOGNLayer("prop");
+  OGNLayer<TypeParam>* deconv = this->GetOGNLayer("deconv");
+  OGNLayer<TypeParam>* conv_s2 = this->GetOGNLayer("conv_s2");
+  // the items keep a different part of the grid each
+  const int cells0 = prop->get_batch_offset(1);
+  const int cells1 = prop->get_num_cells() - cells0;
+  EXPECT_GT(cells0, 0);
+  EXPECT_GT(cells1, 0);
+  EXPECT_LT(cells0, 64);
+  EXPECT_NE(cells0, cells1);
+  EXPECT_EQ(deconv->get_batch_size(), 2);
+  EXPECT_EQ(deconv->get_batch_offset(1), 8 * cells0);
+  EXPECT_EQ(deconv->get_num_cells(), 8 * (cells0 + cells1));
+  EXPECT_EQ(this->net_->blob_by_name("f2")->shape(2),
+      8 * std::max(cells0, cells1));
+  // the strided convolution outputs the parents of the refined cells
+  EXPECT_EQ(conv_s2->get_batch_offset(1), cells0);
+  EXPECT_EQ(conv_s2->get_num_cells(), cells0 + cells1);
+}
+
+TYPED_TEST(OGNConvLayerTest, TestEnginesAgree) {
+  typedef TypeParam Dtype;
+  const char* blobs[][2] = {
+      {"deconv", "f1"}, {"conv", "f2"}, {"conv_s2", "f3"}};
+  // the reference runs one IM2COL GEMM per item on padded blobs
+  this->InitNet("", false, false);
+  this->net_->Forward();
+  NetParameter weights;
+  this->net_->ToProto(&weights);
+  vector<vector<Dtype> > expected;
+  for (int b = 0; b < 3; ++b) {
+    expected.push_back(this->ItemFeatures(blobs[b][0], blobs[b][1]));
+  }
+
+  const char* conv_params[] = {
+      " batched_gemm: true ", " engine: DIRECT ", "", " engine: DIRECT "};
+  const bool packed[] = {false, false, true, true};
+  for (int i = 0; i < 4; ++i) {
+    this->InitNet(conv_params[i], packed[i], false);
+    this->net_->CopyTrainedLayersFrom(weights);
+    this->net_->Forward();
+    for (int b = 0; b < 3; ++b) {
+      const vector<Dtype> features =
+          this->ItemFeatures(blobs[b][0], blobs[b][1]);
+      ASSERT_EQ(features.size(), expected[b].size());
+      for (int j = 0; j < features.size(); ++j) {
+        EXPECT_NEAR(features[j], expected[b][j], 1e-4)
+            << blobs[b][1] << " with" << conv_params[i]
+            << (packed[i] ? " packed" : "");
+      }
+    }
+  }
+}
+
+TYPED_TEST(OGNConvLayerTest, TestGradientDeconv) {
+  this->InitNet("", false, true);
+  this->CheckGradient("deconv");
+}
+
+TYPED_TEST(OGNConvLayerTest, TestGradientConv) {
+  this->InitNet("", false, true);
+  this->CheckGradient("conv");
+}
+
+TYPED_TEST(OGNConvLayerTest, TestGradientConvStrided) {
+  this->InitNet("", false, true);
+  this->CheckGradient("conv_s2");
+}
+
+TYPED_TEST(OGNConvLayerTest, TestGradientConvPackedDirect) {
+  this->InitNet(" engine: DIRECT ", true, true);
+  this->CheckGradient("conv");
+}
+
+}  // namespace caffe
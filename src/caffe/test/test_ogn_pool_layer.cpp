@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cfloat>
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class OGNPoolLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  // A batch of two octrees with different cells at octree level 3, as in
+  // test_ogn_conv_layer.cpp, pooled by "pool" into their parents at level 2.
+  void InitNet(const string& pool, bool packed) {
+    const string layout = packed ? " packed: true " : "";
+    const string proto =
+        "name: 'OGNPoolTestNetwork' force_backward: true "
+        "layer { name: 'input' type: 'DummyData' top: 'dense' top: 'solid' "
+        "  top: 'mixed' dummy_data_param { "
+        "    shape { dim: 2 dim: 2 dim: 4 dim: 4 dim: 4 } "
+        "    shape { dim: 2 dim: 2 dim: 64 } shape { dim: 2 dim: 1 dim: 64 } "
+        "    data_filler { type: 'gaussian' } "
+        "    data_filler { type: 'uniform' min: 0 max: 1 } "
+        "    data_filler { type: 'uniform' min: 0 max: 0.3 } } } "
+        "layer { name: 'keys' type: 'OGNGenerateKeys' bottom: 'dense' } "
+        "layer { name: 'flat' type: 'Reshape' bottom: 'dense' top: 'f0' "
+        "  reshape_param { shape { dim: 0 dim: 0 dim: -1 } } } "
+        "layer { name: 'prob' type: 'Concat' bottom: 'solid' bottom: 'mixed' "
+        "  top: 'prob' } "
+        "layer { name: 'prop' type: 'OGNProp' bottom: 'f0' bottom: 'prob' "
+        "  top: 'p0' ogn_prop_param { key_layer: 'keys' prop_mode: PROP_PRED "
+        + layout + "} } "
+        "layer { name: 'deconv' type: 'OGNConv' bottom: 'p0' top: 'f1' "
+        "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: 3 "
+        "    key_layer: 'prop' " + layout +
+        "    weight_filler { type: 'gaussian' std: 0.3 } "
+        "    bias_filler { type: 'gaussian' std: 0.1 } } } "
+        "layer { name: 'pool' type: 'OGNPool' bottom: 'f1' top: 'f2' "
+        "  ogn_pool_param { key_layer: 'deconv' pool: " + pool + layout +
+        "} } ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    Caffe::set_random_seed(1701);
+    net_.reset(new Net<Dtype>(param));
+  }
+
+  OGNLayer<Dtype>* GetOGNLayer(const string& name) {
+    return dynamic_cast<OGNLayer<Dtype>*>(net_->layer_by_name(name).get());
+  }
+
+  // Checks the pooled features against the maximum or average of the
+  // features of the children of every cell.
+  void CheckForward(bool max_pool) {
+    net_->Forward();
+    OGNLayer<Dtype>* deconv = GetOGNLayer("deconv");
+    OGNLayer<Dtype>* pool = GetOGNLayer("pool");
+    const Blob<Dtype>& input = *net_->blob_by_name("f1");
+    const Blob<Dtype>& output = *net_->blob_by_name("f2");
+    const int channels = input.shape(1);
+    ASSERT_EQ(pool->get_batch_size(), 2);
+    for (int n = 0; n < 2; ++n) {
+      KeyOctree& children = deconv->get_keys_octree(n);
+      KeyOctree& parents = pool->get_keys_octree(n);
+      EXPECT_EQ(parents.num_elements() * 8, children.num_elements());
+      const Dtype* input_item = input.cpu_data() +
+          deconv->get_item_offset(input, n);
+      const Dtype* output_item = output.cpu_data() +
+          pool->get_item_offset(output, n);
+      vector<Dtype> expected(channels * parents.num_elements(),
+          max_pool ? -FLT_MAX : 0);
+      for (typename KeyOctree::iterator it = children.begin();
+          it != children.end(); ++it) {
+        const int parent = parents.get_value(it->first >> 3);
+        ASSERT_GE(parent, 0);
+        for (int c = 0; c < channels; ++c) {
+          const Dtype value = input_item[c * input.count(2) + it->second];
+          Dtype& pooled = expected[c * parents.num_elements() + parent];
+          pooled = max_pool ? std::max(pooled, value) : pooled + value / 8;
+        }
+      }
+      for (int c = 0; c < channels; ++c) {
+        for (int i = 0; i < parents.num_elements(); ++i) {
+          EXPECT_NEAR(output_item[c * output.count(2) + i],
+              expected[c * parents.num_elements() + i], 1e-5);
+        }
+      }
+    }
+  }
+
+  void CheckGradient() {
+    net_->Forward();
+    const int index = net_->layers().size() - 1;
+    // small steps, as children closer than a step change the maximum
+    GradientChecker<Dtype> checker(1e-4, 1e-2);
+    // the layer is set up by the net already, as it looks up its key layer
+    // in it
+    checker.CheckGradientSingle(net_->layers()[index].get(),
+        net_->bottom_vecs()[index], net_->top_vecs()[index], -1, -1, -1);
+  }
+
+  boost::scoped_ptr<Net<Dtype> > net_;
+};
+
+TYPED_TEST_CASE(OGNPoolLayerTest, TestDtypes);
+
+TYPED_TEST(OGNPoolLayerTest, TestForwardMax) {
+  this->InitNet("MAX", false);
+  this->CheckForward(true);
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestForwardMaxPacked) {
+  this->InitNet("MAX", true);
+  this->CheckForward(true);
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestForwardAve) {
+  this->InitNet("AVE", false);
+  this->CheckForward(false);
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestForwardAvePacked) {
+  this->InitNet("AVE", true);
+  this->CheckForward(false);
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestGradientMax) {
+  this->InitNet("MAX", false);
+  this->CheckGradient();
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestGradientMaxPacked) {
+  this->InitNet("MAX", true);
+  this->CheckGradient();
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestGradientAve) {
+  this->InitNet("AVE", false);
+  this->CheckGradient();
+}
+
+TYPED_TEST(OGNPoolLayerTest, TestGradientAvePacked) {
+  this->InitNet("AVE", true);
+  this->CheckGradient();
+}
+
+}  // namespace caffe
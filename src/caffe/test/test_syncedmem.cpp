@@ -40,6 +40,21 @@ TEST_F(SyncedMemoryTest, TestAllocationCPU) {
   EXPECT_TRUE(mem.mutable_cpu_data());
 }
 
+TEST_F(SyncedMemoryTest, TestVersion) {
+  SyncedMemory mem(10);
+  const unsigned int version = mem.version();
+  mem.cpu_data();
+  EXPECT_EQ(mem.version(), version);
+  mem.mutable_cpu_data();
+  EXPECT_NE(mem.version(), version);
+  const unsigned int written = mem.version();
+  mem.cpu_data();
+  EXPECT_EQ(mem.version(), written);
+  char data[10];
+  mem.set_cpu_data(data);
+  EXPECT_NE(mem.version(), written);
+}
+
 #ifndef CPU_ONLY  // GPU test
 
 TEST_F(SyncedMemoryTest, TestAllocationGPU) {
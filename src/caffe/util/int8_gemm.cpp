@@ -0,0 +1,511 @@
+// The SIMD kernels are selected at runtime, as the batch morton functions of
+// image_tree_tools/zindex.h.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define INT8_GEMM_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/int8_gemm.hpp"
+#include "caffe/util/ogn_threads.hpp"
+
+namespace caffe {
+
+bool int8_gemm_impl_supported(Int8GemmImpl impl) {
+#ifdef INT8_GEMM_X86_DISPATCH
+  __builtin_cpu_init();
+  if (impl == INT8_GEMM_AVX2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (impl == INT8_GEMM_AVX512_VNNI) {
+    return __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vnni");
+  }
+#endif
+  return impl == INT8_GEMM_SCALAR;
+}
+
+Int8GemmImpl int8_gemm_impl() {
+  static const Int8GemmImpl impl =
+      int8_gemm_impl_supported(INT8_GEMM_AVX512_VNNI) ? INT8_GEMM_AVX512_VNNI :
+      int8_gemm_impl_supported(INT8_GEMM_AVX2) ? INT8_GEMM_AVX2 :
+      INT8_GEMM_SCALAR;
+  return impl;
+}
+
+namespace {
+
+// The packed layout of a kernel: A is stored in panels of rows rows and the
+// input in panels of cols columns, with the values of group consecutive depth
+// indices in one 32-bit word, as int16 for a group of 2 and int8 for 4.
+struct Layout {
+  int group;
+  int rows;
+  int cols;
+};
+
+const int kMaxTileRows = 8;
+const int kMaxTileCols = 48;
+// size of the packed input of a block of columns, about an L2 cache
+const int kBlockBytes = 1 << 20;
+
+Layout layout(Int8GemmImpl impl) {
+  Layout l;
+  if (impl == INT8_GEMM_AVX512_VNNI) {
+    l.group = 4;
+    l.rows = 8;
+    l.cols = 48;
+  } else {
+    l.group = 2;
+    l.rows = 4;
+    l.cols = 24;
+  }
+  return l;
+}
+
+// Rounds to the nearest int8, saturating at +-127; the SIMD versions below
+// compute exactly the same.
+template <typename Dtype>
+inline int quantize(Dtype val) {
+  return static_cast<int>(std::floor(
+      std::max(Dtype(-127), std::min(Dtype(127), val)) + Dtype(0.5)));
+}
+
+// Packs group quantized values into one word; the input of vpdpbusd is
+// unsigned, so it is offset by 128.
+inline int32_t pack_word(const int* q, int group, bool offset) {
+  if (group == 2) {
+    return static_cast<int32_t>((static_cast<uint32_t>(q[0]) & 0xffff) |
+        static_cast<uint32_t>(q[1]) << 16);
+  }
+  uint32_t word = 0;
+  for (int j = 0; j < 4; ++j) {
+    word |= static_cast<uint32_t>((q[j] + (offset ? 128 : 0)) & 0xff) << 8 * j;
+  }
+  return static_cast<int32_t>(word);
+}
+
+// The word of group g and column c in the packed input, which is stored in
+// panels of (groups x l.cols) words.
+inline int packed_index(const Layout& l, int groups, int g, int c) {
+  return (c / l.cols * groups + g) * l.cols + c % l.cols;
+}
+
+// Quantizes and packs group g of the rows of the input, whose rows are ld
+// apart, from column c to the end of the last panel; the columns beyond cols
+// are zero.
+template <typename Dtype>
+void pack_input_scalar(const Layout& l, const Dtype* input, int ld, int depth,
+    int cols, int g, Dtype inv_scale, int c, int32_t* packed) {
+  const int groups = (depth + l.group - 1) / l.group;
+  const int padded_cols = (cols + l.cols - 1) / l.cols * l.cols;
+  for (; c < padded_cols; ++c) {
+    int q[4] = {0, 0, 0, 0};
+    for (int j = 0; j < l.group; ++j) {
+      const int k = g * l.group + j;
+      if (k < depth && c < cols) {
+        q[j] = quantize(input[k * ld + c] * inv_scale);
+      }
+    }
+    packed[packed_index(l, groups, g, c)] = pack_word(q, l.group, true);
+  }
+}
+
+// Computes the l.rows x l.cols tile of a panel of A and a panel of the input.
+void kernel_scalar(const int32_t* a, const int32_t* b, int groups,
+    int32_t* tile) {
+  const Layout l = layout(INT8_GEMM_SCALAR);
+  std::fill(tile, tile + l.rows * l.cols, 0);
+  for (int g = 0; g < groups; ++g, a += l.rows, b += l.cols) {
+    for (int i = 0; i < l.rows; ++i) {
+      const int32_t w0 = static_cast<int16_t>(a[i]);
+      const int32_t w1 = a[i] >> 16;
+      for (int j = 0; j < l.cols; ++j) {
+        tile[i * l.cols + j] +=
+            w0 * static_cast<int16_t>(b[j]) + w1 * (b[j] >> 16);
+      }
+    }
+  }
+}
+
+// Scales the num_rows x num_cols values of the tile into the output.
+template <typename Dtype>
+void store_tile_scalar(const Layout& l, const int32_t* tile, int num_rows,
+    int num_cols, int c, const int32_t* offsets, const Dtype* scales,
+    Dtype* output, int ldc) {
+  for (int i = 0; i < num_rows; ++i) {
+    for (int j = c; j < num_cols; ++j) {
+      output[i * ldc + j] =
+          static_cast<Dtype>(tile[i * l.cols + j] + offsets[i]) * scales[i];
+    }
+  }
+}
+
+#ifdef INT8_GEMM_X86_DISPATCH
+
+// Quantizes 8 values as quantize does.
+__attribute__((target("avx2")))
+inline __m256i quantize_avx2(__m256 val) {
+  val = _mm256_max_ps(_mm256_set1_ps(-127), _mm256_min_ps(_mm256_set1_ps(127),
+      val));
+  return _mm256_cvtps_epi32(_mm256_floor_ps(
+      _mm256_add_ps(val, _mm256_set1_ps(0.5f))));
+}
+
+// The panels are a multiple of 8 or 16 columns wide, so that every vector of
+// the packed input lies in one panel.
+__attribute__((target("avx2")))
+void pack_input_avx2(const Layout& l, const float* input, int ld, int depth,
+    int cols, int g, float inv_scale, int32_t* packed) {
+  const int groups = (depth + 1) / 2;
+  const int k = 2 * g;
+  const __m256 inv = _mm256_set1_ps(inv_scale);
+  const __m256i low = _mm256_set1_epi32(0xffff);
+  const float* in0 = input + k * ld;
+  const float* in1 = input + (k + 1) * ld;
+  int c = 0;
+  for (; c + 8 <= cols; c += 8) {
+    const __m256i q0 = quantize_avx2(_mm256_mul_ps(_mm256_loadu_ps(in0 + c),
+        inv));
+    const __m256i q1 = k + 1 < depth ? quantize_avx2(_mm256_mul_ps(
+        _mm256_loadu_ps(in1 + c), inv)) : _mm256_setzero_si256();
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(packed + packed_index(l, groups, g, c)),
+        _mm256_or_si256(_mm256_and_si256(q0, low), _mm256_slli_epi32(q1, 16)));
+  }
+  pack_input_scalar(l, input, ld, depth, cols, g, inv_scale, c, packed);
+}
+
+__attribute__((target("avx2,avx512f")))
+void pack_input_avx512(const Layout& l, const float* input, int ld,
+    int depth, int cols, int g, float inv_scale, int32_t* packed) {
+  const int groups = (depth + 3) / 4;
+  const __m512 inv = _mm512_set1_ps(inv_scale);
+  const __m512 max = _mm512_set1_ps(127);
+  const __m512 min = _mm512_set1_ps(-127);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512i offset = _mm512_set1_epi32(128);
+  int c = 0;
+  for (; c + 16 <= cols; c += 16) {
+    // the offset values are in [1, 255], so they do not overlap
+    __m512i word = _mm512_setzero_si512();
+    for (int j = 0; j < 4; ++j) {
+      const int k = 4 * g + j;
+      __m512i q = offset;
+      if (k < depth) {
+        __m512 val = _mm512_mul_ps(_mm512_loadu_ps(input + k * ld + c), inv);
+        val = _mm512_max_ps(min, _mm512_min_ps(max, val));
+        val = _mm512_roundscale_ps(_mm512_add_ps(val, half),
+            _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        q = _mm512_add_epi32(_mm512_cvtps_epi32(val), offset);
+      }
+      word = _mm512_or_si512(word, _mm512_sll_epi32(q,
+          _mm_cvtsi32_si128(8 * j)));
+    }
+    _mm512_storeu_si512(packed + packed_index(l, groups, g, c), word);
+  }
+  pack_input_scalar(l, input, ld, depth, cols, g, inv_scale, c, packed);
+}
+
+#define INT8_GEMM_AVX2_ROW(i) \
+  w = _mm256_set1_epi32(a[i]); \
+  c##i##0 = _mm256_add_epi32(c##i##0, _mm256_madd_epi16(b0, w)); \
+  c##i##1 = _mm256_add_epi32(c##i##1, _mm256_madd_epi16(b1, w)); \
+  c##i##2 = _mm256_add_epi32(c##i##2, _mm256_madd_epi16(b2, w));
+
+#define INT8_GEMM_AVX2_STORE(i) \
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + 24 * i), c##i##0); \
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + 24 * i + 8), \
+      c##i##1); \
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + 24 * i + 16), \
+      c##i##2);
+
+// The 4 x 24 tile in 12 registers.
+__attribute__((target("avx2")))
+void kernel_avx2(const int32_t* a, const int32_t* b, int groups,
+    int32_t* tile) {
+  __m256i c00 = _mm256_setzero_si256(), c01 = c00, c02 = c00;
+  __m256i c10 = c00, c11 = c00, c12 = c00;
+  __m256i c20 = c00, c21 = c00, c22 = c00;
+  __m256i c30 = c00, c31 = c00, c32 = c00;
+  for (int g = 0; g < groups; ++g, a += 4, b += 24) {
+    const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+    const __m256i b1 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 8));
+    const __m256i b2 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 16));
+    __m256i w;
+    INT8_GEMM_AVX2_ROW(0)
+    INT8_GEMM_AVX2_ROW(1)
+    INT8_GEMM_AVX2_ROW(2)
+    INT8_GEMM_AVX2_ROW(3)
+  }
+  INT8_GEMM_AVX2_STORE(0)
+  INT8_GEMM_AVX2_STORE(1)
+  INT8_GEMM_AVX2_STORE(2)
+  INT8_GEMM_AVX2_STORE(3)
+}
+
+#define INT8_GEMM_VNNI_ROW(i) \
+  w = _mm512_set1_epi32(a[i]); \
+  c##i##0 = _mm512_dpbusd_epi32(c##i##0, b0, w); \
+  c##i##1 = _mm512_dpbusd_epi32(c##i##1, b1, w); \
+  c##i##2 = _mm512_dpbusd_epi32(c##i##2, b2, w);
+
+#define INT8_GEMM_VNNI_STORE(i) \
+  _mm512_storeu_si512(tile + 48 * i, c##i##0); \
+  _mm512_storeu_si512(tile + 48 * i + 16, c##i##1); \
+  _mm512_storeu_si512(tile + 48 * i + 32, c##i##2);
+
+// The 8 x 48 tile in 24 registers.
+__attribute__((target("avx512f,avx512vnni")))
+void kernel_avx512_vnni(const int32_t* a, const int32_t* b, int groups,
+    int32_t* tile) {
+  __m512i c00 = _mm512_setzero_si512(), c01 = c00, c02 = c00;
+  __m512i c10 = c00, c11 = c00, c12 = c00;
+  __m512i c20 = c00, c21 = c00, c22 = c00;
+  __m512i c30 = c00, c31 = c00, c32 = c00;
+  __m512i c40 = c00, c41 = c00, c42 = c00;
+  __m512i c50 = c00, c51 = c00, c52 = c00;
+  __m512i c60 = c00, c61 = c00, c62 = c00;
+  __m512i c70 = c00, c71 = c00, c72 = c00;
+  for (int g = 0; g < groups; ++g, a += 8, b += 48) {
+    const __m512i b0 = _mm512_loadu_si512(b);
+    const __m512i b1 = _mm512_loadu_si512(b + 16);
+    const __m512i b2 = _mm512_loadu_si512(b + 32);
+    __m512i w;
+    INT8_GEMM_VNNI_ROW(0)
+    INT8_GEMM_VNNI_ROW(1)
+    INT8_GEMM_VNNI_ROW(2)
+    INT8_GEMM_VNNI_ROW(3)
+    INT8_GEMM_VNNI_ROW(4)
+    INT8_GEMM_VNNI_ROW(5)
+    INT8_GEMM_VNNI_ROW(6)
+    INT8_GEMM_VNNI_ROW(7)
+  }
+  INT8_GEMM_VNNI_STORE(0)
+  INT8_GEMM_VNNI_STORE(1)
+  INT8_GEMM_VNNI_STORE(2)
+  INT8_GEMM_VNNI_STORE(3)
+  INT8_GEMM_VNNI_STORE(4)
+  INT8_GEMM_VNNI_STORE(5)
+  INT8_GEMM_VNNI_STORE(6)
+  INT8_GEMM_VNNI_STORE(7)
+}
+
+__attribute__((target("avx2")))
+void store_tile_avx2(const Layout& l, const int32_t* tile, int num_rows,
+    int num_cols, const int32_t* offsets, const float* scales, float* output,
+    int ldc) {
+  const int vector_cols = num_cols / 8 * 8;
+  for (int i = 0; i < num_rows; ++i) {
+    const __m256i offset = _mm256_set1_epi32(offsets[i]);
+    const __m256 scale = _mm256_set1_ps(scales[i]);
+    for (int j = 0; j < vector_cols; j += 8) {
+      const __m256i acc = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(tile + i * l.cols + j));
+      _mm256_storeu_ps(output + i * ldc + j, _mm256_mul_ps(
+          _mm256_cvtepi32_ps(_mm256_add_epi32(acc, offset)), scale));
+    }
+  }
+  store_tile_scalar(l, tile, num_rows, num_cols, vector_cols, offsets, scales,
+      output, ldc);
+}
+
+#endif  // INT8_GEMM_X86_DISPATCH
+
+// The SIMD versions of the input packing and the output scaling, which are
+// only implemented for float.
+template <typename Dtype>
+void pack_input(Int8GemmImpl impl, const Layout& l, const Dtype* input,
+    int ld, int depth, int cols, int g, Dtype inv_scale, int32_t* packed) {
+  pack_input_scalar(l, input, ld, depth, cols, g, inv_scale, 0, packed);
+}
+
+template <typename Dtype>
+void store_tile(Int8GemmImpl impl, const Layout& l, const int32_t* tile,
+    int num_rows, int num_cols, const int32_t* offsets, const Dtype* scales,
+    Dtype* output, int ldc) {
+  store_tile_scalar(l, tile, num_rows, num_cols, 0, offsets, scales, output,
+      ldc);
+}
+
+#ifdef INT8_GEMM_X86_DISPATCH
+template <>
+void pack_input<float>(Int8GemmImpl impl, const Layout& l, const float* input,
+    int ld, int depth, int cols, int g, float inv_scale, int32_t* packed) {
+  if (impl == INT8_GEMM_AVX2) {
+    pack_input_avx2(l, input, ld, depth, cols, g, inv_scale, packed);
+  } else if (impl == INT8_GEMM_AVX512_VNNI) {
+    pack_input_avx512(l, input, ld, depth, cols, g, inv_scale, packed);
+  } else {
+    pack_input_scalar(l, input, ld, depth, cols, g, inv_scale, 0, packed);
+  }
+}
+
+template <>
+void store_tile<float>(Int8GemmImpl impl, const Layout& l,
+    const int32_t* tile, int num_rows, int num_cols, const int32_t* offsets,
+    const float* scales, float* output, int ldc) {
+  if (impl == INT8_GEMM_SCALAR) {
+    store_tile_scalar(l, tile, num_rows, num_cols, 0, offsets, scales, output,
+        ldc);
+  } else {
+    store_tile_avx2(l, tile, num_rows, num_cols, offsets, scales, output, ldc);
+  }
+}
+#endif  // INT8_GEMM_X86_DISPATCH
+
+void kernel(Int8GemmImpl impl, const int32_t* a, const int32_t* b,
+    int groups, int32_t* tile) {
+#ifdef INT8_GEMM_X86_DISPATCH
+  if (impl == INT8_GEMM_AVX2) {
+    kernel_avx2(a, b, groups, tile);
+    return;
+  }
+  if (impl == INT8_GEMM_AVX512_VNNI) {
+    kernel_avx512_vnni(a, b, groups, tile);
+    return;
+  }
+#endif
+  kernel_scalar(a, b, groups, tile);
+}
+
+}  // namespace
+
+template <typename Dtype>
+Int8Gemm<Dtype>::Int8Gemm(Int8GemmImpl impl)
+    : impl_(sizeof(Dtype) == sizeof(float) ? impl : INT8_GEMM_SCALAR),
+      rows_(0), depth_(0), transposed_(false), source_(NULL),
+      source_version_(0) {
+  CHECK(int8_gemm_impl_supported(impl))
+      << "Int8Gemm: the CPU does not support kernel " << impl;
+}
+
+template <typename Dtype>
+void Int8Gemm<Dtype>::set_weights(const Blob<Dtype>& weights, int rows,
+    int depth, bool transposed, int rows_per_channel) {
+  CHECK_EQ(weights.count(), rows * depth);
+  CHECK_EQ(rows % rows_per_channel, 0);
+  const SyncedMemory* source = weights.data().get();
+  if (rows == rows_ && depth == depth_ && transposed == transposed_ &&
+      source == source_ && source->version() == source_version_) {
+    return;
+  }
+  const Dtype* data = weights.cpu_data();
+  rows_ = rows;
+  depth_ = depth;
+  transposed_ = transposed;
+  source_ = source;
+  source_version_ = source->version();
+
+  const Layout l = layout(impl_);
+  const int groups = (depth + l.group - 1) / l.group;
+  const int padded_rows = (rows + l.rows - 1) / l.rows * l.rows;
+  weights_.assign(padded_rows * groups, 0);
+  weight_scales_.assign(padded_rows, Dtype(0));
+  row_offsets_.assign(padded_rows, 0);
+  row_scales_.resize(padded_rows);
+  std::vector<int> row(groups * l.group);
+  for (int r0 = 0; r0 < rows; r0 += rows_per_channel) {
+    Dtype max_abs = 0;
+    for (int r = r0; r < r0 + rows_per_channel; ++r) {
+      for (int k = 0; k < depth; ++k) {
+        const Dtype w = transposed ? data[k * rows + r] : data[r * depth + k];
+        max_abs = std::max(max_abs, std::abs(w));
+      }
+    }
+    const Dtype scale = max_abs > 0 ? max_abs / 127 : Dtype(1);
+    const Dtype inv_scale = Dtype(1) / scale;
+    for (int r = r0; r < r0 + rows_per_channel; ++r) {
+      weight_scales_[r] = scale;
+      int sum = 0;
+      for (int k = 0; k < depth; ++k) {
+        const Dtype w = transposed ? data[k * rows + r] : data[r * depth + k];
+        row[k] = quantize(w * inv_scale);
+        sum += row[k];
+      }
+      if (impl_ == INT8_GEMM_AVX512_VNNI) {
+        row_offsets_[r] = -128 * sum;
+      }
+      // the panels are (groups x l.rows) words
+      int32_t* panel = &weights_[r / l.rows * l.rows * groups];
+      for (int g = 0; g < groups; ++g) {
+        panel[g * l.rows + r % l.rows] =
+            pack_word(&row[g * l.group], l.group, false);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void Int8Gemm<Dtype>::gemm(const Dtype* input, int cols, Dtype input_scale,
+    Dtype* output) {
+  CHECK_GT(rows_, 0) << "Int8Gemm: set_weights must be called first";
+  const int rows = rows_;
+  const int depth = depth_;
+  if (input_scale <= 0) {
+    Dtype max_abs = 0;
+    for (int i = 0; i < depth * cols; ++i) {
+      max_abs = std::max(max_abs, std::abs(input[i]));
+    }
+    input_scale = max_abs > 0 ? max_abs / 127 : Dtype(1);
+  }
+  const Dtype inv_scale = Dtype(1) / input_scale;
+  for (int r = 0; r < rows; ++r) {
+    row_scales_[r] = input_scale * weight_scales_[r];
+  }
+
+  const Int8GemmImpl impl = impl_;
+  const Layout l = layout(impl);
+  const int groups = (depth + l.group - 1) / l.group;
+  // the input is processed in blocks of columns, which every thread packs
+  // into a buffer that stays in the L2 cache; the blocks are as wide as
+  // possible, as packing touches a page of the input per row and block
+  const int panel_size = groups * l.cols;
+  const int block_panels = std::max(1, kBlockBytes / 4 / panel_size);
+  const int block_size = block_panels * panel_size;
+  const int block_cols = block_panels * l.cols;
+  const int num_blocks = (cols + block_cols - 1) / block_cols;
+  packed_input_.resize(ogn_num_threads() * block_size);
+  int32_t* packed_input = packed_input_.data();
+  const int32_t* weights = weights_.data();
+  const int32_t* row_offsets = row_offsets_.data();
+  const Dtype* row_scales = row_scales_.data();
+  OGN_PARALLEL_FOR
+  for (int b = 0; b < num_blocks; ++b) {
+#ifdef _OPENMP
+    int32_t* packed = packed_input + omp_get_thread_num() * block_size;
+#else
+    int32_t* packed = packed_input;
+#endif
+    const int block_begin = b * block_cols;
+    const int num_block_cols = std::min(block_cols, cols - block_begin);
+    for (int g = 0; g < groups; ++g) {
+      pack_input(impl, l, input + block_begin, cols, depth, num_block_cols, g,
+          inv_scale, packed);
+    }
+    // every panel of the input is multiplied with all panels of A, which stay
+    // in cache
+    int32_t tile[kMaxTileRows * kMaxTileCols];
+    for (int col = 0; col < num_block_cols; col += l.cols) {
+      const int num_cols = std::min(l.cols, num_block_cols - col);
+      const int32_t* panel = packed + col * groups;
+      for (int r = 0; r < rows; r += l.rows) {
+        kernel(impl, weights + r * groups, panel, groups, tile);
+        store_tile(impl, l, tile, std::min(l.rows, rows - r), num_cols,
+            row_offsets + r, row_scales + r,
+            output + r * cols + block_begin + col, cols);
+      }
+    }
+  }
+}
+
+INSTANTIATE_CLASS(Int8Gemm);
+
+}  // namespace caffe
@@ -0,0 +1,23 @@
+#include "caffe/util/ogn_threads.hpp"
+
+#ifndef OGN_NUM_THREADS
+#define OGN_NUM_THREADS 0
+#endif
+
+namespace caffe {
+
+static int ogn_num_threads_ = OGN_NUM_THREADS;
+
+int ogn_num_threads() {
+#ifdef _OPENMP
+  return ogn_num_threads_ > 0 ? ogn_num_threads_ : omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+void set_ogn_num_threads(int num_threads) {
+  ogn_num_threads_ = num_threads > 0 ? num_threads : 0;
+}
+
+}  // namespace caffe
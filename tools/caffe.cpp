@@ -6,13 +6,16 @@ namespace bp = boost::python;
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstring>
+#include <fstream>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
 #include "caffe/caffe.hpp"
+#include "caffe/layers/ogn_layer.hpp"
 #include "caffe/util/signal_handler.h"
 
 using caffe::Blob;
@@ -54,6 +57,15 @@ DEFINE_string(sigint_effect, "stop",
 DEFINE_string(sighup_effect, "snapshot",
              "Optional; action to take when a SIGHUP signal is received: "
              "snapshot, stop or none.");
+DEFINE_bool(ogn_stats, false,
+    "Optional; report the profiling counters of the OGN layers per layer "
+    "and per octree level. Only used for 'time'.");
+DEFINE_string(ogn_stats_json, "",
+    "Optional; also write the OGN counters as JSON to this file. "
+    "Only used for 'time' with -ogn_stats.");
+DEFINE_int32(ogn_max_level, -1,
+    "Optional; stop the refinement of OGN nets at this octree level, "
+    "trading accuracy for speed. Only used for 'test' and 'time'.");
 
 // A simple registry for caffe commands.
 typedef int (*BrewFunction)();
@@ -262,6 +274,16 @@ int train() {
 RegisterBrewFunction(train);
 
 
+// Applies FLAGS_ogn_max_level to the OGN layers of net.
+static void set_ogn_max_level(const Net<float>& net) {
+  if (FLAGS_ogn_max_level < 0) return;
+  for (int i = 0; i < net.layers().size(); ++i) {
+    caffe::OGNLayer<float>* ogn_layer =
+        dynamic_cast<caffe::OGNLayer<float>*>(net.layers()[i].get());
+    if (ogn_layer) ogn_layer->set_max_output_level(FLAGS_ogn_max_level);
+  }
+}
+
 // Test: score a model.
 int test() {
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to score.";
@@ -287,6 +309,7 @@ int test() {
   // Instantiate the caffe net.
   Net<float> caffe_net(FLAGS_model, caffe::TEST, FLAGS_level, &stages);
   caffe_net.CopyTrainedLayersFrom(FLAGS_weights);
+  set_ogn_max_level(caffe_net);
   LOG(INFO) << "Running for " << FLAGS_iterations << " iterations.";
 
   vector<int> test_score_output_id;
@@ -335,6 +358,110 @@ int test() {
 RegisterBrewFunction(test);
 
 
+// Formats the per-iteration averages of OGN counters as JSON fields.
+static string ogn_stats_json_fields(const caffe::OGNStats& stats,
+    double cells) {
+  const int iterations = std::max(stats.iterations, 1);
+  ostringstream fields;
+  fields << "\"level\": " << stats.level
+      << ", \"cells\": " << cells
+      << ", \"neighbor_lookups\": " << stats.neighbor_lookups / iterations
+      << ", \"neighbor_hits\": " << stats.neighbor_hits / iterations
+      << ", \"col_buffer_bytes\": " << stats.col_buffer_bytes
+      << ", \"octree_bytes\": " << stats.octree_bytes / iterations
+      << ", \"keys_ms\": " << stats.keys_ms / FLAGS_iterations
+      << ", \"gather_ms\": " << stats.gather_ms / FLAGS_iterations
+      << ", \"gemm_ms\": " << stats.gemm_ms / FLAGS_iterations
+      << ", \"scatter_ms\": " << stats.scatter_ms / FLAGS_iterations;
+  return fields.str();
+}
+
+// Reports the counters collected by the OGN layers during 'time', per layer
+// and per octree level, and optionally writes them to FLAGS_ogn_stats_json.
+static void report_ogn_stats(const vector<shared_ptr<Layer<float> > >& layers,
+    const vector<double>& forward_time_per_layer,
+    const vector<double>& backward_time_per_layer) {
+  // per level: counters summed over the layers, cells as the maximum
+  std::map<int, caffe::OGNStats> levels;
+  std::map<int, double> level_cells;
+  ostringstream json;
+  json << "{\n  \"iterations\": " << FLAGS_iterations << ",\n  \"layers\": [";
+  bool first = true;
+  LOG(INFO) << "OGN counters per layer, averaged per iteration:";
+  for (int i = 0; i < layers.size(); ++i) {
+    caffe::OGNLayer<float>* ogn_layer =
+        dynamic_cast<caffe::OGNLayer<float>*>(layers[i].get());
+    if (!ogn_layer) continue;
+    const caffe::OGNStats& stats = ogn_layer->get_stats();
+    if (!stats.iterations) continue;
+    const caffe::string& layername = layers[i]->layer_param().name();
+    const double cells = double(stats.num_cells) / stats.iterations;
+    const double hit_ratio = stats.neighbor_lookups ?
+        double(stats.neighbor_hits) / stats.neighbor_lookups : 0;
+    LOG(INFO) << std::setfill(' ') << std::setw(10) << layername
+      << "\tlevel: " << stats.level << "\tcells: " << cells
+      << "\tneighbor hits: " << hit_ratio
+      << "\tcol buffer: " << stats.col_buffer_bytes / 1048576.0 << " MB"
+      << "\toctrees: " << stats.octree_bytes / stats.iterations / 1048576.0
+      << " MB";
+    LOG(INFO) << std::setfill(' ') << std::setw(10) << layername
+      << "\tkeys: " << stats.keys_ms / FLAGS_iterations << " ms"
+      << "\tgather: " << stats.gather_ms / FLAGS_iterations << " ms"
+      << "\tgemm: " << stats.gemm_ms / FLAGS_iterations << " ms"
+      << "\tscatter: " << stats.scatter_ms / FLAGS_iterations << " ms";
+
+    json << (first ? "\n" : ",\n") << "    {\"name\": \"" << layername
+        << "\", \"type\": \"" << layers[i]->type() << "\", "
+        << ogn_stats_json_fields(stats, cells)
+        << ", \"forward_ms\": " << forward_time_per_layer[i] / 1000 /
+        FLAGS_iterations
+        << ", \"backward_ms\": " << backward_time_per_layer[i] / 1000 /
+        FLAGS_iterations << "}";
+    first = false;
+
+    caffe::OGNStats& level = levels[stats.level];
+    level.level = stats.level;
+    level.iterations = std::max(level.iterations, stats.iterations);
+    level.neighbor_lookups += stats.neighbor_lookups;
+    level.neighbor_hits += stats.neighbor_hits;
+    level.col_buffer_bytes = std::max(level.col_buffer_bytes,
+        stats.col_buffer_bytes);
+    level.octree_bytes += stats.octree_bytes;
+    level.keys_ms += stats.keys_ms;
+    level.gather_ms += stats.gather_ms;
+    level.gemm_ms += stats.gemm_ms;
+    level.scatter_ms += stats.scatter_ms;
+    level_cells[stats.level] = std::max(level_cells[stats.level], cells);
+  }
+  json << "\n  ],\n  \"levels\": [";
+
+  LOG(INFO) << "OGN counters per octree level, averaged per iteration:";
+  first = true;
+  for (std::map<int, caffe::OGNStats>::iterator it = levels.begin();
+       it != levels.end(); ++it) {
+    const caffe::OGNStats& stats = it->second;
+    LOG(INFO) << "level " << it->first
+      << "\tcells: " << level_cells[it->first]
+      << "\tkeys: " << stats.keys_ms / FLAGS_iterations << " ms"
+      << "\tgather: " << stats.gather_ms / FLAGS_iterations << " ms"
+      << "\tgemm: " << stats.gemm_ms / FLAGS_iterations << " ms"
+      << "\tscatter: " << stats.scatter_ms / FLAGS_iterations << " ms"
+      << "\toctrees: " << stats.octree_bytes / stats.iterations / 1048576.0
+      << " MB";
+    json << (first ? "\n" : ",\n") << "    {"
+        << ogn_stats_json_fields(stats, level_cells[it->first]) << "}";
+    first = false;
+  }
+  json << "\n  ]\n}\n";
+
+  if (FLAGS_ogn_stats_json.size()) {
+    std::ofstream json_file(FLAGS_ogn_stats_json.c_str());
+    CHECK(json_file.good()) << "Cannot write " << FLAGS_ogn_stats_json;
+    json_file << json.str();
+    LOG(INFO) << "OGN counters written to " << FLAGS_ogn_stats_json;
+  }
+}
+
 // Time: benchmark the execution time of a model.
 int time() {
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to time.";
@@ -354,6 +481,7 @@ int time() {
   }
   // Instantiate the caffe net.
   Net<float> caffe_net(FLAGS_model, phase, FLAGS_level, &stages);
+  set_ogn_max_level(caffe_net);
 
   // Do a clean forward and backward pass, so that memory allocation are done
   // and future iterations will be more stable.
@@ -371,6 +499,13 @@ int time() {
   const vector<vector<Blob<float>*> >& top_vecs = caffe_net.top_vecs();
   const vector<vector<bool> >& bottom_need_backward =
       caffe_net.bottom_need_backward();
+  if (FLAGS_ogn_stats) {
+    for (int i = 0; i < layers.size(); ++i) {
+      caffe::OGNLayer<float>* ogn_layer =
+          dynamic_cast<caffe::OGNLayer<float>*>(layers[i].get());
+      if (ogn_layer) ogn_layer->set_collect_stats(true);
+    }
+  }
   LOG(INFO) << "*** Benchmark begins ***";
   LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations.";
   Timer total_timer;
@@ -421,6 +556,9 @@ int time() {
   LOG(INFO) << "Average Forward-Backward: " << total_timer.MilliSeconds() /
     FLAGS_iterations << " ms.";
   LOG(INFO) << "Total Time: " << total_timer.MilliSeconds() << " ms.";
+  if (FLAGS_ogn_stats) {
+    report_ogn_stats(layers, forward_time_per_layer, backward_time_per_layer);
+  }
   LOG(INFO) << "*** Benchmark ends ***";
   return 0;
 }
@@ -0,0 +1,377 @@
+#include <boost/program_options.hpp>
+#include <google/protobuf/text_format.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/int8_gemm.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+int max_level = 6;
+float density = 0.1f;
+int num_models = 2;
+int num_channels = 16;
+int iterations = 10;
+int seed = 1;
+int num_threads = 0;
+std::string output_file, tmp_dir = "/tmp";
+
+int register_cmd_options(int argc, char* argv[]) {
+    try {
+        boost::program_options::options_description desc("Options");
+        desc.add_options()
+            ("help,h", "Show help")
+            ("level,l", boost::program_options::value<int>(&max_level), "Octree level of the synthetic models, at least 3 (default: 6)")
+            ("density,d", boost::program_options::value<float>(&density), "Fraction of the voxels of the finest level that are occupied (default: 0.1)")
+            ("models,m", boost::program_options::value<int>(&num_models), "Number of synthetic models, also the batch size of the layers (default: 2)")
+            ("channels,c", boost::program_options::value<int>(&num_channels), "Feature channels of the layers (default: 16)")
+            ("iterations,n", boost::program_options::value<int>(&iterations), "Timed repetitions of every benchmark (default: 10)")
+            ("seed,s", boost::program_options::value<int>(&seed), "Random seed of the models and the weights (default: 1)")
+            ("threads,j", boost::program_options::value<int>(&num_threads), "Number of threads of the OGN layers (default: OGN_NUM_THREADS or all)")
+            ("output,o", boost::program_options::value<std::string>(&output_file), "CSV output file (default: stdout)")
+            ("tmp,t", boost::program_options::value<std::string>(&tmp_dir), "Directory of the octree files written by the benchmarks (default: /tmp)")
+        ;
+
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+
+        if ( vm.count("help") ) {
+            std::cout << desc << std::endl;
+            return 1;
+        } else if ( max_level < 3 || density <= 0 || density > 1 || num_models < 1 || num_channels < 1 || iterations < 1 ) {
+            std::cout << desc << std::endl;
+            return -1;
+        }
+    } catch( boost::program_options::error& e ) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/// Level of the dense input of the benchmarked net, and the coarsest level
+/// of the synthetic octrees.
+const int MIN_LEVEL = 2;
+
+std::ostream* out = &std::cout;
+volatile long long sink = 0;
+
+/// Peak resident set size of the process in kB.
+long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/// Writes a CSV row: the benchmark ran ops times in total_us and processed
+/// cells octree cells.
+void report(const std::string& benchmark, const std::string& backend, int level,
+    long long ops, long long cells, double total_us) {
+    const double ns_per_op = total_us * 1000 / ops;
+    const double cells_per_s = total_us > 0 ? cells / (total_us * 1e-6) : 0;
+    *out << benchmark << "," << backend << "," << level << "," << density << "," << ops << ","
+         << cells << "," << ns_per_op << "," << cells_per_s << "," << peak_rss_kb() << std::endl;
+}
+
+/// A model of resolution 2^level with the given fraction of occupied
+/// voxels, made of spheres of a radius of 1/8 of the resolution. The
+/// spheres give the models surfaces, so that most of their cells are on the
+/// finest levels like for real shapes.
+OccupancyVoxelGrid make_model(int level) {
+    const int res = 1 << level;
+    const int radius = std::max(1, res / 8);
+    const long long target = (long long)(density * res * res * res);
+    OccupancyVoxelGrid vg(res, res, res);
+    long long occupied = 0;
+    while ( occupied < target ) {
+        float center[3];
+        caffe::caffe_rng_uniform<float>(3, 0, res, center);
+        for ( int i = std::max(0, int(center[0]) - radius); i < std::min(res, int(center[0]) + radius + 1); i++ ) {
+            for ( int j = std::max(0, int(center[1]) - radius); j < std::min(res, int(center[1]) + radius + 1); j++ ) {
+                for ( int k = std::max(0, int(center[2]) - radius); k < std::min(res, int(center[2]) + radius + 1); k++ ) {
+                    const float di = i + 0.5f - center[0], dj = j + 0.5f - center[1], dk = k + 0.5f - center[2];
+                    if ( di * di + dj * dj + dk * dk > radius * radius || vg.get_element(i, j, k) ) continue;
+                    vg.set_element(i, j, k, 1);
+                    occupied++;
+                }
+            }
+        }
+    }
+    return vg;
+}
+
+std::string model_file_name(const std::string& name, int n) {
+    std::stringstream ss;
+    ss << tmp_dir << "/ogn_bench_" << name << "_" << n << ".ot";
+    return ss.str();
+}
+
+/// compute_key and compute_coord of the cells of the models.
+void bench_keys(std::vector<OccupancyVoxelGrid>& models) {
+    std::vector<KeyType> keys;
+    for ( int n = 0; n < models.size(); n++ ) {
+        Octree octree;
+        octree.from_voxel_grid(models[n], MIN_LEVEL);
+        for ( Octree::iterator it = octree.begin(); it != octree.end(); it++ ) keys.push_back(it->first);
+    }
+    std::vector<OctreeCoord> coords(keys.size());
+    const long long ops = (long long)iterations * keys.size();
+
+    caffe::CPUTimer timer;
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        for ( size_t i = 0; i < keys.size(); i++ ) coords[i] = Octree::compute_coord(keys[i]);
+    }
+    timer.Stop();
+    report("compute_coord", "-", max_level, ops, ops, timer.MicroSeconds());
+
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        KeyType sum = 0;
+        for ( size_t i = 0; i < coords.size(); i++ ) sum += Octree::compute_key(coords[i]);
+        sink += sum;
+    }
+    timer.Stop();
+    report("compute_key", "-", max_level, ops, ops, timer.MicroSeconds());
+}
+
+/// The octree functions of a backend on the models.
+template <class OCTREE>
+void bench_octree(const std::string& backend, std::vector<OccupancyVoxelGrid>& models) {
+    const int num = models.size();
+    std::vector<OCTREE> octrees(num);
+    long long num_cells = 0;
+    caffe::CPUTimer timer;
+
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        for ( int n = 0; n < num; n++ ) {
+            octrees[n] = OCTREE();
+            octrees[n].from_voxel_grid(models[n], MIN_LEVEL);
+        }
+    }
+    timer.Stop();
+    for ( int n = 0; n < num; n++ ) num_cells += octrees[n].num_elements();
+    report("from_voxel_grid", backend, max_level, (long long)iterations * num, iterations * num_cells, timer.MicroSeconds());
+
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        for ( int n = 0; n < num; n++ ) sink += octrees[n].to_voxel_grid().size();
+    }
+    timer.Stop();
+    report("to_voxel_grid", backend, max_level, (long long)iterations * num, iterations * num_cells, timer.MicroSeconds());
+
+    // the 3x3x3 neighborhoods of OGNConv, queried level by level
+    std::vector<std::vector<KeyType> > keys(num);
+    for ( int n = 0; n < num; n++ ) {
+        for ( typename OCTREE::iterator it = octrees[n].begin(); it != octrees[n].end(); it++ ) keys[n].push_back(it->first);
+        std::sort(keys[n].begin(), keys[n].end());
+    }
+    std::vector<KeyType> neighbors;
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        for ( int n = 0; n < num; n++ ) {
+            neighbors.resize(keys[n].size() * 27);
+            octrees[n].get_neighbor_keys(keys[n].data(), keys[n].size(), 3, neighbors.data());
+            sink += neighbors.back();
+        }
+    }
+    timer.Stop();
+    report("get_neighbor_keys", backend, max_level, iterations * num_cells, iterations * num_cells, timer.MicroSeconds());
+
+    const std::string formats[] = {"text", "binary"};
+    for ( int f = 0; f < 2; f++ ) {
+        const bool binary = f == 1;
+        timer.Start();
+        for ( int it = 0; it < iterations; it++ ) {
+            for ( int n = 0; n < num; n++ ) {
+                if ( binary ) octrees[n].to_binary_file(model_file_name(backend, n));
+                else octrees[n].to_file(model_file_name(backend, n));
+            }
+        }
+        timer.Stop();
+        report("to_file." + formats[f], backend, max_level, (long long)iterations * num, iterations * num_cells, timer.MicroSeconds());
+
+        timer.Start();
+        for ( int it = 0; it < iterations; it++ ) {
+            for ( int n = 0; n < num; n++ ) {
+                OCTREE octree;
+                CHECK(octree.from_file(model_file_name(backend, n)));
+                sink += octree.num_elements();
+            }
+        }
+        timer.Stop();
+        report("from_file." + formats[f], backend, max_level, (long long)iterations * num, iterations * num_cells, timer.MicroSeconds());
+    }
+    for ( int n = 0; n < num; n++ ) std::remove(model_file_name(backend, n).c_str());
+}
+
+/// A training net that refines the models from a dense grid of MIN_LEVEL to
+/// max_level like the OGN decoders, with the structure of the models
+/// (PROP_KNOWN): a deconvolution and a convolution per level, followed by
+/// OGNProp below max_level.
+std::string decoder_net(const std::string& list_file) {
+    const int dense_res = 1 << MIN_LEVEL;
+    std::stringstream ss;
+    ss << "name: 'ogn_bench'\n"
+       << "layer { name: 'data' type: 'OGNData' top: 'gt_values' top: 'gt_labels'\n"
+       << "  ogn_data_param { batch_size: " << num_models << " source: '" << list_file << "' preload_data: true prefetch: 0 } }\n"
+       << "layer { name: 'input' type: 'DummyData' top: 'dense'\n"
+       << "  dummy_data_param { shape { dim: " << num_models << " dim: " << num_channels
+       << " dim: " << dense_res << " dim: " << dense_res << " dim: " << dense_res << " } data_filler { type: 'gaussian' std: 1 } } }\n"
+       << "layer { name: 'keys" << MIN_LEVEL << "' type: 'OGNGenerateKeys' bottom: 'dense' }\n"
+       << "layer { name: 'flat' type: 'Reshape' bottom: 'dense' top: 'features" << MIN_LEVEL << "' reshape_param { shape { dim: 0 dim: 0 dim: -1 } } }\n";
+
+    std::string key_layer = "keys", features = "features";
+    for ( int l = MIN_LEVEL + 1; l <= max_level; l++ ) {
+        const bool last = l == max_level;
+        ss << "layer { name: 'deconv" << l << "' type: 'OGNConv' bottom: '" << features << l - 1 << "' top: 'deconv" << l << "'\n"
+           << "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: " << num_channels << " key_layer: '" << key_layer << l - 1 << "'\n"
+           << "    weight_filler { type: 'gaussian' std: 0.01 } bias_filler { type: 'constant' } } }\n"
+           << "layer { name: 'conv" << l << "' type: 'OGNConv' bottom: 'deconv" << l << "' top: 'conv" << l << "'\n"
+           << "  ogn_conv_param { filter_size: 3 output_channels: " << (last ? OGN_NUM_CLASSES : num_channels) << " key_layer: 'deconv" << l << "'\n"
+           << "    weight_filler { type: 'gaussian' std: 0.01 } bias_filler { type: 'constant' } } }\n"
+           << "layer { name: 'lp" << l << "' type: 'OGNLossPrep' bottom: 'conv" << l << "' bottom: 'gt_values' top: 'labels" << l << "'\n"
+           << "  ogn_loss_prep_param { gt_key_layer: 'data' pr_key_layer: 'conv" << l << "' } }\n";
+        if ( last ) break;
+        ss << "layer { name: 'prop" << l << "' type: 'OGNProp' bottom: 'conv" << l << "' bottom: 'labels" << l << "' top: 'prop" << l << "'\n"
+           << "  ogn_prop_param { key_layer: 'conv" << l << "' prop_mode: PROP_KNOWN } }\n";
+        key_layer = features = "prop";
+    }
+    ss << "layer { name: 'loss' type: 'SoftmaxWithLoss' bottom: 'conv" << max_level << "' bottom: 'labels" << max_level << "' top: 'loss'\n"
+       << "  propagate_down: true propagate_down: false loss_param { ignore_label: " << CLASS_IGNORE << " normalization: VALID } }\n";
+    return ss.str();
+}
+
+/// The forward GEMM of an OGNConv layer, with its weights and cols random
+/// columns, in float and in int8 with the fastest kernel of the CPU. The input
+/// scale is fixed as for a calibrated net.
+void bench_gemm(const caffe::Blob<float>& weights, int level, int cols) {
+    const int rows = weights.shape(0);
+    const int depth = weights.count() / rows;
+    std::vector<float> input(depth * cols), output(rows * cols);
+    caffe::caffe_rng_gaussian<float>(input.size(), 0, 1, input.data());
+    caffe::CPUTimer timer;
+
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) {
+        caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, rows, cols, depth, 1,
+            weights.cpu_data(), input.data(), 0, output.data());
+    }
+    timer.Stop();
+    report("gemm.float", "-", level, iterations, (long long)iterations * cols, timer.MicroSeconds());
+
+    const char* impl_names[] = {"scalar", "avx2", "avx512_vnni"};
+    caffe::Int8Gemm<float> int8_gemm;
+    int8_gemm.set_weights(weights, rows, depth, false, 1);
+    timer.Start();
+    for ( int it = 0; it < iterations; it++ ) int8_gemm.gemm(input.data(), cols, 4.f / 127, output.data());
+    timer.Stop();
+    report(std::string("gemm.int8.") + impl_names[int8_gemm.impl()], "-", level, iterations,
+        (long long)iterations * cols, timer.MicroSeconds());
+}
+
+/// Forward and backward of the OGNConv and OGNProp layers of decoder_net,
+/// every layer on the outputs of one pass of the net, and the GEMM of every
+/// convolution in float and int8.
+void bench_layers(std::vector<OccupancyVoxelGrid>& models) {
+    const std::string list_file = tmp_dir + "/ogn_bench_models.txt";
+    std::ofstream list(list_file.c_str());
+    for ( int n = 0; n < models.size(); n++ ) {
+        Octree octree;
+        octree.from_voxel_grid(models[n], MIN_LEVEL);
+        octree.to_binary_file(model_file_name("net", n));
+        list << model_file_name("net", n) << std::endl;
+    }
+    list.close();
+
+    caffe::NetParameter net_param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(decoder_net(list_file), &net_param));
+    net_param.mutable_state()->set_phase(caffe::TRAIN);
+    // OGNData reports the loading on stdout, which may hold the CSV
+    std::streambuf* stdout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+    caffe::Net<float> net(net_param);
+    std::cout.rdbuf(stdout_buf);
+    net.Forward();
+    net.Backward();
+
+#ifdef USE_SORTED_OCTREE
+    const std::string backend = "sorted";
+#else
+    const std::string backend = "hash";
+#endif
+    const std::vector<boost::shared_ptr<caffe::Layer<float> > >& layers = net.layers();
+    for ( int i = 0; i < layers.size(); i++ ) {
+        caffe::OGNLayer<float>* layer = dynamic_cast<caffe::OGNLayer<float>*>(layers[i].get());
+        const std::string type = layers[i]->type();
+        if ( !layer || (type != "OGNConv" && type != "OGNProp") ) continue;
+
+        std::string benchmark = type;
+        if ( type == "OGNConv" ) benchmark += layers[i]->layer_param().ogn_conv_param().is_deconv() ? ".deconv" : ".conv";
+        KeyOctree& keys = layer->get_keys_octree(0);
+        const int level = keys.num_elements() ? KeyOctree::compute_level(keys.begin()->first) : -1;
+        caffe::CPUTimer timer;
+
+        timer.Start();
+        for ( int it = 0; it < iterations; it++ ) layers[i]->Forward(net.bottom_vecs()[i], net.top_vecs()[i]);
+        timer.Stop();
+        const long long cells = layer->get_num_cells();
+        report(benchmark + ".forward", backend, level, iterations, iterations * cells, timer.MicroSeconds());
+
+        timer.Start();
+        for ( int it = 0; it < iterations; it++ ) layers[i]->Backward(net.top_vecs()[i], net.bottom_need_backward()[i], net.bottom_vecs()[i]);
+        timer.Stop();
+        report(benchmark + ".backward", backend, level, iterations, iterations * cells, timer.MicroSeconds());
+
+        if ( benchmark == "OGNConv.conv" ) bench_gemm(*layers[i]->blobs()[0], level, cells);
+    }
+
+    for ( int n = 0; n < models.size(); n++ ) std::remove(model_file_name("net", n).c_str());
+    std::remove(list_file.c_str());
+}
+
+/// Microbenchmarks of image_tree_tools and the OGN layers on synthetic
+/// models, one CSV row per benchmark. Comparing the rows of two builds shows
+/// whether a change to an octree backend or a layer helps; the benchmarks of
+/// both octree backends always run, the layers use the backend of the build
+/// (USE_SORTED_OCTREE).
+int main(int argc, char* argv[]) {
+    int ret = register_cmd_options(argc, argv);
+    if ( ret ) return ret > 0 ? 0 : ret;
+    ::google::InitGoogleLogging(argv[0]);
+    if ( num_threads > 0 ) caffe::set_ogn_num_threads(num_threads);
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+    caffe::Caffe::set_random_seed(seed);
+
+    std::ofstream output;
+    if ( !output_file.empty() ) {
+        output.open(output_file.c_str());
+        if ( !output.good() ) {
+            std::cerr << "ERROR: cannot write " << output_file << std::endl;
+            return -1;
+        }
+        out = &output;
+    }
+
+    std::vector<OccupancyVoxelGrid> models;
+    for ( int n = 0; n < num_models; n++ ) models.push_back(make_model(max_level));
+
+    *out << "benchmark,backend,level,density,ops,cells,ns_per_op,cells_per_s,peak_rss_kb" << std::endl;
+    bench_keys(models);
+    bench_octree<GeneralOctree<SignalType, KeyType> >("hash", models);
+    bench_octree<SortedOctree<SignalType, KeyType> >("sorted", models);
+    bench_layers(models);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::Layer;
+using caffe::LayerParameter;
+using caffe::Net;
+using caffe::NetParameter;
+
+std::string model_file, weights_file, output_file;
+int iterations = 10;
+
+int register_cmd_options(int argc, char* argv[]) {
+    try {
+        boost::program_options::options_description desc("Options");
+        desc.add_options()
+            ("help,h", "Show help")
+            ("model,m", boost::program_options::value<std::string>(&model_file), "Net prototxt with the OGNConv, Convolution and Deconvolution layers to calibrate set to int8")
+            ("weights,w", boost::program_options::value<std::string>(&weights_file), "Trained caffemodel")
+            ("output,o", boost::program_options::value<std::string>(&output_file), "Net prototxt written with the input scales of the int8 layers")
+            ("iterations,n", boost::program_options::value<int>(&iterations), "Number of TEST batches to calibrate on (default: 10)")
+        ;
+
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
+
+        if ( vm.count("help") ) {
+            std::cout << desc << std::endl;
+            return 1;
+        } else if ( !vm.count("model") || !vm.count("weights") || !vm.count("output") || iterations < 1 ) {
+            std::cout << desc << std::endl;
+            return -1;
+        }
+    } catch( boost::program_options::error& e ) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/// Sets int8 of an OGNConv, Convolution or Deconvolution layer, and its input
+/// scale if scale is given; returns whether int8 was set before.
+bool set_int8(LayerParameter* layer_param, bool int8, const float* scale = NULL) {
+    bool was_int8 = false;
+    if ( layer_param->has_ogn_conv_param() ) {
+        was_int8 = layer_param->ogn_conv_param().int8();
+        layer_param->mutable_ogn_conv_param()->set_int8(int8);
+        if ( scale ) layer_param->mutable_ogn_conv_param()->set_input_scale(*scale);
+    } else if ( layer_param->type() == "Convolution" || layer_param->type() == "Deconvolution" ) {
+        was_int8 = layer_param->convolution_param().int8();
+        layer_param->mutable_convolution_param()->set_int8(int8);
+        if ( scale ) layer_param->mutable_convolution_param()->set_input_scale(*scale);
+    }
+    return was_int8;
+}
+
+/// Calibrates the int8 layers of a net: runs the net in float on a few TEST
+/// batches, records the largest absolute input of every int8 layer, and writes
+/// the net prototxt with its symmetric int8 scale as input_scale. The float
+/// caffemodel is used as is with the output prototxt.
+int main(int argc, char* argv[]) {
+    int ret = register_cmd_options(argc, argv);
+    if ( ret ) return ret > 0 ? 0 : ret;
+    ::google::InitGoogleLogging(argv[0]);
+    Caffe::set_mode(Caffe::CPU);
+
+    // the net is run in float: int8 layers are calibrated on the float
+    // activations of the layers before them
+    NetParameter net_param;
+    caffe::ReadNetParamsFromTextFileOrDie(model_file, &net_param);
+    NetParameter calib_param = net_param;
+    calib_param.mutable_state()->set_phase(caffe::TEST);
+    std::map<std::string, float> max_inputs;
+    for ( int i = 0; i < calib_param.layer_size(); i++ ) {
+        LayerParameter* layer_param = calib_param.mutable_layer(i);
+        // a fused OGNProp does not write its top in the TEST phase, so the
+        // inputs of the deconvolutions it feeds would not be seen
+        if ( layer_param->has_ogn_prop_param() ) layer_param->mutable_ogn_prop_param()->set_fuse_deconv(false);
+        if ( set_int8(layer_param, false) ) max_inputs[layer_param->name()] = 0;
+    }
+    if ( max_inputs.empty() ) {
+        std::cerr << "ERROR: " << model_file << " has no OGNConv, Convolution or Deconvolution layers with int8 set" << std::endl;
+        return -1;
+    }
+
+    Net<float> net(calib_param);
+    net.CopyTrainedLayersFrom(weights_file);
+    // layers of the other phases are not calibrated
+    for ( std::map<std::string, float>::iterator max_it = max_inputs.begin(); max_it != max_inputs.end(); ) {
+        if ( net.has_layer(max_it->first) ) max_it++;
+        else max_inputs.erase(max_it++);
+    }
+
+    const std::vector<boost::shared_ptr<Layer<float> > >& layers = net.layers();
+    const std::vector<std::vector<Blob<float>*> >& bottoms = net.bottom_vecs();
+    for ( int it = 0; it < iterations; it++ ) {
+        for ( int l = 0; l < layers.size(); l++ ) {
+            net.ForwardFromTo(l, l);
+            std::map<std::string, float>::iterator max_it = max_inputs.find(layers[l]->layer_param().name());
+            if ( max_it == max_inputs.end() ) continue;
+            for ( int b = 0; b < bottoms[l].size(); b++ ) {
+                const float* input = bottoms[l][b]->cpu_data();
+                for ( int i = 0; i < bottoms[l][b]->count(); i++ ) max_it->second = std::max(max_it->second, std::fabs(input[i]));
+            }
+        }
+    }
+
+    for ( int i = 0; i < net_param.layer_size(); i++ ) {
+        LayerParameter* layer_param = net_param.mutable_layer(i);
+        std::map<std::string, float>::iterator max_it = max_inputs.find(layer_param->name());
+        if ( max_it == max_inputs.end() ) continue;
+        const float scale = max_it->second / 127;
+        CHECK_GT(scale, 0) << layer_param->name() << " had no nonzero input in " << iterations << " batches";
+        set_int8(layer_param, true, &scale);
+        std::cout << layer_param->name() << ": max input " << max_it->second << ", scale " << scale << std::endl;
+    }
+    caffe::WriteProtoToTextFile(net_param, output_file);
+    std::cout << "Calibrated " << max_inputs.size() << " layers on " << iterations << " batches: " << output_file << std::endl;
+    return 0;
+}
@@ -5,6 +5,8 @@
 
 std::string input_file, output_file;
 int min_level = 0;
+int record = 0;
+bool binary_output = false;
 
 int register_cmd_options(int argc, char* argv[]) {
     try {
@@ -14,6 +16,8 @@ int register_cmd_options(int argc, char* argv[]) {
             ("input,i", boost::program_options::value<std::string>(&input_file)->required(), "Input file name for conversion")
             ("output,o", boost::program_options::value<std::string>(&output_file)->required(), "Output file name for conversion")
             ("min_level,l", boost::program_options::value<int>(&min_level), "Minimum octree level")
+            ("binary,b", "Write .ot output in the binary format (.ot input is read in either format)")
+            ("record,r", boost::program_options::value<int>(&record), "Record of a .ots shard input, as written by OGNOutput")
         ;
 
         boost::program_options::variables_map vm;
@@ -29,6 +33,8 @@ int register_cmd_options(int argc, char* argv[]) {
         input_file = vm["input"].as<std::string>();
         output_file = vm["output"].as<std::string>();
         min_level = vm["min_level"].as<int>();
+        if ( vm.count("record") ) record = vm["record"].as<int>();
+        binary_output = vm.count("binary") > 0;
     } catch( boost::program_options::required_option& e ) {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         return -1;
@@ -49,17 +55,28 @@ int main(int argc, char* argv[]) {
 
         //read converter input
         if ( input_ext == "ot" ) {
-            octree.from_file(input_file);
+            if ( !octree.from_file(input_file) ) return -1;
+        } else if ( input_ext == "ots" ) {
+            std::vector<KeyType> keys;
+            std::vector<SignalType> values;
+            int max_level;
+            if ( !Octree::read_shard_record(input_file, record, max_level, keys, values) ) return -1;
+            for(size_t i=0; i<keys.size(); i++) octree.add_element(keys[i], values[i]);
         } else if ( input_ext == "binvox" ) {
-            VoxelGrid vg;
-            vg.read_binvox(input_file);
+            // the octree is built from the run-length encoding, without a dense grid
+            RunLengthVoxelGrid vg;
+            if ( !vg.read_binvox(input_file) ) {
+                std::cerr << "ERROR: cannot read " << input_file << std::endl;
+                return -1;
+            }
             octree.from_voxel_grid(vg, min_level);
         }
 
 
         //generate converter output
         if ( output_ext == "ot" ) {
-            octree.to_file(output_file);
+            if ( binary_output ) octree.to_binary_file(output_file);
+            else octree.to_file(output_file);
         } else if ( output_ext == "binvox" ) {
             VoxelGrid vg = octree.to_voxel_grid();
             vg.write_binvox(output_file);
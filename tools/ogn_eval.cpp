@@ -1,80 +1,255 @@
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "image_tree_tools/image_tree_tools.h"
 
-std::string prediction_file, reference_file;
+std::string prediction_file, reference_file, list_file, output_file;
+int num_threads = 0;
+bool verbose = false;
 
 int register_cmd_options(int argc, char* argv[]) {
     try {
         boost::program_options::options_description desc("Options");
         desc.add_options()
             ("help,h", "Show help")
-            ("prediction,p", boost::program_options::value<std::string>(&prediction_file)->required(), "Predicted model file")
-            ("reference,r", boost::program_options::value<std::string>(&reference_file)->required(), "Reference model file")
+            ("prediction,p", boost::program_options::value<std::string>(&prediction_file), "Predicted model file")
+            ("reference,r", boost::program_options::value<std::string>(&reference_file), "Reference model file")
+            ("list,l", boost::program_options::value<std::string>(&list_file), "File with one 'prediction reference' pair per line, evaluated in parallel")
+            ("output,o", boost::program_options::value<std::string>(&output_file), "CSV output file of --list (default: stdout)")
+            ("threads,j", boost::program_options::value<int>(&num_threads), "Number of threads of --list (default: all)")
+            ("verbose,v", "Also print precision, recall and the confusion per octree level")
         ;
 
         boost::program_options::variables_map vm;
         boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), vm);
+        boost::program_options::notify(vm);
 
         if ( vm.count("help") ) {
             std::cout << desc << std::endl;
-        } else if ( !vm.count("prediction") || !vm.count("reference") ) {
+            return 1;
+        } else if ( !vm.count("list") && (!vm.count("prediction") || !vm.count("reference")) ) {
             std::cout << desc << std::endl;
             return -1;
         }
-        
-        prediction_file = vm["prediction"].as<std::string>();
-        reference_file = vm["reference"].as<std::string>();
-    } catch( boost::program_options::required_option& e ) {
+        verbose = vm.count("verbose") > 0;
+    } catch( boost::program_options::error& e ) {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         return -1;
     }
     return 0;
 }
 
-float iou(VoxelGrid ref, VoxelGrid pr)
+typedef SortedOctree<SignalType, KeyType> EvalOctree;
+
+/// A leaf of an octree as the half-open range of finest-level morton codes it covers.
+struct LeafRange
 {
-	float cnt_i = 0, cnt_u = 0;
-	for(int i=0; i<ref.depth(); i++)
-	{
-		for(int j=0; j<ref.width(); j++)
-		{
-			for(int k=0; k<ref.height(); k++)
-			{
-				cnt_i += ref.get_element(i, j, k) && pr.get_element(i, j, k);
-				cnt_u += ref.get_element(i, j, k) || pr.get_element(i, j, k);
-			}
-		}
-	}
-	return cnt_i / cnt_u;
-}
+    uint64_t begin;
+    uint64_t end;
+    int level;
+    bool occupied;
 
-int main(int argc, char* argv[]) {
-    if ( !register_cmd_options(argc, argv) ) {
-    	VoxelGrid vg_ref, vg_pred;
-
-        std::string prediction_ext = get_file_extension(prediction_file);
-        std::string reference_ext = get_file_extension(reference_file);
-
-        if ( prediction_ext == "ot" ) {
-        	Octree octree;
-            octree.from_file(prediction_file);
-            vg_pred = octree.to_voxel_grid();
-        } else if ( prediction_ext == "binvox" ) {
-            vg_pred.read_binvox(prediction_file);
+    bool operator<(const LeafRange& other) const { return begin < other.begin; }
+};
+
+/// Occupancy confusion of two octrees in voxels of the finest level, per
+/// octree level of the finer of the two compared cells.
+struct Evaluation
+{
+    std::vector<uint64_t> counts;
+    bool valid;
+
+    Evaluation() : counts(4 * (EvalOctree::MAX_LEVEL() + 1), 0), valid(false) {}
+
+    /// Voxels of level where the reference is (ref) and the prediction is (pr) occupied.
+    uint64_t& count(int level, bool ref, bool pr) { return counts[4 * level + 2 * ref + pr]; }
+    uint64_t count(int level, bool ref, bool pr) const { return counts[4 * level + 2 * ref + pr]; }
+
+    uint64_t total(bool ref, bool pr) const
+    {
+        uint64_t sum = 0;
+        for(int l=0; l<=EvalOctree::MAX_LEVEL(); l++) sum += count(l, ref, pr);
+        return sum;
+    }
+
+    float iou() const { return float(total(1, 1)) / float(total(1, 1) + total(1, 0) + total(0, 1)); }
+    float precision() const { return float(total(1, 1)) / float(total(1, 1) + total(0, 1)); }
+    float recall() const { return float(total(1, 1)) / float(total(1, 1) + total(1, 0)); }
+};
+
+/// Reads the cells of a .ot (either format) or .binvox file; returns false on failure.
+bool read_cells(const std::string& fname, EvalOctree& octree)
+{
+    if ( !std::ifstream(fname.c_str()).good() ) {
+        std::cerr << "ERROR: cannot open " << fname << std::endl;
+        return false;
+    }
+    std::string ext = get_file_extension(fname);
+    if ( ext == "ot" ) {
+        if ( !octree.from_file(fname) ) return false;
+    } else if ( ext == "binvox" ) {
+        RunLengthVoxelGrid vg;
+        if ( !vg.read_binvox(fname) ) {
+            std::cerr << "ERROR: cannot read " << fname << std::endl;
+            return false;
         }
+        octree.from_voxel_grid(vg, 0);
+    } else {
+        std::cerr << "ERROR: unsupported file type " << fname << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int octree_max_level(EvalOctree& octree)
+{
+    int max_level = 0;
+    for(EvalOctree::iterator it=octree.begin(); it!=octree.end(); it++)
+    {
+        max_level = std::max(max_level, EvalOctree::compute_level(it->first));
+    }
+    return max_level;
+}
+
+/// The leaves of octree as ranges of the morton codes of level max_level, in morton order.
+void collect_leaves(EvalOctree& octree, int max_level, std::vector<LeafRange>& leaves)
+{
+    leaves.clear();
+    leaves.reserve(octree.num_elements());
+    for(EvalOctree::iterator it=octree.begin(); it!=octree.end(); it++)
+    {
+        LeafRange leaf;
+        leaf.level = EvalOctree::compute_level(it->first);
+        const int shift = 3 * (max_level - leaf.level);
+        const uint64_t code = it->first & ~(EvalOctree::KEY(1) << 3 * leaf.level);
+        leaf.begin = code << shift;
+        leaf.end = (code + 1) << shift;
+        leaf.occupied = it->second != CLASS_EMPTY;
+        leaves.push_back(leaf);
+    }
+    std::sort(leaves.begin(), leaves.end());
+}
+
+/// Compares two octrees by a simultaneous sweep over their leaves in morton
+/// order, so a uniform cell is counted with its full volume without ever
+/// being expanded. Space not covered by an octree counts as empty.
+Evaluation evaluate(EvalOctree& reference, EvalOctree& prediction)
+{
+    Evaluation eval;
+    const int max_level = std::max(octree_max_level(reference), octree_max_level(prediction));
+    std::vector<LeafRange> ref, pr;
+    collect_leaves(reference, max_level, ref);
+    collect_leaves(prediction, max_level, pr);
 
-        if ( reference_ext == "ot" ) {
-        	Octree octree;
-            octree.from_file(reference_file);
-            vg_ref = octree.to_voxel_grid();
-        } else if ( reference_ext == "binvox" ) {
-            vg_ref.read_binvox(reference_file);
+    const uint64_t volume = uint64_t(1) << 3 * max_level;
+    size_t ir = 0, ip = 0;
+    uint64_t pos = 0;
+    while(pos < volume)
+    {
+        while(ir < ref.size() && ref[ir].end <= pos) ir++;
+        while(ip < pr.size() && pr[ip].end <= pos) ip++;
+        const bool in_ref = ir < ref.size() && ref[ir].begin <= pos;
+        const bool in_pr = ip < pr.size() && pr[ip].begin <= pos;
+
+        uint64_t next = volume;
+        if(ir < ref.size()) next = std::min(next, in_ref ? ref[ir].end : ref[ir].begin);
+        if(ip < pr.size()) next = std::min(next, in_pr ? pr[ip].end : pr[ip].begin);
+
+        const int level = std::max(in_ref ? ref[ir].level : 0, in_pr ? pr[ip].level : 0);
+        eval.count(level, in_ref && ref[ir].occupied, in_pr && pr[ip].occupied) += next - pos;
+        pos = next;
+    }
+    eval.valid = true;
+    return eval;
+}
+
+Evaluation evaluate_files(const std::string& prediction, const std::string& reference)
+{
+    EvalOctree octree_pred, octree_ref;
+    if ( !read_cells(prediction, octree_pred) || !read_cells(reference, octree_ref) ) return Evaluation();
+    return evaluate(octree_ref, octree_pred);
+}
+
+void print_details(const Evaluation& eval)
+{
+    std::cout << "precision " << eval.precision() << std::endl;
+    std::cout << "recall " << eval.recall() << std::endl;
+    std::cout << "level true_positive false_positive false_negative true_negative" << std::endl;
+    for(int l=0; l<=EvalOctree::MAX_LEVEL(); l++)
+    {
+        if(!eval.count(l, 0, 0) && !eval.count(l, 0, 1) && !eval.count(l, 1, 0) && !eval.count(l, 1, 1)) continue;
+        std::cout << l << " " << eval.count(l, 1, 1) << " " << eval.count(l, 0, 1) << " "
+                  << eval.count(l, 1, 0) << " " << eval.count(l, 0, 0) << std::endl;
+    }
+}
+
+int evaluate_list()
+{
+    std::vector<std::string> predictions, references;
+    std::ifstream list(list_file.c_str());
+    if ( !list.good() ) {
+        std::cerr << "ERROR: cannot open " << list_file << std::endl;
+        return -1;
+    }
+    std::string line;
+    while ( std::getline(list, line) ) {
+        std::istringstream fields(line);
+        std::string prediction, reference;
+        if ( !(fields >> prediction >> reference) ) continue;
+        predictions.push_back(prediction);
+        references.push_back(reference);
+    }
+
+#ifdef _OPENMP
+    if ( num_threads > 0 ) omp_set_num_threads(num_threads);
+#endif
+    const int num_pairs = predictions.size();
+    std::vector<Evaluation> evals(num_pairs);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(int i=0; i<num_pairs; i++)
+    {
+        evals[i] = evaluate_files(predictions[i], references[i]);
+    }
+
+    std::ofstream output_stream;
+    if ( !output_file.empty() ) output_stream.open(output_file.c_str());
+    std::ostream& csv = output_file.empty() ? std::cout : output_stream;
+    csv << "prediction,reference,iou,precision,recall,true_positive,false_positive,false_negative" << std::endl;
+    int num_failed = 0;
+    for(int i=0; i<num_pairs; i++)
+    {
+        csv << predictions[i] << "," << references[i] << ",";
+        if ( !evals[i].valid ) {
+            csv << "nan,nan,nan,0,0,0" << std::endl;
+            num_failed++;
+            continue;
         }
+        csv << evals[i].iou() << "," << evals[i].precision() << "," << evals[i].recall() << ","
+            << evals[i].total(1, 1) << "," << evals[i].total(0, 1) << "," << evals[i].total(1, 0) << std::endl;
+    }
+    if ( num_failed ) std::cerr << num_failed << " of " << num_pairs << " pairs could not be evaluated" << std::endl;
+    return num_failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    int ret = register_cmd_options(argc, argv);
+    if ( ret ) return ret > 0 ? 0 : ret;
 
-        std::cout << iou(vg_ref, vg_pred) << std::endl;
+    if ( !list_file.empty() ) return evaluate_list();
 
-        return 0;
-	}
-}
\ No newline at end of file
+    Evaluation eval = evaluate_files(prediction_file, reference_file);
+    if ( !eval.valid ) return 1;
+
+    std::cout << eval.iou() << std::endl;
+    if ( verbose ) print_details(eval);
+    return 0;
+}